@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Time svn-fe end to end on a synthetic dump, with bench/mock-fast-import
+# answering the backchannel in place of git fast-import.
+#
+# usage: bench/e2e.sh [gen-dump.pl options...]
+#
+# Prints "<key> <value>" lines: revisions, seconds, revisions/s, MB/s
+# of dump input and backchannel requests per revision.
+#
+# With E2E_MODE=no-backchannel, svn-fe --no-backchannel writes the
+# stream to a file instead, and the sizes of the stream and of its
+# blob store are printed for comparison with the importer's store.
+#
+# Licensed under a two-clause BSD-style license.
+# See LICENSE for details.
+
+set -e
+BENCH=$(cd "$(dirname "$0")" && pwd)
+SVN_FE=${SVN_FE:-$BENCH/../contrib/svn-fe/svn-fe}
+TMP=${TMPDIR:-/tmp}/svn-fe-e2e.$$
+trap 'rm -rf "$TMP"' EXIT
+mkdir "$TMP"
+
+perl "$BENCH/gen-dump.pl" "$@" >"$TMP/dump"
+size=$(wc -c <"$TMP/dump")
+
+if test "$E2E_MODE" = no-backchannel
+then
+	start=$(date +%s.%N)
+	"$SVN_FE" --no-backchannel $SVN_FE_OPTS <"$TMP/dump" \
+		>"$TMP/stream" 2>"$TMP/stats"
+	end=$(date +%s.%N)
+	commits=$(grep -ac '^progress Imported commit' "$TMP/stream")
+	stream=$(wc -c <"$TMP/stream")
+	awk -v start="$start" -v end="$end" -v size="$size" \
+	    -v commits="$commits" -v stream="$stream" '
+		/^Blob store:/ { store = $3 }
+		END {
+			secs = end - start
+			printf "revisions %d\n", commits
+			printf "seconds %.3f\n", secs
+			printf "revisions/s %.1f\n", commits / secs
+			printf "MB/s %.2f\n", size / secs / 1e6
+			printf "stream_MB %.2f\n", stream / 1e6
+			printf "blob_store_MB %.2f\n", store / 1e6
+		}' "$TMP/stats"
+	exit 0
+fi
+
+mkfifo "$TMP/backchannel"
+
+start=$(date +%s.%N)
+"$SVN_FE" $SVN_FE_OPTS <"$TMP/dump" 3<"$TMP/backchannel" |
+	"$BENCH/mock-fast-import" 3>"$TMP/backchannel" 2>"$TMP/stats"
+end=$(date +%s.%N)
+
+awk -v start="$start" -v end="$end" -v size="$size" '
+	{ stat[$1] = $2 }
+	END {
+		secs = end - start
+		requests = stat["ls"] + stat["ls_rev"] + stat["cat_blob"]
+		printf "revisions %d\n", stat["commits"]
+		printf "seconds %.3f\n", secs
+		printf "revisions/s %.1f\n", stat["commits"] / secs
+		printf "MB/s %.2f\n", size / secs / 1e6
+		printf "ls/revision %.2f\n", stat["ls"] / stat["commits"]
+		printf "ls_rev/revision %.2f\n", stat["ls_rev"] / stat["commits"]
+		printf "cat_blob/revision %.2f\n", stat["cat_blob"] / stat["commits"]
+		printf "backchannel_waits/revision %.2f\n", requests / stat["commits"]
+		printf "importer_blobs_MB %.2f\n", stat["data_bytes"] / 1e6
+	}' "$TMP/stats"
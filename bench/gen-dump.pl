@@ -0,0 +1,209 @@
+#!/usr/bin/perl
+#
+# Write a synthetic Subversion dump for benchmarking svn-fe.
+#
+# Only file sizes are tracked, so deltas copy from the preimage and
+# insert new bytes without the generator keeping any content.
+#
+# --large-blob=<bytes> ends the dump with two more revisions that add
+# trunk/large.bin and change it by a text delta, to exercise blobs
+# larger than 4 GiB without a real repository to dump them from.
+#
+# Licensed under a two-clause BSD-style license.
+# See LICENSE for details.
+
+use strict;
+use warnings;
+use Getopt::Long;
+
+my %opt = (
+	'revisions' => 1000,
+	'files' => 10,		# files touched per revision
+	'depth' => 3,		# directories between trunk and a file
+	'fanout' => 4,		# subdirectories per directory
+	'delta' => 0.8,		# fraction of changes stored as deltas
+	'copy-every' => 100,	# branch trunk every N revisions (0: never)
+	'blob-size' => 4096,	# mean blob size; sizes are exponential
+	'max-blob-size' => 16 * 1024 * 1024,
+	'seed' => 1,
+	'large-blob' => 0,	# add then delta-change one blob this big
+);
+GetOptions(\%opt, 'revisions=i', 'files=i', 'depth=i', 'fanout=i',
+	'delta=f', 'copy-every=i', 'blob-size=f', 'max-blob-size=f',
+	'seed=i', 'large-blob=f') or die "usage: $0 [--option=value...]\n";
+srand($opt{'seed'});
+binmode STDOUT;
+
+my $WINDOW = 100 * 1024;
+my $CHUNK = 1024 * 1024;
+my $noise = join '', map { chr(int(rand(256))) } 1 .. 65536;
+$noise x= 32;
+
+my %size;	# path -> file size
+my @files;
+my %dirs;
+my $nr_branches = 0;
+
+sub bytes {
+	my ($len) = @_;
+	my $off = int(rand(length($noise) - 65536));
+	return substr($noise, $off, $len) if $len <= 65536;
+	return substr($noise, $off, 65536) . bytes($len - 65536);
+}
+
+sub print_bytes {
+	my ($len) = @_;
+	while ($len > 0) {
+		my $n = $len < $CHUNK ? $len : $CHUNK;
+		print bytes($n);
+		$len -= $n;
+	}
+}
+
+sub blob_size {
+	my $n = int(-log(1 - rand()) * $opt{'blob-size'});
+	return $n < $opt{'max-blob-size'} ? $n : int($opt{'max-blob-size'});
+}
+
+sub props {
+	my (@kv) = @_;
+	my $p = '';
+	while (my ($k, $v) = splice(@kv, 0, 2)) {
+		$p .= 'K ' . length($k) . "\n$k\nV " . length($v) . "\n$v\n";
+	}
+	return $p . "PROPS-END\n";
+}
+
+sub vli {
+	my ($n) = @_;
+	my @digits = ($n & 0x7f);
+	while ($n >>= 7) {
+		unshift @digits, ($n & 0x7f) | 0x80;
+	}
+	return pack('C*', @digits);
+}
+
+sub dir_node {
+	my ($path, $from_rev, $from_path) = @_;
+	print "Node-path: $path\nNode-kind: dir\nNode-action: add\n";
+	print "Node-copyfrom-rev: $from_rev\nNode-copyfrom-path: $from_path\n"
+		if defined $from_rev;
+	print "Prop-content-length: 10\nContent-length: 10\n\nPROPS-END\n\n";
+}
+
+sub add_parents {
+	my ($path) = @_;
+	my @parts = split m{/}, $path;
+	for my $i (1 .. $#parts) {
+		my $dir = join '/', @parts[0 .. $i - 1];
+		next if $dirs{$dir}++;
+		dir_node($dir);
+	}
+}
+
+sub fulltext_node {
+	my ($path, $action, $len) = @_;
+	print "Node-path: $path\nNode-kind: file\nNode-action: $action\n";
+	print "Prop-content-length: 10\n" if $action eq 'add';
+	my $props = $action eq 'add' ? 10 : 0;
+	print "Text-content-length: $len\nContent-length: ",
+		$props + $len, "\n\n";
+	print "PROPS-END\n" if $props;
+	print_bytes($len);
+	print "\n\n";
+}
+
+# Copy three quarters of each source view and insert new bytes for the
+# rest of the window.
+sub delta_node {
+	my ($path, $old_len, $new_len) = @_;
+	my @windows;
+	my $delta_len = 4;
+	for (my $pos = 0; $pos < $new_len || !@windows; $pos += $WINDOW) {
+		my $tlen = $new_len - $pos < $WINDOW ? $new_len - $pos : $WINDOW;
+		my $soff = $pos < $old_len ? $pos : $old_len;
+		my $slen = $old_len - $soff < $WINDOW ? $old_len - $soff : $WINDOW;
+		my $copy = int($tlen * 3 / 4);
+		$copy = $slen if $copy > $slen;
+		my $insns = '';
+		$insns .= chr(0x00) . vli($copy) . vli(0) if $copy;
+		$insns .= chr(0x80) . vli($tlen - $copy) if $tlen > $copy;
+		my $header = vli($soff) . vli($slen) . vli($tlen) .
+			vli(length $insns) . vli($tlen - $copy);
+		push @windows, [$header . $insns, $tlen - $copy];
+		$delta_len += length($header) + length($insns) + $tlen - $copy;
+	}
+	print "Node-path: $path\nNode-kind: file\nNode-action: change\n",
+		"Text-delta: true\nText-content-length: $delta_len\n",
+		"Content-length: $delta_len\n\nSVN\0";
+	for my $w (@windows) {
+		print $w->[0];
+		print_bytes($w->[1]);
+	}
+	print "\n\n";
+}
+
+sub new_path {
+	my @parts = ('trunk');
+	push @parts, 'd' . int(rand($opt{'fanout'})) for 1 .. $opt{'depth'};
+	return join('/', @parts) . '/file' . scalar(@files) . '.c';
+}
+
+print "SVN-fs-dump-format-version: 3\n\n",
+	"UUID: 5a1a3c8e-0e2b-4c1c-9c1b-7b1d6a0c1e42\n\n";
+for my $rev (0 .. $opt{'revisions'}) {
+	my $p = props('svn:log', "Synthetic revision $rev.\n",
+		'svn:author', 'author' . ($rev % 7),
+		'svn:date', sprintf('2010-01-01T00:%02d:%02d.000000Z',
+			int($rev / 60) % 60, $rev % 60));
+	$p = props('svn:date', '2010-01-01T00:00:00.000000Z') if !$rev;
+	print "Revision-number: $rev\nProp-content-length: ", length($p),
+		"\nContent-length: ", length($p), "\n\n$p\n";
+	next if !$rev;
+	if ($rev == 1) {
+		dir_node($_) for qw(trunk branches);
+		$dirs{$_} = 1 for qw(trunk branches);
+	}
+	if ($opt{'copy-every'} && $rev > 1 && $rev % $opt{'copy-every'} == 0) {
+		dir_node('branches/b' . $nr_branches++, $rev - 1, 'trunk');
+	}
+	my %touched;
+	for (1 .. $opt{'files'}) {
+		my $path = @files ? $files[int(rand(@files))] : undef;
+		if (@files < $opt{'files'} || rand() < 0.2 ||
+		    $touched{$path}++) {
+			$path = new_path();
+			$touched{$path} = 1;
+			add_parents($path);
+			push @files, $path;
+			$size{$path} = blob_size();
+			fulltext_node($path, 'add', $size{$path});
+			next;
+		}
+		my $len = blob_size();
+		if (rand() < $opt{'delta'}) {
+			delta_node($path, $size{$path}, $len);
+		} else {
+			fulltext_node($path, 'change', $len);
+		}
+		$size{$path} = $len;
+	}
+}
+if ($opt{'large-blob'}) {
+	my $len = int($opt{'large-blob'});
+	my $path = 'trunk/large.bin';
+	for my $i (1, 2) {
+		my $rev = $opt{'revisions'} + $i;
+		my $p = props('svn:log', "Large blob revision $rev.\n",
+			'svn:author', 'author0',
+			'svn:date', '2010-01-02T00:00:00.000000Z');
+		print "Revision-number: $rev\nProp-content-length: ",
+			length($p), "\nContent-length: ", length($p),
+			"\n\n$p\n";
+		if ($i == 1) {
+			fulltext_node($path, 'add', $len);
+		} else {
+			delta_node($path, $len, $len + 1);
+		}
+	}
+}
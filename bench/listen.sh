@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# Run svn-fe --listen on a synthetic dump, with bench/mock-fast-import
+# in place of git fast-import and bench/replay-client.pl sending the
+# dump one fragment at a time.  One fragment is sent twice, so the
+# daemon has to reject it and carry on.
+#
+# usage: bench/listen.sh [gen-dump.pl options...]
+#
+# Fails unless exactly that fragment is rejected, every revision is
+# imported and the --trace file written meanwhile is valid JSON.
+# Prints "<key> <value>" lines: revisions, seconds and the round-trip
+# percentiles from replay-client.pl.
+#
+# Licensed under a two-clause BSD-style license.
+# See LICENSE for details.
+
+set -e
+BENCH=$(cd "$(dirname "$0")" && pwd)
+SVN_FE=${SVN_FE:-$BENCH/../contrib/svn-fe/svn-fe}
+TMP=${TMPDIR:-/tmp}/svn-fe-listen.$$
+trap 'rm -rf "$TMP"' EXIT
+mkdir "$TMP"
+
+perl "$BENCH/gen-dump.pl" --revisions=200 "$@" >"$TMP/dump"
+revisions=$(grep -ac '^Revision-number: [1-9]' "$TMP/dump")
+mkfifo "$TMP/backchannel"
+
+start=$(date +%s.%N)
+"$SVN_FE" $SVN_FE_OPTS --listen="$TMP/socket" --trace="$TMP/trace.json" \
+	</dev/null 3<"$TMP/backchannel" 2>"$TMP/svn-fe.err" |
+	"$BENCH/mock-fast-import" 3>"$TMP/backchannel" 2>"$TMP/stats" &
+while ! test -S "$TMP/socket"
+do
+	kill -0 $! 2>/dev/null || { cat "$TMP/svn-fe.err" >&2; exit 1; }
+	sleep 0.1
+done
+perl "$BENCH/replay-client.pl" --reject "$TMP/socket" "$TMP/dump" \
+	2>"$TMP/client"
+wait $!
+end=$(date +%s.%N)
+
+rejected=$(grep -c 'warning: fragment rejected' "$TMP/svn-fe.err" || :)
+if test "$rejected" != 1
+then
+	echo "expected one rejected fragment, got $rejected" >&2
+	cat "$TMP/svn-fe.err" >&2
+	exit 1
+fi
+commits=$(sed -n 's/^commits //p' "$TMP/stats")
+if test "$commits" != "$revisions"
+then
+	echo "imported $commits of $revisions revisions" >&2
+	exit 1
+fi
+perl -MJSON::PP -e 'local $/; decode_json(<STDIN>)' <"$TMP/trace.json" ||
+	{ echo "--trace wrote invalid JSON" >&2; exit 1; }
+
+awk -v start="$start" -v end="$end" -v commits="$commits" '
+	/^Fragments:/ {
+		for (i = 1; i < NF; i++)
+			if ($i ~ /^p[0-9]+$/)
+				printf "round_trip_%s_ms %s\n", $i, $(i + 1)
+	}
+	END {
+		printf "revisions %d\n", commits
+		printf "seconds %.3f\n", end - start
+	}' "$TMP/client"
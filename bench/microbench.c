@@ -0,0 +1,515 @@
+/*
+ * Microbenchmarks for the hot paths of svn-fe.
+ *
+ * Each benchmark prints one line to the standard output:
+ *
+ *	<name> <ops> ops <ns> ns/op <bytes> bytes/s <n> allocs/op
+ *
+ * where allocs/op counts calls to malloc, calloc and realloc (the
+ * Makefile links with --wrap for them).  Output written by the code
+ * under test goes to /dev/null.
+ *
+ * usage: bench/microbench [--preimage-size=<n>[k|m|g]] [<name>...]
+ *
+ * runs the named benchmarks, or all of them.  --preimage-size sets
+ * the preimage that svndiff0_apply and move_window slide over (8m by
+ * default), for example to 1g to see how views of a large blob move.
+ *
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "strbuf.h"
+#include "quote.h"
+#include "line_buffer.h"
+#include "sliding_window.h"
+#include "svndiff.h"
+#include "svndump.h"
+
+#define MIN_BENCH_NSEC 500000000
+
+#define NR_LINES 200000
+#define COPY_LEN (16 * 1024 * 1024)
+#define NR_PROP_REVS 5000
+#define PREIMAGE_LEN (8 * 1024 * 1024)
+#define WINDOW_LEN (100 * 1024)
+#define NR_PATHS 4096
+
+static FILE *report;
+static uintmax_t nr_allocs;
+static off_t preimage_len = PREIMAGE_LEN;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	__atomic_fetch_add(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&nr_allocs, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+struct bench {
+	const char *name;
+	void (*setup)(void);
+	/* Runs one round; returns the number of ops and bytes handled. */
+	void (*run)(uintmax_t *ops, uintmax_t *bytes);
+	void (*teardown)(void);
+};
+
+static uintmax_t now_nsec(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		die_errno("clock_gettime");
+	return (uintmax_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_bench(const struct bench *b)
+{
+	uintmax_t start, elapsed, ops = 0, bytes = 0, allocs;
+
+	if (b->setup)
+		b->setup();
+	start = now_nsec();
+	allocs = __atomic_load_n(&nr_allocs, __ATOMIC_RELAXED);
+	do {
+		b->run(&ops, &bytes);
+		elapsed = now_nsec() - start;
+	} while (elapsed < MIN_BENCH_NSEC);
+	allocs = __atomic_load_n(&nr_allocs, __ATOMIC_RELAXED) - allocs;
+	if (b->teardown)
+		b->teardown();
+
+	fprintf(report, "%s %"PRIuMAX" ops %.1f ns/op %.0f bytes/s "
+		"%.2f allocs/op\n",
+		b->name, ops, (double) elapsed / ops,
+		(double) bytes * 1e9 / elapsed, (double) allocs / ops);
+	fflush(report);
+}
+
+static struct line_buffer scratch = LINE_BUFFER_INIT;
+static struct line_buffer scratch2 = LINE_BUFFER_INIT;
+static off_t scratch_len;
+
+static void scratch_init(struct line_buffer *buf)
+{
+	if (buffer_tmpfile_init(buf))
+		die_errno("cannot create temporary file");
+}
+
+static void scratch_release(struct line_buffer *buf)
+{
+	if (buffer_deinit(buf))
+		die("error closing temporary file");
+}
+
+static void fill_random(FILE *out, off_t len)
+{
+	uint32_t x = 2463534242u;
+	for (; len > 0; len--) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		fputc(' ' + x % 95, out);
+	}
+}
+
+/* buffer_read_line */
+
+static void setup_read_line(void)
+{
+	FILE *out;
+	int i;
+
+	scratch_init(&scratch);
+	out = buffer_tmpfile_rewind(&scratch);
+	for (i = 0; i < NR_LINES; i++)
+		fprintf(out, "Node-path: trunk/project/src/module%d/file%d.c\n",
+			i % 97, i);
+	scratch_len = buffer_tmpfile_prepare_to_read(&scratch);
+}
+
+static void run_read_line(uintmax_t *ops, uintmax_t *bytes)
+{
+	if (fseeko(scratch.infile, 0, SEEK_SET))
+		die_errno("seek error");
+	while (buffer_read_line(&scratch))
+		++*ops;
+	*bytes += scratch_len;
+}
+
+static void teardown_scratch(void)
+{
+	scratch_release(&scratch);
+}
+
+/* buffer_copy_bytes */
+
+static void setup_copy_bytes(void)
+{
+	scratch_init(&scratch);
+	fill_random(buffer_tmpfile_rewind(&scratch), COPY_LEN);
+	scratch_len = buffer_tmpfile_prepare_to_read(&scratch);
+}
+
+static void run_copy_bytes(uintmax_t *ops, uintmax_t *bytes)
+{
+	if (fseeko(scratch.infile, 0, SEEK_SET))
+		die_errno("seek error");
+	if (buffer_copy_bytes(&scratch, scratch_len) != scratch_len)
+		die("short copy");
+	++*ops;
+	*bytes += scratch_len;
+}
+
+/* buffer_tmpfile_send_bytes, on the same file */
+
+static void run_send_bytes(uintmax_t *ops, uintmax_t *bytes)
+{
+	if (fseeko(scratch.infile, 0, SEEK_SET))
+		die_errno("seek error");
+	if (buffer_tmpfile_send_bytes(&scratch, scratch_len) != scratch_len)
+		die("short copy");
+	++*ops;
+	*bytes += scratch_len;
+}
+
+/* read_props, through svndump_read() on revisions with properties only */
+
+static char props_dump[] = "/tmp/svn-fe-bench-XXXXXX";
+
+static void add_prop(struct strbuf *sb, const char *key, const char *val)
+{
+	char hdr[64];
+	snprintf(hdr, sizeof(hdr), "K %d\n", (int) strlen(key));
+	strbuf_addstr(sb, hdr);
+	strbuf_addstr(sb, key);
+	snprintf(hdr, sizeof(hdr), "\nV %d\n", (int) strlen(val));
+	strbuf_addstr(sb, hdr);
+	strbuf_addstr(sb, val);
+	strbuf_addch(sb, '\n');
+}
+
+static void write_record(FILE *out, const char *headers, struct strbuf *props)
+{
+	strbuf_addstr(props, "PROPS-END\n");
+	fprintf(out, "%sProp-content-length: %d\nContent-length: %d\n\n",
+		headers, (int) props->len, (int) props->len);
+	fwrite(props->buf, 1, props->len, out);
+	fputc('\n', out);
+	strbuf_reset(props);
+}
+
+static void setup_props(void)
+{
+	struct strbuf props = STRBUF_INIT;
+	struct strbuf mergeinfo = STRBUF_INIT;
+	char headers[128];
+	int fd, rev;
+	FILE *out;
+
+	fd = mkstemp(props_dump);
+	if (fd < 0 || !(out = fdopen(fd, "w")))
+		die_errno("cannot create %s", props_dump);
+	for (rev = 0; rev < 40; rev++) {
+		snprintf(headers, sizeof(headers),
+			 "/branches/feature%d:1-%d\n", rev, rev * 13 + 7);
+		strbuf_addstr(&mergeinfo, headers);
+	}
+	fprintf(out, "SVN-fs-dump-format-version: 3\n\n"
+		"UUID: 3bd6fa69-4b2d-4852-8da1-81cb0f847b4a\n\n");
+	for (rev = 0; rev < NR_PROP_REVS; rev++) {
+		snprintf(headers, sizeof(headers),
+			 "Revision-number: %d\n", rev);
+		add_prop(&props, "svn:log", "Merge the latest changes from "
+			 "trunk into the release branch.\n\nReviewed-by: nobody");
+		add_prop(&props, "svn:author", "someone");
+		add_prop(&props, "svn:date", "2010-03-22T11:03:45.284750Z");
+		write_record(out, headers, &props);
+
+		snprintf(headers, sizeof(headers), "Node-path: branches/b%d\n"
+			 "Node-kind: dir\nNode-action: add\n", rev);
+		add_prop(&props, "svn:ignore", "*.o\n*.a\n*.so\nbuild\n");
+		add_prop(&props, "svn:mergeinfo", mergeinfo.buf);
+		write_record(out, headers, &props);
+	}
+	if (fclose(out))
+		die_errno("cannot write %s", props_dump);
+	strbuf_release(&props);
+	strbuf_release(&mergeinfo);
+}
+
+static void run_props(uintmax_t *ops, uintmax_t *bytes)
+{
+	static struct svndump dump;
+	struct stat st;
+	/* No node asks fast-import anything. */
+	int report_fd = open("/dev/null", O_RDONLY);
+
+	if (report_fd < 0)
+		die_errno("cannot open /dev/null");
+	if (svndump_init(&dump, props_dump, stdout, report_fd))
+		die("cannot read %s", props_dump);
+	svndump_read(&dump, NULL);
+	svndump_deinit(&dump);
+	svndump_reset(&dump);
+	if (stat(props_dump, &st))
+		die_errno("cannot stat %s", props_dump);
+	*ops += NR_PROP_REVS;
+	*bytes += st.st_size;
+}
+
+static void teardown_props(void)
+{
+	unlink(props_dump);
+}
+
+/* svndiff0_apply */
+
+static void put_int(struct strbuf *sb, uintmax_t val)
+{
+	unsigned char digits[sizeof(val) * 8 / 7 + 1];
+	size_t n = 0;
+
+	do {
+		digits[n++] = val & 0x7f;
+		val >>= 7;
+	} while (val);
+	while (n > 1)
+		strbuf_addch(sb, digits[--n] | 0x80);
+	strbuf_addch(sb, digits[0]);
+}
+
+/*
+ * Each window copies most of its source view in 1 KiB pieces,
+ * interleaved with short runs of new data and of repeated output.
+ */
+static void write_window(FILE *out, off_t off, size_t len)
+{
+	struct strbuf insns = STRBUF_INIT;
+	struct strbuf data = STRBUF_INIT;
+	struct strbuf header = STRBUF_INIT;
+	size_t pos, out_len = 0;
+
+	for (pos = 0; pos + 1024 <= len; pos += 1024) {
+		strbuf_addch(&insns, 0x00);	/* copyfrom_source */
+		put_int(&insns, 1000);
+		put_int(&insns, pos);
+		strbuf_addch(&insns, 0x80 | 16);	/* copyfrom_data */
+		strbuf_add(&data, "0123456789abcdef", 16);
+		strbuf_addch(&insns, 0x40 | 8);	/* copyfrom_target */
+		put_int(&insns, out_len);
+		out_len += 1000 + 16 + 8;
+	}
+	put_int(&header, off);
+	put_int(&header, len);
+	put_int(&header, out_len);
+	put_int(&header, insns.len);
+	put_int(&header, data.len);
+	fwrite(header.buf, 1, header.len, out);
+	fwrite(insns.buf, 1, insns.len, out);
+	fwrite(data.buf, 1, data.len, out);
+	strbuf_release(&insns);
+	strbuf_release(&data);
+	strbuf_release(&header);
+}
+
+static off_t delta_len;
+static FILE *postimage;
+
+static void setup_svndiff(void)
+{
+	FILE *out;
+	off_t off;
+
+	scratch_init(&scratch);
+	fill_random(buffer_tmpfile_rewind(&scratch), preimage_len);
+	scratch_len = buffer_tmpfile_prepare_to_read(&scratch);
+
+	scratch_init(&scratch2);
+	out = buffer_tmpfile_rewind(&scratch2);
+	fwrite("SVN\0", 1, 4, out);
+	for (off = 0; off < preimage_len; off += WINDOW_LEN)
+		write_window(out, off, preimage_len - off < WINDOW_LEN ?
+				       preimage_len - off : WINDOW_LEN);
+	delta_len = buffer_tmpfile_prepare_to_read(&scratch2);
+
+	postimage = fopen("/dev/null", "w");
+	if (!postimage)
+		die_errno("cannot open /dev/null");
+}
+
+static void run_svndiff(uintmax_t *ops, uintmax_t *bytes)
+{
+	static struct strbuf preimage_buf = STRBUF_INIT;
+	struct sliding_view preimage = SLIDING_VIEW_INIT(&scratch, scratch_len);
+
+	strbuf_swap(&preimage.buf, &preimage_buf);
+
+	if (fseeko(scratch.infile, 0, SEEK_SET) ||
+	    fseeko(scratch2.infile, 0, SEEK_SET))
+		die_errno("seek error");
+	if (svndiff0_apply(&scratch2, delta_len, &preimage, postimage))
+		die("cannot apply delta");
+	strbuf_swap(&preimage.buf, &preimage_buf);
+	strbuf_recycle(&preimage_buf, SLIDING_VIEW_KEEP_MAX);
+	++*ops;
+	*bytes += delta_len;
+}
+
+static void teardown_svndiff(void)
+{
+	fclose(postimage);
+	scratch_release(&scratch);
+	scratch_release(&scratch2);
+}
+
+/* move_window */
+
+static void run_move_window(uintmax_t *ops, uintmax_t *bytes)
+{
+	struct sliding_view view = SLIDING_VIEW_INIT(&scratch, scratch_len);
+	off_t off;
+
+	if (fseeko(scratch.infile, 0, SEEK_SET))
+		die_errno("seek error");
+	/* Source views of successive windows overlap by half. */
+	for (off = 0; off + WINDOW_LEN <= preimage_len; off += WINDOW_LEN / 2) {
+		if (move_window(&view, off, WINDOW_LEN))
+			die("cannot move window");
+		++*ops;
+	}
+	strbuf_release(&view.buf);
+	*bytes += preimage_len;
+}
+
+static void setup_move_window(void)
+{
+	scratch_init(&scratch);
+	fill_random(buffer_tmpfile_rewind(&scratch), preimage_len);
+	scratch_len = buffer_tmpfile_prepare_to_read(&scratch);
+}
+
+/* quote_c_style */
+
+static char *paths[NR_PATHS];
+static FILE *devnull_out;
+
+static void setup_quote(void)
+{
+	static const char *const dirs[] = {
+		"trunk", "branches/release-1.x", "tags/v2.0",
+		"trunk/My Documents", "trunk/\xc3\xbc" "bersicht",
+	};
+	char path[256];
+	int i;
+
+	for (i = 0; i < NR_PATHS; i++) {
+		snprintf(path, sizeof(path), "%s/src/module%d/%s%d.c",
+			 dirs[i % 5], i % 31,
+			 i % 17 ? "file" : "tab\there", i);
+		paths[i] = strdup(path);
+	}
+	devnull_out = fopen("/dev/null", "w");
+	if (!devnull_out)
+		die_errno("cannot open /dev/null");
+}
+
+static void run_quote(uintmax_t *ops, uintmax_t *bytes)
+{
+	int i;
+	for (i = 0; i < NR_PATHS; i++) {
+		quote_c_style(paths[i], NULL, devnull_out, 0);
+		*bytes += strlen(paths[i]);
+	}
+	*ops += NR_PATHS;
+}
+
+static void teardown_quote(void)
+{
+	int i;
+	for (i = 0; i < NR_PATHS; i++)
+		free(paths[i]);
+	fclose(devnull_out);
+}
+
+static const struct bench benchmarks[] = {
+	{ "buffer_read_line", setup_read_line, run_read_line, teardown_scratch },
+	{ "buffer_copy_bytes", setup_copy_bytes, run_copy_bytes, teardown_scratch },
+	{ "buffer_tmpfile_send_bytes", setup_copy_bytes, run_send_bytes,
+	  teardown_scratch },
+	{ "read_props", setup_props, run_props, teardown_props },
+	{ "svndiff0_apply", setup_svndiff, run_svndiff, teardown_svndiff },
+	{ "move_window", setup_move_window, run_move_window, teardown_scratch },
+	{ "quote_c_style", setup_quote, run_quote, teardown_quote },
+};
+
+static off_t parse_size(const char *arg)
+{
+	const char *p = arg;
+	char *end;
+	uintmax_t n;
+	int shift = 0;
+
+	errno = 0;
+	if (*p == '-' || !(n = strtoumax(p, &end, 10)) || errno)
+		die("invalid size: %s", arg);
+	switch (*end) {
+	case 'k': shift = 10; end++; break;
+	case 'm': shift = 20; end++; break;
+	case 'g': shift = 30; end++; break;
+	}
+	if (*end ||
+	    n > (uintmax_t) maximum_signed_value_of_type(off_t) >> shift)
+		die("invalid size: %s", arg);
+	return n << shift;
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	int fd, first = 1;
+
+	/* Keep the report; send everything else on stdout to /dev/null. */
+	fd = dup(1);
+	if (fd < 0 || !(report = fdopen(fd, "w")))
+		die_errno("cannot duplicate standard output");
+	if (!freopen("/dev/null", "w", stdout))
+		die_errno("cannot open /dev/null");
+
+	if (argc > 1 && !strncmp(argv[1], "--preimage-size=",
+				 strlen("--preimage-size="))) {
+		preimage_len = parse_size(argv[1] + strlen("--preimage-size="));
+		first = 2;
+	}
+	for (i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+		int j;
+		if (argc > first) {
+			for (j = first; j < argc; j++)
+				if (!strcmp(argv[j], benchmarks[i].name))
+					break;
+			if (j == argc)
+				continue;
+		}
+		run_bench(&benchmarks[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,477 @@
+/*
+ * A stand-in for "git fast-import --cat-blob-fd=3" that keeps just
+ * enough of a model of the stream to answer svn-fe's "ls", "cat-blob"
+ * and "get-mark" requests, so conversions can be timed offline.
+ *
+ * Trees are shared between commits and copied on first write within
+ * a commit.  Blob contents go to a temporary file.  Object names are
+ * sequence numbers printed as 40 hex digits; a commit mark is named
+ * after its root tree.
+ *
+ * At the end of input a summary is written to the standard error:
+ *
+ *	<key> <value>
+ *
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include <time.h>
+#include "strbuf.h"
+#include "line_buffer.h"
+
+#define REPORT_FILENO 3
+#define MODE_TREE 0040000
+
+struct entry {
+	char *name;
+	uint32_t mode;
+	uint32_t obj;
+};
+
+struct tree {
+	uint32_t gen;	/* commit that may still modify it in place */
+	size_t nr, alloc;
+	struct entry *entries;
+};
+
+struct object {
+	struct tree *tree;	/* NULL for blobs */
+	off_t off, len;
+};
+
+static struct object *objects;
+static size_t nr_objects, objects_alloc;
+
+static uint32_t *marks;	/* mark -> root tree object, 0 if unused */
+static size_t nr_marks, marks_alloc;
+
+static uint32_t gen = 1;
+static uint32_t root, tip;
+static int in_commit;
+static uintmax_t active_mark;
+
+static struct line_buffer input = LINE_BUFFER_INIT;
+static FILE *blobs;
+static off_t blobs_len;
+static FILE *backchannel;
+
+static uintmax_t nr_commits, nr_ls, nr_ls_rev, nr_cat_blob,
+	nr_checkpoints, data_bytes;
+
+static uint32_t new_object(struct tree *tree, off_t off, off_t len)
+{
+	ALLOC_GROW(objects, nr_objects + 1, objects_alloc);
+	objects[nr_objects].tree = tree;
+	objects[nr_objects].off = off;
+	objects[nr_objects].len = len;
+	return nr_objects++;
+}
+
+static uint32_t new_tree(const struct tree *from)
+{
+	struct tree *t = calloc(1, sizeof(*t));
+	size_t i;
+
+	if (!t)
+		die_errno("cannot allocate tree");
+	t->gen = gen;
+	if (from) {
+		ALLOC_GROW(t->entries, from->nr, t->alloc);
+		for (i = 0; i < from->nr; i++) {
+			t->entries[i] = from->entries[i];
+			t->entries[i].name = strdup(from->entries[i].name);
+		}
+		t->nr = from->nr;
+	}
+	return new_object(t, 0, 0);
+}
+
+static struct tree *tree_of(uint32_t obj)
+{
+	if (obj >= nr_objects || !objects[obj].tree)
+		die("not a tree: %"PRIu32, obj);
+	return objects[obj].tree;
+}
+
+/* Returns the index where name is or should be inserted. */
+static size_t find_entry(const struct tree *t, const char *name,
+			size_t len, int *found)
+{
+	size_t lo = 0, hi = t->nr;
+
+	while (lo < hi) {
+		size_t mi = lo + (hi - lo) / 2;
+		int cmp = strncmp(t->entries[mi].name, name, len);
+		if (!cmp)
+			cmp = t->entries[mi].name[len] ? 1 : 0;
+		if (!cmp) {
+			*found = 1;
+			return mi;
+		}
+		if (cmp < 0)
+			lo = mi + 1;
+		else
+			hi = mi;
+	}
+	*found = 0;
+	return lo;
+}
+
+static uint32_t writable(uint32_t obj)
+{
+	if (tree_of(obj)->gen == gen)
+		return obj;
+	return new_tree(tree_of(obj));
+}
+
+/* Returns the new tree, or UINT32_MAX if it became empty. */
+static uint32_t tree_update(uint32_t obj, const char *path,
+			uint32_t mode, uint32_t target, int remove)
+{
+	const char *slash = strchr(path, '/');
+	size_t len = slash ? (size_t) (slash - path) : strlen(path);
+	struct tree *t;
+	size_t pos;
+	int found;
+
+	obj = writable(obj);
+	t = tree_of(obj);
+	pos = find_entry(t, path, len, &found);
+	if (slash) {
+		uint32_t child;
+		if (found && t->entries[pos].mode == MODE_TREE)
+			child = t->entries[pos].obj;
+		else if (remove)
+			return obj;
+		else
+			child = new_tree(NULL);
+		target = tree_update(child, slash + 1, mode, target, remove);
+		mode = MODE_TREE;
+		t = tree_of(obj);	/* objects may have moved */
+		remove = target == UINT32_MAX;
+	}
+	if (remove) {
+		if (found) {
+			free(t->entries[pos].name);
+			memmove(t->entries + pos, t->entries + pos + 1,
+				(t->nr - pos - 1) * sizeof(*t->entries));
+			t->nr--;
+		}
+		return t->nr ? obj : UINT32_MAX;
+	}
+	if (!found) {
+		ALLOC_GROW(t->entries, t->nr + 1, t->alloc);
+		memmove(t->entries + pos + 1, t->entries + pos,
+			(t->nr - pos) * sizeof(*t->entries));
+		t->entries[pos].name = malloc(len + 1);
+		memcpy(t->entries[pos].name, path, len);
+		t->entries[pos].name[len] = '\0';
+		t->nr++;
+	}
+	t->entries[pos].mode = mode;
+	t->entries[pos].obj = target;
+	return obj;
+}
+
+static void set_path(const char *path, uint32_t mode, uint32_t obj)
+{
+	if (!*path) {
+		root = obj;
+		return;
+	}
+	root = tree_update(root, path, mode, obj, 0);
+}
+
+static void delete_path(const char *path)
+{
+	if (!*path) {
+		root = new_tree(NULL);
+		return;
+	}
+	root = tree_update(root, path, 0, 0, 1);
+	if (root == UINT32_MAX)
+		root = new_tree(NULL);
+}
+
+static const struct entry *lookup(uint32_t obj, const char *path)
+{
+	static struct entry top;
+
+	top.mode = MODE_TREE;
+	top.obj = obj;
+	while (*path) {
+		const char *slash = strchr(path, '/');
+		size_t len = slash ? (size_t) (slash - path) : strlen(path);
+		const struct tree *t = tree_of(top.obj);
+		size_t pos;
+		int found;
+
+		pos = find_entry(t, path, len, &found);
+		if (!found)
+			return NULL;
+		if (!slash)
+			return &t->entries[pos];
+		if (t->entries[pos].mode != MODE_TREE)
+			return NULL;
+		top = t->entries[pos];
+		path = slash + 1;
+	}
+	return &top;
+}
+
+/* Undo quote_c_style(); returns a pointer past the closing quote. */
+static const char *unquote(const char *p, struct strbuf *out)
+{
+	strbuf_reset(out);
+	if (*p != '"') {
+		strbuf_addstr(out, p);
+		return p + strlen(p);
+	}
+	for (p++; *p && *p != '"'; p++) {
+		int ch = *p;
+		if (ch == '\\') {
+			ch = *++p;
+			switch (ch) {
+			case 'a': ch = '\a'; break;
+			case 'b': ch = '\b'; break;
+			case 't': ch = '\t'; break;
+			case 'n': ch = '\n'; break;
+			case 'v': ch = '\v'; break;
+			case 'f': ch = '\f'; break;
+			case 'r': ch = '\r'; break;
+			case '0': case '1': case '2': case '3':
+				ch = ((p[0] - '0') << 6) | ((p[1] - '0') << 3) |
+					(p[2] - '0');
+				p += 2;
+				break;
+			}
+		}
+		strbuf_addch(out, ch);
+	}
+	return *p ? p + 1 : p;
+}
+
+static uint32_t parse_object_name(const char *name)
+{
+	char *end;
+	uintmax_t obj = strtoumax(name, &end, 16);
+	if (end - name != 40 || obj >= nr_objects)
+		die("unknown object: %s", name);
+	return obj;
+}
+
+static void read_data(const char *line, int keep)
+{
+	uintmax_t len = strtoumax(line + strlen("data "), NULL, 10);
+	static struct strbuf chunk = STRBUF_INIT;
+	uintmax_t done;
+
+	for (done = 0; done < len; done += chunk.len) {
+		size_t n = len - done < 65536 ? len - done : 65536;
+		strbuf_reset(&chunk);
+		if (buffer_read_binary(&input, &chunk, n) != n)
+			die("unexpected end of data");
+		if (keep)
+			fwrite(chunk.buf, 1, chunk.len, blobs);
+	}
+	data_bytes += len;
+	if (keep) {
+		new_object(NULL, blobs_len, len);
+		blobs_len += len;
+	}
+}
+
+static void finish_commit(void)
+{
+	if (!in_commit)
+		return;
+	if (active_mark) {
+		if (active_mark >= UINT32_MAX)
+			die("mark too large: %"PRIuMAX, active_mark);
+		ALLOC_GROW(marks, active_mark + 1, marks_alloc);
+		for (; nr_marks <= active_mark; nr_marks++)
+			marks[nr_marks] = 0;
+		marks[active_mark] = root;
+	}
+	tip = root;
+	in_commit = 0;
+	active_mark = 0;
+	gen++;
+	nr_commits++;
+}
+
+static void print_entry(const struct entry *e, const char *path)
+{
+	if (!e) {
+		fprintf(backchannel, "missing %s\n", path);
+		return;
+	}
+	fprintf(backchannel, "%06"PRIo32" %s %040"PRIx32"\t%s\n", e->mode,
+		e->mode == MODE_TREE ? "tree" : "blob", e->obj, path);
+}
+
+static void do_ls(const char *arg)
+{
+	static struct strbuf path = STRBUF_INIT;
+	uint32_t tree = root;
+
+	if (*arg == ':') {
+		char *end;
+		uintmax_t mark = strtoumax(arg + 1, &end, 10);
+		if (mark >= nr_marks || !marks[mark])
+			die("unknown mark: %s", arg);
+		tree = marks[mark];
+		arg = end + 1;
+		nr_ls_rev++;
+	} else {
+		nr_ls++;
+	}
+	unquote(arg, &path);
+	print_entry(lookup(tree, path.buf), path.buf);
+	fflush(backchannel);
+}
+
+static void do_cat_blob(const char *name)
+{
+	static struct strbuf buf = STRBUF_INIT;
+	const struct object *o = &objects[parse_object_name(name)];
+	off_t done;
+
+	if (o->tree)
+		die("not a blob: %s", name);
+	fprintf(backchannel, "%040"PRIx32" blob %"PRIuMAX"\n",
+		(uint32_t) (o - objects), (uintmax_t) o->len);
+	fflush(blobs);
+	for (done = 0; done < o->len; done += buf.len) {
+		size_t n = o->len - done < 65536 ? o->len - done : 65536;
+		strbuf_reset(&buf);
+		if (fseeko(blobs, o->off + done, SEEK_SET) ||
+		    strbuf_fread(&buf, n, blobs) != n)
+			die_errno("cannot read blob store");
+		fwrite(buf.buf, 1, buf.len, backchannel);
+	}
+	fputc('\n', backchannel);
+	fflush(backchannel);
+	if (fseeko(blobs, 0, SEEK_END))
+		die_errno("cannot seek in blob store");
+	nr_cat_blob++;
+}
+
+static void do_get_mark(const char *arg)
+{
+	uintmax_t mark;
+
+	if (*arg != ':')
+		die("invalid get-mark: %s", arg);
+	mark = strtoumax(arg + 1, NULL, 10);
+	if (mark >= nr_marks || !marks[mark])
+		die("unknown mark: %s", arg);
+	fprintf(backchannel, "%040"PRIx32"\n", marks[mark]);
+	fflush(backchannel);
+}
+
+static void do_modify(const char *arg)
+{
+	static struct strbuf path = STRBUF_INIT;
+	uint32_t mode = strtoul(arg, (char **) &arg, 8);
+	const char *ref = arg + 1;
+	const char *sp = strchr(ref, ' ');
+	uint32_t obj;
+
+	if (!sp)
+		die("invalid M command");
+	unquote(sp + 1, &path);
+	if (!strncmp(ref, "inline ", strlen("inline "))) {
+		const char *line;
+		/* Like fast-import, answer requests before the data. */
+		while ((line = buffer_read_line(&input))) {
+			if (!strncmp(line, "cat-blob ", strlen("cat-blob ")))
+				do_cat_blob(line + strlen("cat-blob "));
+			else if (!strncmp(line, "ls ", strlen("ls ")))
+				do_ls(line + strlen("ls "));
+			else
+				break;
+		}
+		if (!line || strncmp(line, "data ", strlen("data ")))
+			die("expected data after M inline");
+		read_data(line, 1);
+		obj = nr_objects - 1;
+	} else {
+		obj = parse_object_name(ref);
+	}
+	set_path(path.buf, mode, obj);
+}
+
+static void do_delete(const char *arg)
+{
+	static struct strbuf path = STRBUF_INIT;
+	unquote(arg, &path);
+	delete_path(path.buf);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	const char *t;
+	double start = now(), elapsed;
+
+	if (buffer_init(&input, NULL))
+		die_errno("cannot read standard input");
+	if (!(backchannel = fdopen(REPORT_FILENO, "w")))
+		die_errno("cannot write to file descriptor %d", REPORT_FILENO);
+	if (!(blobs = tmpfile()))
+		die_errno("cannot create blob store");
+	new_object(NULL, 0, 0);	/* so no mark refers to object 0 */
+	tip = root = new_tree(NULL);
+
+	while ((t = buffer_read_line(&input))) {
+		if (!strncmp(t, "M ", 2)) {
+			do_modify(t + 2);
+		} else if (!strncmp(t, "D ", 2)) {
+			do_delete(t + 2);
+		} else if (!strncmp(t, "ls ", 3)) {
+			do_ls(t + 3);
+		} else if (!strncmp(t, "cat-blob ", strlen("cat-blob "))) {
+			do_cat_blob(t + strlen("cat-blob "));
+		} else if (!strncmp(t, "commit ", strlen("commit "))) {
+			finish_commit();
+			root = tip;
+			in_commit = 1;
+		} else if (!strncmp(t, "mark :", strlen("mark :"))) {
+			active_mark = strtoumax(t + strlen("mark :"), NULL, 10);
+		} else if (!strncmp(t, "from :", strlen("from :"))) {
+			uintmax_t mark = strtoumax(t + strlen("from :"), NULL, 10);
+			if (mark < nr_marks && marks[mark])
+				root = marks[mark];
+		} else if (!strncmp(t, "data ", strlen("data "))) {
+			read_data(t, 0);
+		} else if (!strncmp(t, "progress ", strlen("progress "))) {
+			finish_commit();
+		} else if (!strncmp(t, "get-mark ", strlen("get-mark "))) {
+			finish_commit();
+			do_get_mark(t + strlen("get-mark "));
+		} else if (!strcmp(t, "checkpoint")) {
+			finish_commit();
+			nr_checkpoints++;
+		}
+	}
+	finish_commit();
+	elapsed = now() - start;
+
+	fprintf(stderr, "commits %"PRIuMAX"\n", nr_commits);
+	fprintf(stderr, "seconds %.3f\n", elapsed);
+	fprintf(stderr, "data_bytes %"PRIuMAX"\n", data_bytes);
+	fprintf(stderr, "ls %"PRIuMAX"\n", nr_ls);
+	fprintf(stderr, "ls_rev %"PRIuMAX"\n", nr_ls_rev);
+	fprintf(stderr, "cat_blob %"PRIuMAX"\n", nr_cat_blob);
+	fprintf(stderr, "checkpoints %"PRIuMAX"\n", nr_checkpoints);
+	return 0;
+}
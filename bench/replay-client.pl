@@ -0,0 +1,108 @@
+#!/usr/bin/perl
+#
+# Stand in for an svnsync post-commit hook: replay a dump to
+# "svn-fe --listen=<socket>" one fragment at a time, each with the
+# dump's own header, as "svnadmin dump --incremental" would send it.
+#
+# usage: bench/replay-client.pl [--batch=<n>] [--keep-running] [--reject]
+#	<socket> <dump>
+#
+# Each connection carries <n> revisions (default 1) and waits for the
+# "ok" that svn-fe sends once the importer has checkpointed them.
+# With --reject, the first fragment is sent a second time, and must be
+# answered "error" because it no longer follows what was imported.
+# Unless --keep-running is given, an empty connection then shuts the
+# daemon down.  Round-trip percentiles are printed to stderr.
+#
+# Licensed under a two-clause BSD-style license.
+# See LICENSE for details.
+
+use strict;
+use warnings;
+use Getopt::Long;
+use IO::Socket::UNIX;
+use Socket qw(SOCK_STREAM);
+use Time::HiRes qw(time);
+
+my $batch = 1;
+my $keep_running = 0;
+my $reject = 0;
+my $usage = "usage: $0 [--batch=<n>] [--keep-running] [--reject] " .
+	"<socket> <dump>\n";
+GetOptions('batch=i' => \$batch, 'keep-running' => \$keep_running,
+	   'reject' => \$reject)
+	or die $usage;
+@ARGV == 2 or die $usage;
+my ($socket, $dump) = @ARGV;
+
+open my $in, '<:raw', $dump or die "cannot open $dump: $!\n";
+
+# Read one record: header lines up to a blank line, then the content
+# announced by Content-length.  Returns (text, revision or undef).
+sub read_record {
+	my ($text, $rev, $len) = ('', undef, 0);
+	while (defined(my $line = <$in>)) {
+		next if $line eq "\n" && $text eq '';
+		$text .= $line;
+		last if $line eq "\n";
+		$rev = $1 if $line =~ /^Revision-number: (\d+)$/;
+		$len = $1 if $line =~ /^Content-length: (\d+)$/;
+	}
+	return () if $text eq '';
+	if ($len) {
+		read($in, my $content, $len) == $len
+			or die "$dump: truncated record\n";
+		$text .= $content;
+	}
+	return ($text, $rev);
+}
+
+my $header = '';
+my @revisions;
+while (my ($text, $rev) = read_record()) {
+	if (defined $rev) {
+		push @revisions, $text;
+	} elsif (@revisions) {
+		$revisions[-1] .= $text;
+	} else {
+		$header .= $text;
+	}
+}
+
+sub send_fragment {
+	my ($fragment) = @_;
+	my $conn = IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => $socket)
+		or die "cannot connect to $socket: $!\n";
+	binmode $conn;
+	print $conn $fragment;
+	$conn->shutdown(1);
+	my $reply = <$conn>;
+	close $conn;
+	return $reply;
+}
+
+my @ms;
+while (my @chunk = splice(@revisions, 0, $batch)) {
+	my $start = time;
+	my $reply = send_fragment(join('', $header, @chunk));
+	defined $reply && $reply eq "error\n"
+		and die "svn-fe rejected the fragment\n";
+	defined $reply && $reply eq "ok\n"
+		or die "svn-fe did not acknowledge the fragment\n";
+	push @ms, (time - $start) * 1000;
+	if ($reject) {
+		$reply = send_fragment(join('', $header, @chunk));
+		defined $reply && $reply eq "error\n"
+			or die "svn-fe accepted a fragment out of order\n";
+		$reject = 0;
+	}
+}
+send_fragment('') unless $keep_running;
+
+@ms = sort { $a <=> $b } @ms;
+if (@ms) {
+	printf STDERR "Fragments: %d, round trip", scalar @ms;
+	printf STDERR " p%d %.1f ms", $_, $ms[int($#ms * $_ / 100)]
+		for (50, 90, 99, 100);
+	print STDERR "\n";
+}
@@ -7,12 +7,20 @@
  *  - use compat-util.h in place of cache.h.
  *  - include strbuf.h directly instead of through refs.h.
  *  - remove unneeded functions.
+ *
+ * Modifications (2026-10-19):
+ *  - find the next byte to quote 16 bytes at a time with SSE2.
+ *  - emit each escape sequence with one write.
  */
 
 #include "compat-util.h"
 #include "quote.h"
 #include "strbuf.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 static int quote_path_fully = 1;
 
 /* 1 means: quote as octal
@@ -40,12 +48,50 @@ static inline int sq_must_quote(char c)
 	return sq_lookup[(unsigned char)c] + quote_path_fully > 0;
 }
 
+#ifdef __SSE2__
+/*
+ * With quote_path_fully, the bytes to quote are exactly the controls,
+ * '"', '\\', DEL and everything from 0x80, that is, everything that is
+ * below ' ' as a signed char plus three others.  Only whole 16-byte
+ * blocks inside the string are loaded; the rest is checked bytewise.
+ */
+static size_t next_quote_pos_sse2(const char *s, ssize_t maxlen)
+{
+	const __m128i space = _mm_set1_epi8(' ');
+	const __m128i dq = _mm_set1_epi8('"');
+	const __m128i bs = _mm_set1_epi8('\\');
+	const __m128i del = _mm_set1_epi8(0x7f);
+	size_t len = maxlen < 0 ? strlen(s) : (size_t) maxlen;
+	size_t i;
+
+	for (i = 0; len - i >= 16; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i hit = _mm_or_si128(
+			_mm_or_si128(_mm_cmplt_epi8(v, space),
+				     _mm_cmpeq_epi8(v, dq)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, bs),
+				     _mm_cmpeq_epi8(v, del)));
+		unsigned int mask = _mm_movemask_epi8(hit);
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	for (; i < len && !sq_must_quote(s[i]); i++)
+		;
+	return i;
+}
+#endif
+
 /* returns the longest prefix not needing a quote up to maxlen if positive.
    This stops at the first \0 because it's marked as a character needing an
    escape */
 static size_t next_quote_pos(const char *s, ssize_t maxlen)
 {
 	ssize_t len;
+#ifdef __SSE2__
+	if (quote_path_fully)
+		return next_quote_pos_sse2(s, maxlen);
+#endif
 	if (maxlen < 0) {
 		for (len = 0; !sq_must_quote(s[len]); len++);
 	} else {
@@ -86,6 +132,7 @@ static size_t quote_c_style_counted(const char *name, ssize_t maxlen,
 
 	ssize_t len, count = 0;
 	const char *p = name;
+	char esc[4];
 
 	for (;;) {
 		int ch;
@@ -98,17 +145,19 @@ static size_t quote_c_style_counted(const char *name, ssize_t maxlen,
 			EMIT('"');
 
 		EMITBUF(p, len);
-		EMIT('\\');
 		p += len;
 		ch = (unsigned char)*p++;
 		if (maxlen >= 0)
 			maxlen -= len + 1;
+		esc[0] = '\\';
 		if (sq_lookup[ch] >= ' ') {
-			EMIT(sq_lookup[ch]);
+			esc[1] = sq_lookup[ch];
+			EMITBUF(esc, 2);
 		} else {
-			EMIT(((ch >> 6) & 03) + '0');
-			EMIT(((ch >> 3) & 07) + '0');
-			EMIT(((ch >> 0) & 07) + '0');
+			esc[1] = ((ch >> 6) & 03) + '0';
+			esc[2] = ((ch >> 3) & 07) + '0';
+			esc[3] = ((ch >> 0) & 07) + '0';
+			EMITBUF(esc, 4);
 		}
 	}
 
@@ -9,10 +9,13 @@
  *  - remove unneeded functions.
  * Modifications (2012-05-18):
  *  - restore functions needed for downstream changes.
+ * Modifications (2026-10-19):
+ *  - account for memory by tag.
  */
 
 #include "compat-util.h"
 #include "strbuf.h"
+#include "memory.h"
 
 /*
  * Used as the default ->buf value, so that people can always assume
@@ -25,6 +28,7 @@ void strbuf_init(struct strbuf *sb, size_t hint)
 {
 	sb->alloc = sb->len = 0;
 	sb->buf = strbuf_slopbuf;
+	strbuf_set_tag(sb, MEM_OTHER);
 	if (hint)
 		strbuf_grow(sb, hint);
 }
@@ -32,18 +36,30 @@ void strbuf_init(struct strbuf *sb, size_t hint)
 void strbuf_release(struct strbuf *sb)
 {
 	if (sb->alloc) {
+#ifdef MEMORY_ACCOUNTING
+		memory_account(sb->tag, sb->alloc, 0);
+#endif
 		free(sb->buf);
-		strbuf_init(sb, 0);
+		/* Keep the tag. */
+		sb->alloc = sb->len = 0;
+		sb->buf = strbuf_slopbuf;
 	}
 }
 
 void strbuf_grow(struct strbuf *sb, size_t extra)
 {
+#ifdef MEMORY_ACCOUNTING
+	size_t old_alloc = sb->alloc;
+#endif
 	if (sb->len + extra + 1 <= sb->len)
 		die("you want to use way too much memory");
 	if (!sb->alloc)
 		sb->buf = NULL;
 	ALLOC_GROW(sb->buf, sb->len + extra + 1, sb->alloc);
+#ifdef MEMORY_ACCOUNTING
+	if (sb->alloc != old_alloc)
+		memory_account(sb->tag, old_alloc, sb->alloc);
+#endif
 }
 
 void strbuf_add(struct strbuf *sb, const void *data, size_t len)
@@ -7,6 +7,9 @@
  *  - remove unneeded functions.
  * Modifications (2012-05-18):
  *  - restore functions needed for downstream changes.
+ * Modifications (2026-10-19):
+ *  - tag buffers for memory accounting.
+ *  - add strbuf_recycle().
  */
 
 #ifndef STRBUF_H
@@ -52,9 +55,20 @@ struct strbuf {
 	size_t alloc;
 	size_t len;
 	char *buf;
+#ifdef MEMORY_ACCOUNTING
+	int tag;	/* see memory.h */
+#endif
 };
 
+#ifdef MEMORY_ACCOUNTING
+#define STRBUF_INIT  { 0, 0, strbuf_slopbuf, 0 }
+#define STRBUF_INIT_TAGGED(tag)  { 0, 0, strbuf_slopbuf, (tag) }
+#define strbuf_set_tag(sb, t)  ((sb)->tag = (t))
+#else
 #define STRBUF_INIT  { 0, 0, strbuf_slopbuf }
+#define STRBUF_INIT_TAGGED(tag)  STRBUF_INIT
+#define strbuf_set_tag(sb, t)  ((void) (sb), (void) (t))
+#endif
 
 /*----- strbuf life cycle -----*/
 extern void strbuf_init(struct strbuf *, size_t);
@@ -78,6 +92,17 @@ static inline void strbuf_setlen(struct strbuf *sb, size_t len) {
 }
 #define strbuf_reset(sb)  strbuf_setlen(sb, 0)
 
+/*
+ * Empty a scratch buffer for its next use, keeping the allocation
+ * unless it has grown beyond keep_max bytes.
+ */
+static inline void strbuf_recycle(struct strbuf *sb, size_t keep_max) {
+	if (sb->alloc > keep_max)
+		strbuf_release(sb);
+	else if (sb->len)
+		strbuf_setlen(sb, 0);
+}
+
 /*----- add data in your buffer -----*/
 static inline void strbuf_addch(struct strbuf *sb, int c) {
 	strbuf_grow(sb, 1);
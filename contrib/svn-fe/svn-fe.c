@@ -3,15 +3,579 @@
  * You may freely use, modify, distribute, and relicense it.
  */
 
-#include <stdlib.h>
+#include "compat-util.h"
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include "strbuf.h"
+#include "thread_pool.h"
+#include "svndiff.h"
 #include "svndump.h"
+#include "fast_export.h"
+#include "metrics.h"
+#include "trace.h"
+#include "profile.h"
+#include "memory.h"
+#include "split.h"
+#include "analyze.h"
+#include "dump_filter.h"
+#include "dump_parser.h"
+#include "blob_set.h"
+#include "manifest.h"
+
+static const char svn_fe_usage[] =
+	"svn-fe [--threads=<n>]\n"
+	"       [--pack-dir=<dir> | --no-backchannel | --split=<map>]\n"
+	"       [--checkpoint=<policy>] [--known-blobs=<file>]\n"
+	"       [--input=<dump-or-dir>... | --listen=<socket>]\n"
+	"       [--metrics=<file>] [--trace=<file>] [--profile=<file>]\n"
+	"       [--manifest=<file>] [url]\n"
+	"   or: svn-fe --analyze [--input=<dump-or-dir>...]\n"
+	"   or: svn-fe --verify=<manifest> --marks=<file> [--threads=<n>]\n"
+	"   or: svn-fe (--include=<path> | --exclude=<path>)...\n"
+	"              [--drop-empty-revs] [--renumber-revs]\n"
+	"              [--input=<dump-or-dir>...]";
+
+static const char **inputs;
+static size_t nr_inputs, inputs_alloc;
+
+static void add_input(const char *path)
+{
+	ALLOC_GROW(inputs, nr_inputs + 1, inputs_alloc);
+	inputs[nr_inputs++] = path;
+}
+
+/* A directory stands for every dump in it. */
+static void add_inputs(const char *path)
+{
+	struct stat st;
+	struct dirent *de;
+	DIR *dir;
+
+	if (stat(path, &st))
+		die_errno("cannot stat %s", path);
+	if (!S_ISDIR(st.st_mode)) {
+		add_input(path);
+		return;
+	}
+	dir = opendir(path);
+	if (!dir)
+		die_errno("cannot open directory %s", path);
+	while ((de = readdir(dir))) {
+		struct strbuf file = STRBUF_INIT;
+		if (de->d_name[0] == '.')
+			continue;
+		strbuf_addstr(&file, path);
+		strbuf_addch(&file, '/');
+		strbuf_addstr(&file, de->d_name);
+		if (stat(file.buf, &st))
+			die_errno("cannot stat %s", file.buf);
+		if (S_ISREG(st.st_mode))
+			add_input(strdup(file.buf));
+		strbuf_release(&file);
+	}
+	closedir(dir);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		die("socket path too long: %s", path);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		die_errno("cannot create socket");
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(fd, 16))
+		die_errno("cannot listen on %s", path);
+	return fd;
+}
+
+static int double_order(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void report_latency(double *ms, size_t nr)
+{
+	static const int percentiles[] = { 50, 90, 99, 100 };
+	size_t i;
+
+	if (!nr)
+		return;
+	qsort(ms, nr, sizeof(*ms), double_order);
+	fprintf(stderr, "Batches: %lu, latency", (unsigned long) nr);
+	for (i = 0; i < sizeof(percentiles) / sizeof(*percentiles); i++)
+		fprintf(stderr, " p%d %.1f ms", percentiles[i],
+			ms[(nr - 1) * percentiles[i] / 100]);
+	fputc('\n', stderr);
+}
+
+/* What a fragment is checked for before it is converted. */
+struct fragment_check {
+	uint32_t expected_revision;	/* 0 means anything goes */
+	int have_revision;
+};
+
+static void check_revision(void *data, uint32_t revision)
+{
+	struct fragment_check *c = data;
+
+	if (!c->have_revision && c->expected_revision &&
+	    revision != c->expected_revision)
+		die("fragment starts at r%"PRIu32", not r%"PRIu32,
+		    revision, c->expected_revision);
+	c->have_revision = 1;
+}
+
+/* The checks of svndump's visit_node() that need no tree. */
+static int check_node(void *data, const struct dump_node *node)
+{
+	int have_text = node->text_length != -1;
+
+	(void) data;
+	if (node->action == NODEACT_UNKNOWN)
+		die("invalid dump: Node-path block lacks Node-action");
+	if (node->action == NODEACT_DELETE &&
+	    (have_text || node->prop_length != -1 || node->copyfrom_rev))
+		die("invalid dump: deletion node has "
+		    "copyfrom info, text, or properties");
+	if (have_text && node->kind == NODEKIND_DIR)
+		die("invalid dump: directories cannot have text attached");
+	if ((node->action == NODEACT_ADD || node->action == NODEACT_REPLACE) &&
+	    node->kind != NODEKIND_DIR && !have_text && !node->copyfrom_rev)
+		die("invalid dump: adds node without text");
+	return DUMP_SKIP_BODY;
+}
+
+static const struct dump_visitor fragment_checker = {
+	NULL,
+	check_revision,
+	NULL,
+	check_node,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+/*
+ * "svn-fe --check-fragment=<revision>": parse the fragment on stdin,
+ * bodies skipped, and die if it is malformed or does not start at
+ * <revision> (0 for any).  Only run by check_fragment().
+ */
+static int check_fragment_main(const char *arg)
+{
+	struct line_buffer input = LINE_BUFFER_INIT;
+	struct dump_parser parser;
+	struct fragment_check c;
+
+	c.expected_revision = strtoul(arg, NULL, 10);
+	c.have_revision = 0;
+	if (buffer_init(&input, NULL))
+		die_errno("cannot read standard input");
+	dump_parser_init(&parser);
+	dump_parser_read(&parser, &input, &fragment_checker, &c);
+	dump_parser_deinit(&parser);
+	buffer_deinit(&input);
+	return 0;
+}
+
+static const char *self_path;	/* argv[0], if /proc/self/exe is missing */
+
+/*
+ * Check the fragment in fd in a fresh svn-fe, so that one the parser
+ * dies on ends only its own connection.  The child execs at once: it
+ * must not flush the daemon's stdio buffers, run its exit handlers or
+ * wait for a lock that another thread held at fork time.
+ */
+static int check_fragment(const struct svndump *d, int fd)
+{
+	char arg[64];
+	pid_t pid;
+	int status;
+
+	snprintf(arg, sizeof(arg), "--check-fragment=%"PRIu32,
+		 d->have_revision ? d->last_revision + 1 : 0);
+	pid = fork();
+	if (pid < 0)
+		die_errno("fork failed");
+	if (!pid) {
+		if (dup2(fd, 0) < 0 || dup2(2, 1) < 0)
+			_exit(128);
+		execl("/proc/self/exe", "svn-fe", arg, (char *) NULL);
+		execlp(self_path, "svn-fe", arg, (char *) NULL);
+		_exit(127);
+	}
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			die_errno("cannot wait for the fragment check");
+	if (lseek(fd, 0, SEEK_SET))
+		die_errno("cannot rewind the fragment");
+	return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+/* Read what is sent on conn into a temporary file, and rewind it. */
+static int spool_fragment(int conn)
+{
+	FILE *tmp = tmpfile();
+	char buf[65536];
+	ssize_t n;
+	int fd;
+
+	if (!tmp)
+		die_errno("cannot create a file for a fragment");
+	while ((n = read(conn, buf, sizeof(buf))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			die_errno("cannot read a fragment");
+		if (fwrite(buf, 1, n, tmp) != (size_t) n)
+			die_errno("cannot spool a fragment");
+	}
+	fd = dup(fileno(tmp));
+	if (fd < 0 || fclose(tmp) || lseek(fd, 0, SEEK_SET))
+		die_errno("cannot spool a fragment");
+	return fd;
+}
+
+/*
+ * Each connection sends one dump fragment, for example from an
+ * svnsync post-commit hook, and is answered "ok" once the importer
+ * has checkpointed it.  A fragment is first read in full and parsed
+ * in a child process; one that is malformed or does not follow the
+ * revisions imported so far is answered "error" and dropped.  An
+ * empty connection shuts the daemon down.
+ */
+static void serve(struct svndump *d, const char *path, const char *url)
+{
+	double *latency = NULL;
+	size_t nr = 0, alloc = 0;
+	int fd = listen_on(path);
+
+	for (;;) {
+		double start;
+		char c;
+		int input;
+		int conn = accept(fd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("accept failed");
+		}
+		start = now();
+		if (recv(conn, &c, 1, MSG_PEEK) <= 0) {
+			close(conn);
+			break;
+		}
+		input = spool_fragment(conn);
+		if (check_fragment(d, input)) {
+			fprintf(stderr, "warning: fragment rejected\n");
+			close(input);
+			send(conn, "error\n", 6, MSG_NOSIGNAL);
+			close(conn);
+			continue;
+		}
+		svndump_read_fd(d, input, url);
+		fast_export_checkpoint(&d->fe);
+		ALLOC_GROW(latency, nr + 1, alloc);
+		latency[nr++] = (now() - start) * 1000;
+		send(conn, "ok\n", 3, MSG_NOSIGNAL);
+		close(conn);
+	}
+	close(fd);
+	unlink(path);
+	report_latency(latency, nr);
+	free(latency);
+}
+
+/* Statistics on stdout (JSON) and stderr instead of a conversion. */
+static void analyze(void)
+{
+	static struct analysis a;
+	struct line_buffer input = LINE_BUFFER_INIT;
+	size_t i;
+
+	if (!nr_inputs)
+		add_input(NULL);	/* stdin */
+	analyze_init(&a);
+	for (i = 0; i < nr_inputs; i++) {
+		if (buffer_init(&input, inputs[i]))
+			die_errno("cannot open %s", inputs[i]);
+		analyze_read(&a, &input);
+		if (buffer_deinit(&input))
+			die("error reading dump file");
+	}
+	analyze_report(&a, stderr, stdout);
+	analyze_deinit(&a);
+}
+
+static struct dump_filter filter;
+static struct blob_set known_blobs;
+
+/* A dump of the paths wanted on stdout instead of a conversion. */
+static void filter_dump(void)
+{
+	struct line_buffer input = LINE_BUFFER_INIT;
+	size_t i;
+
+	if (!nr_inputs)
+		add_input(NULL);	/* stdin */
+	for (i = 0; i < nr_inputs; i++) {
+		if (buffer_init(&input, inputs[i]))
+			die_errno("cannot open %s", inputs[i]);
+		dump_filter_read(&filter, &input);
+		if (buffer_deinit(&input))
+			die("error reading dump file");
+	}
+	if (fflush(stdout))
+		die_errno("cannot write the dump");
+	dump_filter_deinit(&filter);
+}
 
 int main(int argc, char **argv)
 {
-	if (svndump_init(NULL))
+	static struct svndump dump;
+	const char *url = NULL;
+	const char *socket_path = NULL;
+	const char *metrics_file = NULL;
+	const char *trace_file = NULL;
+	const char *profile_file = NULL;
+	const char *split_map = NULL;
+	const char *manifest_file = NULL;
+	const char *verify_file = NULL, *marks_file = NULL;
+	int pack = 0, store = 0, analyze_only = 0, filtering = 0;
+	int checkpoint = 0, known = 0;
+	int threads = online_cpus();
+	int i;
+
+	self_path = argv[0];
+	if (argc == 2 && !strncmp(argv[1], "--check-fragment=",
+				  strlen("--check-fragment=")))
+		return check_fragment_main(argv[1] +
+					   strlen("--check-fragment="));
+	dump_filter_init(&filter, stdout);
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (!strncmp(arg, "--threads=", strlen("--threads="))) {
+			char *end;
+			long n = strtol(arg + strlen("--threads="), &end, 10);
+
+			if (end == arg + strlen("--threads=") || *end ||
+			    n < 1 || n > INT_MAX)
+				die("--threads needs a positive number: %s", arg);
+			threads = n;
+			continue;
+		}
+		if (!strncmp(arg, "--pack-dir=", strlen("--pack-dir="))) {
+			fast_export_set_pack_dir(&dump.fe,
+						 arg + strlen("--pack-dir="));
+			pack = 1;
+			continue;
+		}
+		if (!strncmp(arg, "--checkpoint=", strlen("--checkpoint="))) {
+			struct checkpoint_policy policy;
+
+			if (parse_checkpoint_policy(&policy,
+					arg + strlen("--checkpoint=")))
+				return 1;
+			fast_export_set_checkpoint(&dump.fe, &policy);
+			checkpoint = 1;
+			continue;
+		}
+		if (!strncmp(arg, "--known-blobs=", strlen("--known-blobs="))) {
+			if (!known)
+				blob_set_init(&known_blobs);
+			if (blob_set_load(&known_blobs,
+					  arg + strlen("--known-blobs=")))
+				return 1;
+			fast_export_set_known_blobs(&dump.fe, &known_blobs);
+			known = 1;
+			continue;
+		}
+		if (!strncmp(arg, "--input=", strlen("--input="))) {
+			add_inputs(arg + strlen("--input="));
+			continue;
+		}
+		if (!strncmp(arg, "--listen=", strlen("--listen="))) {
+			socket_path = arg + strlen("--listen=");
+			continue;
+		}
+		if (!strncmp(arg, "--metrics=", strlen("--metrics="))) {
+			metrics_file = arg + strlen("--metrics=");
+			continue;
+		}
+		if (!strncmp(arg, "--trace=", strlen("--trace="))) {
+			trace_file = arg + strlen("--trace=");
+			continue;
+		}
+		if (!strncmp(arg, "--profile=", strlen("--profile="))) {
+			profile_file = arg + strlen("--profile=");
+			continue;
+		}
+		if (!strncmp(arg, "--manifest=", strlen("--manifest="))) {
+			manifest_file = arg + strlen("--manifest=");
+			continue;
+		}
+		if (!strncmp(arg, "--verify=", strlen("--verify="))) {
+			verify_file = arg + strlen("--verify=");
+			continue;
+		}
+		if (!strncmp(arg, "--marks=", strlen("--marks="))) {
+			marks_file = arg + strlen("--marks=");
+			continue;
+		}
+		if (!strcmp(arg, "--no-backchannel")) {
+			const char *tmp = getenv("TMPDIR");
+			fast_export_set_store_dir(&dump.fe,
+						  tmp && *tmp ? tmp : "/tmp");
+			store = 1;
+			continue;
+		}
+		if (!strncmp(arg, "--include=", strlen("--include="))) {
+			dump_filter_include(&filter,
+					    arg + strlen("--include="));
+			filtering = 1;
+			continue;
+		}
+		if (!strncmp(arg, "--exclude=", strlen("--exclude="))) {
+			dump_filter_exclude(&filter,
+					    arg + strlen("--exclude="));
+			filtering = 1;
+			continue;
+		}
+		if (!strcmp(arg, "--drop-empty-revs")) {
+			filter.drop_empty = 1;
+			continue;
+		}
+		if (!strcmp(arg, "--renumber-revs")) {
+			filter.renumber = 1;
+			continue;
+		}
+		if (!strcmp(arg, "--analyze")) {
+			analyze_only = 1;
+			continue;
+		}
+		if (!strncmp(arg, "--split=", strlen("--split="))) {
+			split_map = arg + strlen("--split=");
+			continue;
+		}
+		if (!strcmp(arg, "--")) {
+			i++;
+			break;
+		}
+		if (!strncmp(arg, "--", 2))
+			die("unknown option %s\nusage: %s", arg, svn_fe_usage);
+		if (url)
+			break;
+		url = arg;
+	}
+	if (i < argc) {
+		if (url || i != argc - 1)
+			die("usage: %s\n", svn_fe_usage);
+		url = argv[i];
+	}
+	if (socket_path && (pack || nr_inputs))
+		die("--listen cannot be used with --pack-dir or --input");
+	if (split_map && (pack || store || socket_path))
+		die("--split cannot be used with --pack-dir, --no-backchannel "
+		    "or --listen");
+	if (analyze_only && (pack || store || split_map || socket_path))
+		die("--analyze cannot be used with --pack-dir, "
+		    "--no-backchannel, --split or --listen");
+	if (filtering && (pack || store || split_map || socket_path ||
+			  analyze_only))
+		die("--include and --exclude cannot be used with --pack-dir, "
+		    "--no-backchannel, --split, --listen or --analyze");
+	if (checkpoint && (pack || analyze_only || filtering))
+		die("--checkpoint cannot be used with --pack-dir, --analyze, "
+		    "--include or --exclude");
+	if (known && (pack || store || split_map || analyze_only || filtering))
+		die("--known-blobs cannot be used with --pack-dir, "
+		    "--no-backchannel, --split, --analyze, --include or "
+		    "--exclude");
+	if (profile_file && (analyze_only || filtering))
+		die("--profile cannot be used with --analyze, --include or "
+		    "--exclude");
+	if ((filter.drop_empty || filter.renumber) && !filtering)
+		die("--drop-empty-revs and --renumber-revs need --include "
+		    "or --exclude");
+	if (manifest_file && (split_map || socket_path || analyze_only ||
+			      filtering))
+		die("--manifest cannot be used with --split, --listen, "
+		    "--analyze, --include or --exclude");
+	if (!verify_file != !marks_file)
+		die("--verify and --marks go together");
+	if (verify_file)
+		return manifest_verify(verify_file, marks_file, threads) ? 1 : 0;
+
+	svndiff0_set_threads(threads);
+	fast_export_set_threads(&dump.fe, threads);
+	if (metrics_file && metrics_init(metrics_file))
+		return 1;
+	if (trace_file && trace_init(trace_file))
+		return 1;
+	if (profile_file && profile_init(profile_file))
+		return 1;
+	if (split_map && split_init(split_map))
+		return 1;
+	if (filtering) {
+		filter_dump();
+		metrics_finish();
+		trace_finish();
+		memory_report();
+		return 0;
+	}
+	if (analyze_only) {
+		analyze();
+		metrics_finish();
+		trace_finish();
+		memory_report();
+		return 0;
+	}
+	if (manifest_file && !(dump.manifest = fopen(manifest_file, "w")))
+		die_errno("cannot open %s", manifest_file);
+	if (svndump_init(&dump, NULL, stdout, REPORT_FILENO))
 		return 1;
-	svndump_read((argc > 1) ? argv[1] : NULL);
-	svndump_deinit();
-	svndump_reset();
+	if (socket_path)
+		serve(&dump, socket_path, url);
+	else if (nr_inputs)
+		svndump_read_files(&dump, inputs, nr_inputs, url);
+	else
+		svndump_read(&dump, url);
+	svndump_deinit(&dump);
+	if (split_map)
+		split_deinit();
+	svndump_reset(&dump);
+	if (dump.manifest && fclose(dump.manifest))
+		die_errno("error writing %s", manifest_file);
+	if (known)
+		blob_set_release(&known_blobs);
+	profile_finish();
+	metrics_finish();
+	trace_finish();
+	memory_report();
+	svndiff0_set_threads(1);
 	return 0;
 }
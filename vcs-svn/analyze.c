@@ -0,0 +1,361 @@
+/*
+ * Gather statistics about a dump without converting it.
+ *
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include "line_buffer.h"
+#include "strbuf.h"
+#include "memory.h"
+#include "dump_parser.h"
+#include "analyze.h"
+
+static uint32_t hash_name(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;	/* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	return hash;
+}
+
+static void table_init(struct analyze_table *t)
+{
+	t->entries = NULL;
+	t->nr = t->alloc = 0;
+	t->nr_slots = 1024;
+	t->slots = calloc(t->nr_slots, sizeof(*t->slots));
+	if (!t->slots)
+		die_errno("cannot allocate a hash table");
+	strbuf_init(&t->names, 0);
+	strbuf_set_tag(&t->names, MEM_PARSER);
+}
+
+static void table_release(struct analyze_table *t)
+{
+	free(t->entries);
+	free(t->slots);
+	strbuf_release(&t->names);
+}
+
+static void table_grow(struct analyze_table *t)
+{
+	size_t i;
+
+	free(t->slots);
+	t->nr_slots *= 2;
+	t->slots = calloc(t->nr_slots, sizeof(*t->slots));
+	if (!t->slots)
+		die_errno("cannot allocate a hash table");
+	for (i = 0; i < t->nr; i++) {
+		size_t pos = t->entries[i].hash & (t->nr_slots - 1);
+		while (t->slots[pos])
+			pos = (pos + 1) & (t->nr_slots - 1);
+		t->slots[pos] = i + 1;
+	}
+}
+
+static const char *entry_name(const struct analyze_table *t,
+			      const struct analyze_entry *e)
+{
+	return t->names.buf + e->name;
+}
+
+/* The entry for name, added if it is new. */
+static struct analyze_entry *lookup(struct analyze_table *t,
+				    const char *name, size_t len)
+{
+	uint32_t hash = hash_name(name, len);
+	size_t pos = hash & (t->nr_slots - 1);
+	struct analyze_entry *e;
+
+	for (; t->slots[pos]; pos = (pos + 1) & (t->nr_slots - 1)) {
+		e = &t->entries[t->slots[pos] - 1];
+		if (e->hash == hash && !strncmp(entry_name(t, e), name, len) &&
+		    !entry_name(t, e)[len])
+			return e;
+	}
+	ALLOC_GROW(t->entries, t->nr + 1, t->alloc);
+	e = &t->entries[t->nr++];
+	memset(e, 0, sizeof(*e));
+	e->name = t->names.len;
+	e->hash = hash;
+	strbuf_add(&t->names, name, len);
+	strbuf_addch(&t->names, '\0');
+	t->slots[pos] = t->nr;
+	if (t->nr * 4 > t->nr_slots * 3)
+		table_grow(t);
+	return e;
+}
+
+static void add_top(struct analysis *a, const struct analyze_revision *r)
+{
+	size_t pos = a->nr_top;
+
+	while (pos && a->top[pos - 1].bytes < r->bytes)
+		pos--;
+	if (pos == ANALYZE_TOP)
+		return;
+	if (a->nr_top < ANALYZE_TOP)
+		a->nr_top++;
+	memmove(&a->top[pos + 1], &a->top[pos],
+		(a->nr_top - 1 - pos) * sizeof(*a->top));
+	a->top[pos] = *r;
+}
+
+static void begin_revision(void *data, uint32_t revision)
+{
+	struct analysis *a = data;
+
+	memset(&a->rev, 0, sizeof(a->rev));
+	a->rev.revision = revision;
+	strbuf_reset(&a->author);
+}
+
+static void end_revision(void *data, uint32_t revision)
+{
+	struct analysis *a = data;
+	struct analyze_entry *e = lookup(&a->authors, a->author.buf,
+					 a->author.len);
+
+	assert(a->rev.revision == revision);
+	e->count++;
+	e->bytes += a->rev.bytes;
+	a->rev.author = e - a->authors.entries;
+	add_top(a, &a->rev);
+	a->revisions++;
+}
+
+static void property(void *data, const char *key, size_t keylen,
+		     const char *val, size_t vallen)
+{
+	struct analysis *a = data;
+
+	/* Only revision properties are read. */
+	if (keylen != strlen("svn:author") ||
+	    memcmp(key, "svn:author", keylen))
+		return;
+	strbuf_reset(&a->author);
+	if (val)
+		strbuf_add(&a->author, val, vallen);
+}
+
+static int node(void *data, const struct dump_node *node)
+{
+	struct analysis *a = data;
+	struct analyze_entry *e = lookup(&a->paths, node->path,
+					 strlen(node->path));
+
+	e->count++;
+	a->nodes[node->action]++;
+	a->rev.nodes++;
+	if (node->copyfrom_rev) {
+		e->copies++;
+		a->copies++;
+		if (node->kind == NODEKIND_DIR)
+			a->branches++;
+	}
+	if (node->prop_length > 0) {
+		a->prop_bytes += node->prop_length;
+		a->rev.bytes += node->prop_length;
+	}
+	if (node->text_length >= 0) {
+		uint64_t len = node->text_length;
+
+		if (node->text_delta) {
+			e->deltas++;
+			a->deltas++;
+		} else {
+			e->fulltexts++;
+			a->fulltexts++;
+		}
+		e->bytes += len;
+		if (len > e->max_bytes)
+			e->max_bytes = len;
+		a->text_bytes += len;
+		a->rev.bytes += len;
+	}
+	return DUMP_SKIP_BODY;
+}
+
+static const struct dump_visitor analyzer = {
+	NULL,
+	begin_revision,
+	end_revision,
+	node,
+	NULL,
+	property,
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+void analyze_init(struct analysis *a)
+{
+	memset(a, 0, sizeof(*a));
+	dump_parser_init(&a->parser);
+	table_init(&a->paths);
+	table_init(&a->authors);
+	strbuf_init(&a->author, 0);
+}
+
+void analyze_read(struct analysis *a, struct line_buffer *input)
+{
+	dump_parser_read(&a->parser, input, &analyzer, a);
+}
+
+void analyze_deinit(struct analysis *a)
+{
+	dump_parser_deinit(&a->parser);
+	table_release(&a->paths);
+	table_release(&a->authors);
+	strbuf_release(&a->author);
+}
+
+/* Entries in order, largest first, for qsort. */
+
+static int by_bytes(const void *a, const void *b)
+{
+	const struct analyze_entry *x = *(const struct analyze_entry **) a;
+	const struct analyze_entry *y = *(const struct analyze_entry **) b;
+
+	if (x->bytes != y->bytes)
+		return x->bytes < y->bytes ? 1 : -1;
+	return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static int by_count(const void *a, const void *b)
+{
+	const struct analyze_entry *x = *(const struct analyze_entry **) a;
+	const struct analyze_entry *y = *(const struct analyze_entry **) b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+static size_t ranked(const struct analyze_table *t,
+		     int (*cmp)(const void *, const void *),
+		     const struct analyze_entry ***out)
+{
+	const struct analyze_entry **v;
+	size_t i;
+
+	v = malloc((t->nr ? t->nr : 1) * sizeof(*v));
+	if (!v)
+		die_errno("cannot allocate %"PRIuMAX" entries",
+			  (uintmax_t) t->nr);
+	for (i = 0; i < t->nr; i++)
+		v[i] = &t->entries[i];
+	qsort(v, t->nr, sizeof(*v), cmp);
+	*out = v;
+	return t->nr < ANALYZE_TOP ? t->nr : ANALYZE_TOP;
+}
+
+static const char *author_name(const struct analysis *a, size_t i)
+{
+	const char *name = entry_name(&a->authors, &a->authors.entries[i]);
+	return *name ? name : "(none)";
+}
+
+static void write_json_string(FILE *out, const char *s)
+{
+	putc('"', out);
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			putc(c, out);
+	}
+	putc('"', out);
+}
+
+void analyze_report(struct analysis *a, FILE *report, FILE *json)
+{
+	const struct analyze_entry **paths, **authors;
+	size_t nr_paths = ranked(&a->paths, by_bytes, &paths);
+	size_t nr_authors = ranked(&a->authors, by_count, &authors);
+	size_t i;
+
+	fprintf(report, "Revisions: %"PRIu32", nodes: %"PRIu32" added, "
+		"%"PRIu32" changed, %"PRIu32" deleted, %"PRIu32" replaced\n",
+		a->revisions, a->nodes[NODEACT_ADD], a->nodes[NODEACT_CHANGE],
+		a->nodes[NODEACT_DELETE], a->nodes[NODEACT_REPLACE]);
+	fprintf(report, "Text: %"PRIu32" fulltexts, %"PRIu32" deltas, "
+		"%"PRIu64" bytes; properties: %"PRIu64" bytes\n",
+		a->fulltexts, a->deltas, a->text_bytes, a->prop_bytes);
+	fprintf(report, "Copies: %"PRIu32", %"PRIu32" of them directories\n",
+		a->copies, a->branches);
+
+	fprintf(report, "\nPaths with the most text:\n"
+		"%14s %12s %7s %7s %7s  %s\n",
+		"bytes", "largest", "nodes", "deltas", "copies", "path");
+	for (i = 0; i < nr_paths; i++)
+		fprintf(report, "%14"PRIu64" %12"PRIu64" %7"PRIu32" %7"PRIu32
+			" %7"PRIu32"  %s\n", paths[i]->bytes,
+			paths[i]->max_bytes, paths[i]->count,
+			paths[i]->deltas, paths[i]->copies,
+			entry_name(&a->paths, paths[i]));
+
+	fprintf(report, "\nLargest revisions:\n%10s %14s %7s  %s\n",
+		"revision", "bytes", "nodes", "author");
+	for (i = 0; i < a->nr_top; i++)
+		fprintf(report, "%10"PRIu32" %14"PRIu64" %7"PRIu32"  %s\n",
+			a->top[i].revision, a->top[i].bytes, a->top[i].nodes,
+			author_name(a, a->top[i].author));
+
+	fprintf(report, "\nAuthors with the most revisions:\n"
+		"%10s %14s  %s\n", "revisions", "bytes", "author");
+	for (i = 0; i < nr_authors; i++)
+		fprintf(report, "%10"PRIu32" %14"PRIu64"  %s\n",
+			authors[i]->count, authors[i]->bytes,
+			author_name(a, authors[i] - a->authors.entries));
+
+	fprintf(json, "{\"revisions\":%"PRIu32",\"nodes\":{\"add\":%"PRIu32
+		",\"change\":%"PRIu32",\"delete\":%"PRIu32",\"replace\":%"
+		PRIu32"},\"fulltexts\":%"PRIu32",\"deltas\":%"PRIu32
+		",\"text_bytes\":%"PRIu64",\"prop_bytes\":%"PRIu64
+		",\"copies\":%"PRIu32",\"directory_copies\":%"PRIu32
+		",\"paths\":%"PRIuMAX",\n \"top_paths\":[",
+		a->revisions, a->nodes[NODEACT_ADD], a->nodes[NODEACT_CHANGE],
+		a->nodes[NODEACT_DELETE], a->nodes[NODEACT_REPLACE],
+		a->fulltexts, a->deltas, a->text_bytes, a->prop_bytes,
+		a->copies, a->branches, (uintmax_t) a->paths.nr);
+	for (i = 0; i < nr_paths; i++) {
+		fputs(i ? ",\n  {\"path\":" : "\n  {\"path\":", json);
+		write_json_string(json, entry_name(&a->paths, paths[i]));
+		fprintf(json, ",\"bytes\":%"PRIu64",\"largest\":%"PRIu64
+			",\"nodes\":%"PRIu32",\"fulltexts\":%"PRIu32
+			",\"deltas\":%"PRIu32",\"copies\":%"PRIu32"}",
+			paths[i]->bytes, paths[i]->max_bytes, paths[i]->count,
+			paths[i]->fulltexts, paths[i]->deltas,
+			paths[i]->copies);
+	}
+	fputs("],\n \"top_revisions\":[", json);
+	for (i = 0; i < a->nr_top; i++) {
+		fprintf(json, "%s{\"revision\":%"PRIu32",\"bytes\":%"PRIu64
+			",\"nodes\":%"PRIu32",\"author\":",
+			i ? ",\n  " : "\n  ", a->top[i].revision,
+			a->top[i].bytes, a->top[i].nodes);
+		write_json_string(json, entry_name(&a->authors,
+				  &a->authors.entries[a->top[i].author]));
+		putc('}', json);
+	}
+	fputs("],\n \"authors\":[", json);
+	for (i = 0; i < a->authors.nr; i++) {
+		fputs(i ? ",\n  {\"author\":" : "\n  {\"author\":", json);
+		write_json_string(json, entry_name(&a->authors, authors[i]));
+		fprintf(json, ",\"revisions\":%"PRIu32",\"bytes\":%"PRIu64"}",
+			authors[i]->count, authors[i]->bytes);
+	}
+	fputs("]}\n", json);
+	free(paths);
+	free(authors);
+}
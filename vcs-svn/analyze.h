@@ -0,0 +1,61 @@
+#ifndef ANALYZE_H_
+#define ANALYZE_H_
+
+#include "strbuf.h"
+#include "line_buffer.h"
+#include "dump_parser.h"
+
+/*
+ * Statistics about a dump for planning a migration, gathered from
+ * its headers and revision properties alone: node bodies are seeked
+ * over, so a dump on disk is read about as fast as the disk allows.
+ */
+
+/* One path or author; its name is at names.buf + name. */
+struct analyze_entry {
+	size_t name;
+	uint32_t hash;
+	uint32_t count;	/* nodes of a path, revisions of an author */
+	uint32_t fulltexts, deltas, copies;
+	uint64_t bytes, max_bytes;	/* text, as stored in the dump */
+};
+
+/* Open addressing with linear probing; 0 in slots means empty. */
+struct analyze_table {
+	struct analyze_entry *entries;
+	size_t nr, alloc;
+	uint32_t *slots;	/* index into entries + 1 */
+	size_t nr_slots;	/* a power of two */
+	struct strbuf names;
+};
+
+struct analyze_revision {
+	uint32_t revision, nodes;
+	uint64_t bytes;
+	size_t author;	/* entry in the author table */
+};
+
+#define ANALYZE_TOP 20
+
+struct analysis {
+	struct dump_parser parser;
+	struct analyze_table paths, authors;
+	struct strbuf author;	/* of the revision being read */
+	struct analyze_revision rev;
+	/* The largest revisions, largest first. */
+	struct analyze_revision top[ANALYZE_TOP];
+	size_t nr_top;
+
+	uint32_t revisions;
+	uint32_t nodes[NODEACT_REPLACE + 1];
+	uint32_t fulltexts, deltas, copies, branches;
+	uint64_t text_bytes, prop_bytes;
+};
+
+void analyze_init(struct analysis *a);
+void analyze_read(struct analysis *a, struct line_buffer *input);
+/* Write a ranked report to report and a JSON summary to json. */
+void analyze_report(struct analysis *a, FILE *report, FILE *json);
+void analyze_deinit(struct analysis *a);
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * A set of git blob names.
+ *
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include "line_buffer.h"
+#include "sha1.h"
+#include "blob_set.h"
+
+static const unsigned char null_sha1[20];
+
+static size_t slot_of(const struct blob_set *set, const unsigned char *sha1)
+{
+	uint32_t hash = (uint32_t) sha1[0] << 24 | sha1[1] << 16 |
+			sha1[2] << 8 | sha1[3];
+
+	return hash & (set->nr_slots - 1);
+}
+
+static size_t find(const struct blob_set *set, const unsigned char *sha1)
+{
+	size_t pos = slot_of(set, sha1);
+
+	while (memcmp(set->slots[pos], null_sha1, 20) &&
+	       memcmp(set->slots[pos], sha1, 20))
+		pos = (pos + 1) & (set->nr_slots - 1);
+	return pos;
+}
+
+static void alloc_slots(struct blob_set *set, size_t nr_slots)
+{
+	set->nr_slots = nr_slots;
+	set->slots = calloc(nr_slots, sizeof(*set->slots));
+	if (!set->slots)
+		die_errno("cannot allocate a set of blobs");
+}
+
+void blob_set_init(struct blob_set *set)
+{
+	set->nr = 0;
+	alloc_slots(set, 1024);
+}
+
+void blob_set_release(struct blob_set *set)
+{
+	free(set->slots);
+	set->slots = NULL;
+	set->nr = set->nr_slots = 0;
+}
+
+static void grow(struct blob_set *set)
+{
+	unsigned char (*old)[20] = set->slots;
+	size_t i, nr_old = set->nr_slots;
+
+	alloc_slots(set, nr_old * 2);
+	for (i = 0; i < nr_old; i++)
+		if (memcmp(old[i], null_sha1, 20))
+			memcpy(set->slots[find(set, old[i])], old[i], 20);
+	free(old);
+}
+
+void blob_set_add(struct blob_set *set, const unsigned char *sha1)
+{
+	size_t pos;
+
+	/* The null name marks an empty slot, and names no blob. */
+	if (!memcmp(sha1, null_sha1, 20))
+		return;
+	pos = find(set, sha1);
+	if (!memcmp(set->slots[pos], sha1, 20))
+		return;
+	memcpy(set->slots[pos], sha1, 20);
+	if (++set->nr * 4 > set->nr_slots * 3)
+		grow(set);
+}
+
+int blob_set_contains(const struct blob_set *set, const unsigned char *sha1)
+{
+	if (!set->nr)
+		return 0;
+	return !memcmp(set->slots[find(set, sha1)], sha1, 20);
+}
+
+int blob_set_load(struct blob_set *set, const char *path)
+{
+	struct line_buffer input = LINE_BUFFER_INIT;
+	unsigned char sha1[20];
+	const char *t;
+	uintmax_t lineno = 0;
+
+	if (buffer_init(&input, path))
+		return error("cannot open %s: %s", path, strerror(errno));
+	while ((t = buffer_read_line(&input))) {
+		lineno++;
+		if (get_sha1_hex(t, sha1) || (t[40] && t[40] != ' ')) {
+			buffer_deinit(&input);
+			return error("%s:%"PRIuMAX": expected an object name",
+				     path, lineno);
+		}
+		if (t[40] && (strncmp(t + 41, "blob", 4) ||
+			      (t[45] && t[45] != ' ')))
+			continue;
+		blob_set_add(set, sha1);
+	}
+	if (buffer_deinit(&input))
+		return error("error reading %s", path);
+	return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef BLOB_SET_H_
+#define BLOB_SET_H_
+
+/*
+ * A set of git blob names, such as those a repository being imported
+ * into already has.  The names are kept bare, 20 bytes each, in an
+ * open-addressed table; as they are hashes already, their first
+ * bytes pick the slot.
+ */
+struct blob_set {
+	unsigned char (*slots)[20];	/* all zeroes when empty */
+	size_t nr, nr_slots;
+};
+
+void blob_set_init(struct blob_set *set);
+void blob_set_release(struct blob_set *set);
+void blob_set_add(struct blob_set *set, const unsigned char *sha1);
+int blob_set_contains(const struct blob_set *set, const unsigned char *sha1);
+/*
+ * Add the blobs named in a file, one to a line, as written by
+ * "git cat-file --batch-all-objects --batch-check": lines for other
+ * types of object are skipped.  A line may be a bare name, too.
+ */
+int blob_set_load(struct blob_set *set, const char *path);
+
+#endif
@@ -0,0 +1,497 @@
+/*
+ * Filter a svnadmin dump by path.
+ *
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include "line_buffer.h"
+#include "strbuf.h"
+#include "memory.h"
+#include "dump_parser.h"
+#include "dump_filter.h"
+
+/* Does the line of len bytes at s start with the literal ref? */
+#define has_prefix(s, len, ref) \
+	((len) >= sizeof(ref) - 1 && !memcmp(s, ref, sizeof(ref) - 1))
+
+static void add_prefix(char ***list, size_t *nr, size_t *alloc,
+		       const char *prefix)
+{
+	size_t len;
+	char *p;
+
+	prefix += strspn(prefix, "/");
+	len = strlen(prefix);
+	while (len && prefix[len - 1] == '/')
+		len--;
+	p = malloc(len + 1);
+	if (!p)
+		die_errno("cannot allocate a prefix");
+	memcpy(p, prefix, len);
+	p[len] = '\0';
+	ALLOC_GROW(*list, *nr + 1, *alloc);
+	(*list)[(*nr)++] = p;
+}
+
+void dump_filter_include(struct dump_filter *f, const char *prefix)
+{
+	add_prefix(&f->include, &f->nr_include, &f->include_alloc, prefix);
+}
+
+void dump_filter_exclude(struct dump_filter *f, const char *prefix)
+{
+	add_prefix(&f->exclude, &f->nr_exclude, &f->exclude_alloc, prefix);
+}
+
+/* Is path prefix or below it? */
+static int is_below(const char *path, const char *prefix)
+{
+	size_t len = strlen(prefix);
+
+	if (!len)
+		return 1;
+	return !strncmp(path, prefix, len) && (!path[len] || path[len] == '/');
+}
+
+static int matches(char **list, size_t nr, const char *path)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		if (is_below(path, list[i]))
+			return 1;
+	return 0;
+}
+
+static int wanted(const struct dump_filter *f, const char *path)
+{
+	if (f->nr_include && !matches(f->include, f->nr_include, path))
+		return 0;
+	return !matches(f->exclude, f->nr_exclude, path);
+}
+
+/*
+ * A directory above what is kept is added too, so that the paths
+ * kept have somewhere to go when the dump is loaded.
+ */
+static int is_parent(const struct dump_filter *f,
+		     const struct dump_node *node)
+{
+	size_t i;
+
+	if (node->kind != NODEKIND_DIR || node->action != NODEACT_ADD ||
+	    node->copyfrom_rev)
+		return 0;
+	for (i = 0; i < f->nr_include; i++)
+		if (is_below(f->include[i], node->path) &&
+		    !matches(f->exclude, f->nr_exclude, f->include[i]))
+			return 1;
+	return 0;
+}
+
+static uint32_t *revmap_slot(struct dump_filter *f, uint32_t revision)
+{
+	size_t old = f->revmap_alloc;
+
+	if (revision >= old) {
+		ALLOC_GROW(f->revmap, revision + 1, f->revmap_alloc);
+		memset(f->revmap + old, 0,
+		       (f->revmap_alloc - old) * sizeof(*f->revmap));
+	}
+	return &f->revmap[revision];
+}
+
+/* The revision a copy from revision is made from in the output. */
+static uint32_t map_revision(struct dump_filter *f, uint32_t revision)
+{
+	uint32_t mapped;
+
+	if (revision >= f->revmap_alloc)
+		return revision;
+	mapped = f->revmap[revision];
+	return mapped ? mapped - 1 : revision;
+}
+
+/* Forget the entries of list at or below path. */
+static void forget_below(char **list, size_t *nr, const char *path)
+{
+	size_t i, j = 0;
+
+	for (i = 0; i < *nr; i++) {
+		if (is_below(list[i], path))
+			free(list[i]);
+		else
+			list[j++] = list[i];
+	}
+	*nr = j;
+}
+
+/* The longest entry of list at or above path, or NULL. */
+static const char *longest_above(char **list, size_t nr, const char *path)
+{
+	const char *best = NULL;
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		if (is_below(path, list[i]) &&
+		    (!best || strlen(list[i]) > strlen(best)))
+			best = list[i];
+	return best;
+}
+
+#define PATH_ABSENT 0
+#define PATH_PARTIAL 1	/* without all the input has below it */
+#define PATH_COMPLETE 2	/* but for what is missing further down */
+
+/* How much of path is in the output. */
+static int coverage(const struct dump_filter *f, const char *path)
+{
+	const char *missing, *present;
+
+	missing = longest_above(f->missing, f->nr_missing, path);
+	if (!missing)
+		return PATH_COMPLETE;
+	present = longest_above(f->present, f->nr_present, path);
+	if (!present || strlen(present) < strlen(missing))
+		return PATH_ABSENT;
+	if (strlen(present) > strlen(missing))
+		return PATH_COMPLETE;
+	return strcmp(present, path) ? PATH_ABSENT : PATH_PARTIAL;
+}
+
+/* Give dst a copy of each entry of list at or below src. */
+static void copy_below(char ***list, size_t *nr, size_t *alloc,
+		       const char *src, const char *dst)
+{
+	struct strbuf path = STRBUF_INIT;
+	size_t i, n = *nr, len = strlen(src);
+
+	for (i = 0; i < n; i++) {
+		const char *rest = (*list)[i] + len;
+
+		if (!is_below((*list)[i], src))
+			continue;
+		strbuf_reset(&path);
+		strbuf_addstr(&path, dst);
+		if (!len && *rest)
+			strbuf_addch(&path, '/');
+		strbuf_addstr(&path, rest);
+		add_prefix(list, nr, alloc, path.buf);
+	}
+	strbuf_release(&path);
+}
+
+static void add_missing(struct dump_filter *f, const char *path)
+{
+	add_prefix(&f->missing, &f->nr_missing, &f->missing_alloc, path);
+}
+
+static void add_present(struct dump_filter *f, const char *path)
+{
+	add_prefix(&f->present, &f->nr_present, &f->present_alloc, path);
+}
+
+/* Add the directories above path that are not in the output. */
+static void add_parents(struct dump_filter *f, const char *path)
+{
+	struct strbuf dir = STRBUF_INIT;
+	const char *slash;
+
+	for (slash = strchr(path, '/'); slash;
+	     slash = strchr(slash + 1, '/')) {
+		strbuf_reset(&dir);
+		strbuf_add(&dir, path, slash - path);
+		if (coverage(f, dir.buf) != PATH_ABSENT)
+			continue;
+		fprintf(f->out, "Node-path: %s\nNode-kind: dir\n"
+			"Node-action: add\nProp-content-length: 10\n"
+			"Content-length: 10\n\nPROPS-END\n\n\n", dir.buf);
+		add_present(f, dir.buf);
+	}
+	strbuf_release(&dir);
+}
+
+static void write_revision(struct dump_filter *f)
+{
+	uint32_t revision = f->revision;
+
+	if (f->renumber && revision)
+		revision = f->next_revision++;
+	strbuf_addstr(&f->props, "PROPS-END\n");
+	fprintf(f->out, "Revision-number: %"PRIu32"\n"
+		"Prop-content-length: %"PRIuMAX"\n"
+		"Content-length: %"PRIuMAX"\n\n",
+		revision, (uintmax_t) f->props.len, (uintmax_t) f->props.len);
+	fwrite(f->props.buf, 1, f->props.len, f->out);
+	fputc('\n', f->out);
+	*revmap_slot(f, f->revision) = revision + 1;
+	f->last_written = revision + 1;
+	f->written = 1;
+}
+
+static void add_prop_record(struct strbuf *sb, char type,
+			    const char *s, size_t len)
+{
+	char hdr[32];
+
+	snprintf(hdr, sizeof(hdr), "%c %"PRIuMAX"\n", type, (uintmax_t) len);
+	strbuf_addstr(sb, hdr);
+	strbuf_add(sb, s, len);
+	strbuf_addch(sb, '\n');
+}
+
+static void property(void *data, const char *key, size_t keylen,
+		     const char *val, size_t vallen)
+{
+	struct dump_filter *f = data;
+
+	/* Only revision properties are read; node bodies are not. */
+	if (!val) {
+		add_prop_record(&f->props, 'D', key, keylen);
+		return;
+	}
+	add_prop_record(&f->props, 'K', key, keylen);
+	add_prop_record(&f->props, 'V', val, vallen);
+}
+
+static void dump_version(void *data, uint32_t version)
+{
+	struct dump_filter *f = data;
+
+	if (f->nr_read)
+		return;
+	fprintf(f->out, "SVN-fs-dump-format-version: %"PRIu32"\n\n", version);
+}
+
+static void dump_uuid(void *data, const char *uuid)
+{
+	struct dump_filter *f = data;
+
+	if (f->nr_read)
+		return;
+	fprintf(f->out, "UUID: %s\n\n", uuid);
+}
+
+static void begin_revision(void *data, uint32_t revision)
+{
+	struct dump_filter *f = data;
+
+	f->revision = revision;
+	f->written = 0;
+	strbuf_reset(&f->props);
+}
+
+static void end_revision(void *data, uint32_t revision)
+{
+	struct dump_filter *f = data;
+
+	/* Revision 0 only has properties, and is always kept. */
+	if (!f->written && (!f->drop_empty || !revision))
+		write_revision(f);
+	/* A copy from a revision left out is made from the one before. */
+	if (!f->written)
+		*revmap_slot(f, revision) = f->last_written;
+}
+
+/*
+ * Copy the headers of node, leaving out its copyfrom headers if
+ * drop_copy or else giving its copyfrom revision as copyfrom_rev,
+ * and giving its action as action unless that is NULL.
+ */
+static void rewrite_headers(struct dump_filter *f,
+			    const struct dump_node *node, const char *action,
+			    int drop_copy, uint32_t copyfrom_rev)
+{
+	const char *p = node->headers, *end = p + node->headers_len;
+
+	strbuf_reset(&f->headers);
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		size_t len = eol - p + 1;
+
+		if (action && has_prefix(p, len, "Node-action: ")) {
+			strbuf_addstr(&f->headers, "Node-action: ");
+			strbuf_addstr(&f->headers, action);
+			strbuf_addch(&f->headers, '\n');
+		} else if (!has_prefix(p, len, "Node-copyfrom-rev: ")) {
+			if (!drop_copy ||
+			    (!has_prefix(p, len, "Node-copyfrom-path: ") &&
+			     !has_prefix(p, len, "Text-copy-source-")))
+				strbuf_add(&f->headers, p, len);
+		} else if (!drop_copy) {
+			char line[64];
+
+			snprintf(line, sizeof(line),
+				 "Node-copyfrom-rev: %"PRIu32"\n", copyfrom_rev);
+			strbuf_addstr(&f->headers, line);
+		}
+		p += len;
+	}
+	fwrite(f->headers.buf, 1, f->headers.len, f->out);
+}
+
+/*
+ * A path copied from one left out is written as added with what the
+ * node has, and remembered with what is missing below it, so that
+ * later nodes under it can be left out, or written as adds of the
+ * paths they change, as the output needs.  The output's tree is
+ * taken to be as of the latest revision, whatever revision a copy
+ * is from.
+ */
+static int node(void *data, const struct dump_node *node)
+{
+	struct dump_filter *f = data;
+	const char *action = NULL;
+	int drop_copy = 0;
+	uint32_t copyfrom_rev = 0;
+
+	if (!wanted(f, node->path) && !is_parent(f, node))
+		return DUMP_SKIP_BODY;
+	if (node->action != NODEACT_CHANGE) {
+		int absent = coverage(f, node->path) == PATH_ABSENT;
+
+		forget_below(f->missing, &f->nr_missing, node->path);
+		forget_below(f->present, &f->nr_present, node->path);
+		if (absent && node->action == NODEACT_DELETE)
+			return DUMP_SKIP_BODY;
+		if (absent && node->action == NODEACT_REPLACE)
+			action = "add";
+	} else if (coverage(f, node->path) == PATH_ABSENT) {
+		if (node->kind != NODEKIND_FILE ||
+		    node->text_length < 0 || node->text_delta) {
+			fprintf(stderr, "warning: r%"PRIu32": a change to %s "
+				"is left out, as it was copied from a path "
+				"left out\n", f->revision, node->path);
+			return DUMP_SKIP_BODY;
+		}
+		action = "add";
+	}
+	if (node->copyfrom_rev) {
+		int from = PATH_ABSENT;
+
+		if (wanted(f, node->copyfrom_path))
+			from = coverage(f, node->copyfrom_path);
+		if (from == PATH_PARTIAL)
+			add_missing(f, node->path);
+		if (from != PATH_ABSENT) {
+			copy_below(&f->missing, &f->nr_missing,
+				   &f->missing_alloc,
+				   node->copyfrom_path, node->path);
+			copy_below(&f->present, &f->nr_present,
+				   &f->present_alloc,
+				   node->copyfrom_path, node->path);
+			copyfrom_rev = map_revision(f, node->copyfrom_rev);
+		} else if (node->kind != NODEKIND_DIR &&
+			   (node->text_length < 0 || node->text_delta)) {
+			/*
+			 * A directory can be added empty instead, and a
+			 * file with its full text, but with no text or a
+			 * delta the contents of a file are those left out.
+			 */
+			fprintf(stderr, "warning: r%"PRIu32": %s is left "
+				"out, as it is copied from %s\n",
+				f->revision, node->path, node->copyfrom_path);
+			add_missing(f, node->path);
+			return DUMP_SKIP_BODY;
+		} else {
+			fprintf(stderr, "warning: r%"PRIu32": %s is copied "
+				"from %s, which is left out; it is written "
+				"without the copy\n",
+				f->revision, node->path, node->copyfrom_path);
+			if (node->kind == NODEKIND_DIR)
+				add_missing(f, node->path);
+			drop_copy = 1;
+		}
+	}
+	if (!f->written)
+		write_revision(f);
+	if (node->action != NODEACT_DELETE &&
+	    longest_above(f->missing, f->nr_missing, node->path)) {
+		add_parents(f, node->path);
+		if (node->action != NODEACT_CHANGE || action)
+			add_present(f, node->path);
+	}
+	if (action || drop_copy || copyfrom_rev != node->copyfrom_rev)
+		rewrite_headers(f, node, action, drop_copy, copyfrom_rev);
+	else
+		fwrite(node->headers, 1, node->headers_len, f->out);
+	return DUMP_RAW_BODY;
+}
+
+static void raw_body(void *data, const struct dump_node *node,
+		     struct line_buffer *input, off_t len)
+{
+	struct dump_filter *f = data;
+	off_t done;
+
+	if (node->prop_length < 0 && node->text_length < 0) {
+		fputs("\n\n", f->out);
+		return;
+	}
+	fputc('\n', f->out);
+	if (len >= LARGE_BLOB_MIN)
+		done = buffer_tmpfile_fsend_bytes(input, len, f->out);
+	else
+		done = buffer_fcopy_bytes(input, len, f->out);
+	if (done != len) {
+		if (buffer_ferror(input))
+			die_errno("error reading dump file");
+		die("invalid dump: unexpected end of file");
+	}
+	fputs("\n\n", f->out);
+}
+
+static const struct dump_visitor filter = {
+	dump_uuid,
+	begin_revision,
+	end_revision,
+	node,
+	NULL,
+	property,
+	NULL,
+	NULL,
+	raw_body,
+	dump_version
+};
+
+void dump_filter_init(struct dump_filter *f, FILE *out)
+{
+	memset(f, 0, sizeof(*f));
+	f->out = out;
+	f->next_revision = 1;
+	dump_parser_init(&f->parser);
+	strbuf_init(&f->props, 0);
+	strbuf_set_tag(&f->props, MEM_PROPS);
+	strbuf_init(&f->headers, 0);
+	strbuf_set_tag(&f->headers, MEM_PARSER);
+}
+
+void dump_filter_read(struct dump_filter *f, struct line_buffer *input)
+{
+	dump_parser_read(&f->parser, input, &filter, f);
+	f->nr_read++;
+}
+
+void dump_filter_deinit(struct dump_filter *f)
+{
+	size_t i;
+
+	for (i = 0; i < f->nr_include; i++)
+		free(f->include[i]);
+	for (i = 0; i < f->nr_exclude; i++)
+		free(f->exclude[i]);
+	for (i = 0; i < f->nr_missing; i++)
+		free(f->missing[i]);
+	for (i = 0; i < f->nr_present; i++)
+		free(f->present[i]);
+	free(f->include);
+	free(f->exclude);
+	free(f->missing);
+	free(f->present);
+	free(f->revmap);
+	dump_parser_deinit(&f->parser);
+	strbuf_release(&f->props);
+	strbuf_release(&f->headers);
+}
@@ -0,0 +1,63 @@
+#ifndef DUMP_FILTER_H_
+#define DUMP_FILTER_H_
+
+#include "strbuf.h"
+#include "line_buffer.h"
+#include "dump_parser.h"
+
+/*
+ * Write the part of a dump under some paths as a dump of its own,
+ * like svndumpfilter.  Node records that are kept are copied as they
+ * are, their bodies unparsed; only their copyfrom headers are changed
+ * where needed.
+ */
+
+struct dump_filter {
+	struct dump_parser parser;
+	FILE *out;
+
+	/* Set before dump_filter_read(). */
+	int drop_empty;	/* leave out revisions with no node kept */
+	int renumber;	/* number the revisions kept 1, 2, ... */
+
+	/* Path prefixes, with no slash at either end. */
+	char **include, **exclude;
+	size_t nr_include, include_alloc, nr_exclude, exclude_alloc;
+
+	/* The revision being read, written out with its first node. */
+	uint32_t revision;
+	struct strbuf props;
+	int written;
+
+	/*
+	 * The revision each revision read is written as, + 1: 0 for
+	 * one not read, or dropped before any was written.
+	 */
+	uint32_t *revmap;
+	size_t revmap_alloc;
+	uint32_t next_revision, last_written;
+
+	struct strbuf headers;	/* rewritten */
+
+	/*
+	 * Paths whose contents below them are not all in the output,
+	 * because they were copied from a path left out, and paths
+	 * under those that have been written since.
+	 */
+	char **missing, **present;
+	size_t nr_missing, missing_alloc, nr_present, present_alloc;
+
+	/* Inputs read so far; only the first has its headers written. */
+	size_t nr_read;
+};
+
+void dump_filter_init(struct dump_filter *f, FILE *out);
+/* Keep the paths under prefix (everything, if none is given)... */
+void dump_filter_include(struct dump_filter *f, const char *prefix);
+/* ...but not those under prefix. */
+void dump_filter_exclude(struct dump_filter *f, const char *prefix);
+/* Read an input, the dump or an incremental dump following it. */
+void dump_filter_read(struct dump_filter *f, struct line_buffer *input);
+void dump_filter_deinit(struct dump_filter *f);
+
+#endif
@@ -0,0 +1,379 @@
+/*
+ * Parse a svnadmin dump, handing each piece to a visitor.
+ *
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include <ctype.h>
+
+#include "compat-util.h"
+#include "line_buffer.h"
+#include "metrics.h"
+#include "memory.h"
+#include "strbuf.h"
+#include "dump_parser.h"
+
+/*
+ * Compare start of string to literal of equal length;
+ * must be guarded by length test.
+ */
+#define constcmp(s, ref) memcmp(s, ref, sizeof(ref) - 1)
+
+/* States: */
+#define DUMP_CTX 0	/* dump metadata */
+#define REV_CTX  1	/* revision metadata */
+#define NODE_CTX 2	/* node metadata */
+#define INTERNODE_CTX 3	/* between nodes */
+
+#define TEXT_CHUNK_LEN (64 * 1024)
+
+static void reset_node(struct dump_parser *p, const char *path)
+{
+	strbuf_reset(&p->path);
+	strbuf_reset(&p->copyfrom_path);
+	strbuf_reset(&p->headers);
+	if (path)
+		strbuf_addstr(&p->path, path);
+	p->node.path = p->path.buf;
+	p->node.copyfrom_path = p->copyfrom_path.buf;
+	p->node.kind = NODEKIND_UNKNOWN;
+	p->node.action = NODEACT_UNKNOWN;
+	p->node.copyfrom_rev = 0;
+	p->node.prop_length = -1;
+	p->node.text_length = -1;
+	p->node.prop_delta = 0;
+	p->node.text_delta = 0;
+	p->node.text_md5[0] = '\0';
+	p->node.text_sha1[0] = '\0';
+}
+
+static void set_checksum(char *dst, size_t size, const char *val)
+{
+	if (strlen(val) != size - 1)
+		die("invalid dump: bad checksum %s", val);
+	memcpy(dst, val, size);
+}
+
+static void die_short_read(struct line_buffer *input)
+{
+	if (buffer_ferror(input))
+		die_errno("error reading dump file");
+	die("invalid dump: unexpected end of file");
+}
+
+static void read_props(struct dump_parser *p, struct line_buffer *input,
+		       const struct dump_visitor *v, void *data)
+{
+	struct strbuf *key = &p->key, *val = &p->val;
+	const char *t;
+
+	while ((t = buffer_read_line(input)) && strcmp(t, "PROPS-END")) {
+		uint32_t len;
+		const char type = t[0];
+		int ch;
+
+		if (!type || t[1] != ' ')
+			die("invalid property line: %s", t);
+		len = atoi(&t[2]);
+		strbuf_reset(val);
+		buffer_read_binary(input, val, len);
+		if (val->len < len)
+			die_short_read(input);
+
+		/* Discard trailing newline. */
+		ch = buffer_read_char(input);
+		if (ch == EOF)
+			die_short_read(input);
+		if (ch != '\n')
+			die("invalid dump: expected newline after %s", val->buf);
+
+		switch (type) {
+		case 'K':
+			strbuf_swap(key, val);
+			continue;
+		case 'D':
+			if (v->property)
+				v->property(data, val->buf, val->len, NULL, 0);
+			continue;
+		case 'V':
+			if (v->property)
+				v->property(data, key->buf, key->len,
+					    val->buf, val->len);
+			strbuf_reset(key);
+			continue;
+		default:
+			die("invalid property line: %s", t);
+		}
+	}
+}
+
+static void read_text(struct dump_parser *p, struct line_buffer *input,
+		      const struct dump_visitor *v, void *data)
+{
+	const struct dump_node *node = &p->node;
+	off_t left = node->text_length;
+
+	if (v->text_stream) {
+		v->text_stream(data, node, input);
+		return;
+	}
+	if (!v->text) {
+		if (buffer_seek_bytes(input, left) != left)
+			die_short_read(input);
+		return;
+	}
+	while (left) {
+		size_t len = left < TEXT_CHUNK_LEN ? left : TEXT_CHUNK_LEN;
+
+		strbuf_reset(&p->chunk);
+		if (buffer_read_binary(input, &p->chunk, len) != len)
+			die_short_read(input);
+		v->text(data, node, p->chunk.buf, len);
+		left -= len;
+	}
+}
+
+static void visit_node(struct dump_parser *p, struct line_buffer *input,
+		       const struct dump_visitor *v, void *data)
+{
+	struct dump_node *node = &p->node;
+	int ret;
+	off_t len = 0;
+
+	node->headers = p->headers.buf;
+	node->headers_len = p->headers.len;
+	ret = v->node ? v->node(data, node) : 0;
+	if (node->prop_length > 0)
+		len += node->prop_length;
+	if (node->text_length > 0)
+		len += node->text_length;
+	if (ret == DUMP_RAW_BODY && v->raw_body) {
+		v->raw_body(data, node, input, len);
+	} else if (ret == DUMP_SKIP_BODY || ret == DUMP_RAW_BODY) {
+		if (buffer_seek_bytes(input, len) != len)
+			die_short_read(input);
+	} else {
+		if (node->prop_length > 0)
+			read_props(p, input, v, data);
+		if (node->text_length != -1)
+			read_text(p, input, v, data);
+	}
+	if (v->end_node)
+		v->end_node(data, node);
+}
+
+void dump_parser_read(struct dump_parser *p, struct line_buffer *input,
+		      const struct dump_visitor *v, void *data)
+{
+	char *val;
+	char *t;
+	uint32_t active_ctx = DUMP_CTX;
+	uint32_t revision = 0;
+	uint32_t len;
+
+	p->version = 1;
+	reset_node(p, NULL);
+	while ((t = buffer_read_line(input))) {
+		size_t line_len = strlen(t) + 1;
+
+		metrics_add(METRIC_INPUT_BYTES, line_len);
+		val = strchr(t, ':');
+		if (!val)
+			continue;
+		val++;
+		if (*val != ' ')
+			continue;
+		val++;
+		if (active_ctx == NODE_CTX) {
+			strbuf_add(&p->headers, t, line_len - 1);
+			strbuf_addch(&p->headers, '\n');
+		}
+
+		/* strlen(key) + 1 */
+		switch (val - t - 1) {
+		case sizeof("SVN-fs-dump-format-version"):
+			if (constcmp(t, "SVN-fs-dump-format-version"))
+				continue;
+			p->version = atoi(val);
+			if (p->version > 3)
+				die("expected svn dump format version <= 3, found %"PRIu32,
+				    p->version);
+			if (v->version)
+				v->version(data, p->version);
+			break;
+		case sizeof("UUID"):
+			if (constcmp(t, "UUID"))
+				continue;
+			if (v->uuid)
+				v->uuid(data, val);
+			break;
+		case sizeof("Revision-number"):
+			if (constcmp(t, "Revision-number"))
+				continue;
+			if (active_ctx == NODE_CTX) {
+				/* That was not one of its headers. */
+				strbuf_setlen(&p->headers,
+					      p->headers.len - line_len);
+				visit_node(p, input, v, data);
+			}
+			if (active_ctx != DUMP_CTX && v->end_revision)
+				v->end_revision(data, revision);
+			active_ctx = REV_CTX;
+			revision = atoi(val);
+			if (v->begin_revision)
+				v->begin_revision(data, revision);
+			break;
+		case sizeof("Node-path"):
+			if (constcmp(t, "Node-"))
+				continue;
+			if (!constcmp(t + strlen("Node-"), "path")) {
+				if (active_ctx == NODE_CTX) {
+					strbuf_setlen(&p->headers,
+						      p->headers.len - line_len);
+					visit_node(p, input, v, data);
+				}
+				active_ctx = NODE_CTX;
+				reset_node(p, val);
+				strbuf_add(&p->headers, t, line_len - 1);
+				strbuf_addch(&p->headers, '\n');
+				break;
+			}
+			if (constcmp(t + strlen("Node-"), "kind"))
+				continue;
+			if (!strcmp(val, "dir"))
+				p->node.kind = NODEKIND_DIR;
+			else if (!strcmp(val, "file"))
+				p->node.kind = NODEKIND_FILE;
+			else
+				fprintf(stderr, "Unknown node-kind: %s\n", val);
+			break;
+		case sizeof("Node-action"):
+			if (constcmp(t, "Node-action"))
+				continue;
+			if (!strcmp(val, "delete")) {
+				p->node.action = NODEACT_DELETE;
+			} else if (!strcmp(val, "add")) {
+				p->node.action = NODEACT_ADD;
+			} else if (!strcmp(val, "change")) {
+				p->node.action = NODEACT_CHANGE;
+			} else if (!strcmp(val, "replace")) {
+				p->node.action = NODEACT_REPLACE;
+			} else {
+				fprintf(stderr, "Unknown node-action: %s\n", val);
+				p->node.action = NODEACT_UNKNOWN;
+			}
+			break;
+		case sizeof("Node-copyfrom-path"):
+			if (constcmp(t, "Node-copyfrom-path"))
+				continue;
+			strbuf_reset(&p->copyfrom_path);
+			strbuf_addstr(&p->copyfrom_path, val);
+			p->node.copyfrom_path = p->copyfrom_path.buf;
+			break;
+		case sizeof("Node-copyfrom-rev"):
+			if (!constcmp(t, "Text-content-sha1")) {
+				set_checksum(p->node.text_sha1,
+					     sizeof(p->node.text_sha1), val);
+				break;
+			}
+			if (constcmp(t, "Node-copyfrom-rev"))
+				continue;
+			p->node.copyfrom_rev = atoi(val);
+			break;
+		case sizeof("Text-content-md5"):
+			if (constcmp(t, "Text-content-md5"))
+				continue;
+			set_checksum(p->node.text_md5, sizeof(p->node.text_md5),
+				     val);
+			break;
+		case sizeof("Text-content-length"):
+			if (constcmp(t, "Text") && constcmp(t, "Prop"))
+				continue;
+			if (constcmp(t + 4, "-content-length"))
+				continue;
+			{
+				char *end;
+				uintmax_t len;
+
+				len = strtoumax(val, &end, 10);
+				if (!isdigit(*val) || *end)
+					die("invalid dump: non-numeric length %s", val);
+				if (len > maximum_signed_value_of_type(off_t))
+					die("unrepresentable length in dump: %s", val);
+
+				if (*t == 'T')
+					p->node.text_length = (off_t) len;
+				else
+					p->node.prop_length = (off_t) len;
+				break;
+			}
+		case sizeof("Text-delta"):
+			if (!constcmp(t, "Text-delta")) {
+				p->node.text_delta = !strcmp(val, "true");
+				break;
+			}
+			if (constcmp(t, "Prop-delta"))
+				continue;
+			p->node.prop_delta = !strcmp(val, "true");
+			break;
+		case sizeof("Content-length"):
+			if (constcmp(t, "Content-length"))
+				continue;
+			len = atoi(val);
+			/* The blank line and the content. */
+			metrics_add(METRIC_INPUT_BYTES, len + 1);
+			t = buffer_read_line(input);
+			if (!t)
+				die_short_read(input);
+			if (*t)
+				die("invalid dump: expected blank line after content length header");
+			if (active_ctx == REV_CTX) {
+				read_props(p, input, v, data);
+			} else if (active_ctx == NODE_CTX) {
+				visit_node(p, input, v, data);
+				active_ctx = INTERNODE_CTX;
+			} else {
+				fprintf(stderr, "Unexpected content length header: %"PRIu32"\n", len);
+				if (buffer_seek_bytes(input, len) != len)
+					die_short_read(input);
+			}
+		}
+	}
+	if (buffer_ferror(input))
+		die_short_read(input);
+	if (active_ctx == NODE_CTX)
+		visit_node(p, input, v, data);
+	if (active_ctx != DUMP_CTX && v->end_revision)
+		v->end_revision(data, revision);
+}
+
+static void init_field(struct strbuf *sb, int tag)
+{
+	strbuf_init(sb, 0);
+	strbuf_set_tag(sb, tag);
+	strbuf_grow(sb, 4096);
+}
+
+void dump_parser_init(struct dump_parser *p)
+{
+	init_field(&p->path, MEM_PARSER);
+	init_field(&p->copyfrom_path, MEM_PARSER);
+	init_field(&p->headers, MEM_PARSER);
+	init_field(&p->key, MEM_PROPS);
+	init_field(&p->val, MEM_PROPS);
+	strbuf_init(&p->chunk, 0);
+	strbuf_set_tag(&p->chunk, MEM_PARSER);
+	p->version = 1;
+	reset_node(p, NULL);
+}
+
+void dump_parser_deinit(struct dump_parser *p)
+{
+	strbuf_release(&p->path);
+	strbuf_release(&p->copyfrom_path);
+	strbuf_release(&p->headers);
+	strbuf_release(&p->key);
+	strbuf_release(&p->val);
+	strbuf_release(&p->chunk);
+}
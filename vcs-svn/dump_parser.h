@@ -0,0 +1,112 @@
+#ifndef DUMP_PARSER_H_
+#define DUMP_PARSER_H_
+
+#include "strbuf.h"
+#include "line_buffer.h"
+
+/*
+ * A streaming parser for svnadmin dumps.  It reads the headers and
+ * bodies of a dump and hands each piece to a visitor as it goes by;
+ * nothing of the dump is kept beyond the piece being visited.
+ */
+
+#define NODEACT_REPLACE 4
+#define NODEACT_DELETE 3
+#define NODEACT_ADD 2
+#define NODEACT_CHANGE 1
+#define NODEACT_UNKNOWN 0
+
+/* Node-kind */
+#define NODEKIND_DIR 2
+#define NODEKIND_FILE 1
+#define NODEKIND_UNKNOWN 0
+
+/* The headers of a node, as far as the dump gives them. */
+struct dump_node {
+	const char *path;
+	uint32_t kind, action;
+	uint32_t copyfrom_rev;	/* 0 if not a copy */
+	const char *copyfrom_path;
+	off_t prop_length, text_length;	/* -1 if there is none */
+	int prop_delta, text_delta;
+	/* Of the full text, in hex; "" if the dump does not say. */
+	char text_md5[33], text_sha1[41];
+	/* Every header line, as in the dump, including newlines. */
+	const char *headers;
+	size_t headers_len;
+};
+
+/* A node callback returns this to have its body passed over, */
+#define DUMP_SKIP_BODY 1
+/* or this to have it passed to raw_body whole. */
+#define DUMP_RAW_BODY 2
+
+/*
+ * What to do with each piece of a dump.  Every callback may be NULL,
+ * and data is passed to each.  Strings and slices point into the
+ * parser's buffers and are good until the callback returns; slices
+ * are followed by a NUL that is not counted in their length.
+ */
+struct dump_visitor {
+	void (*uuid)(void *data, const char *uuid);
+	void (*begin_revision)(void *data, uint32_t revision);
+	void (*end_revision)(void *data, uint32_t revision);
+
+	/*
+	 * After the headers of a node.  Returning DUMP_SKIP_BODY
+	 * skips its properties and text without reading them if the
+	 * dump is a regular file; end_node is still called.
+	 */
+	int (*node)(void *data, const struct dump_node *node);
+	void (*end_node)(void *data, const struct dump_node *node);
+
+	/*
+	 * A property of the revision or node being read.  val is
+	 * NULL for a "D" record, which deletes key.
+	 */
+	void (*property)(void *data, const char *key, size_t keylen,
+			 const char *val, size_t vallen);
+
+	/*
+	 * The text of a node, a full text or an svndiff delta as
+	 * node->text_delta says, in slices of up to 64 KiB.
+	 */
+	void (*text)(void *data, const struct dump_node *node,
+		     const char *buf, size_t len);
+	/*
+	 * Instead of text: take the text_length bytes of a node's
+	 * text straight from input, for code that reads a line_buffer.
+	 * All of them must be consumed.
+	 */
+	void (*text_stream)(void *data, const struct dump_node *node,
+			    struct line_buffer *input);
+
+	/*
+	 * The body of a node whose callback returned DUMP_RAW_BODY,
+	 * properties and text as they are in the dump: len bytes to
+	 * be consumed from input.
+	 */
+	void (*raw_body)(void *data, const struct dump_node *node,
+			 struct line_buffer *input, off_t len);
+	void (*version)(void *data, uint32_t version);
+};
+
+struct dump_parser {
+	struct dump_node node;
+	struct strbuf path, copyfrom_path;
+	struct strbuf headers;
+	struct strbuf key, val;
+	struct strbuf chunk;
+	uint32_t version;
+};
+
+void dump_parser_init(struct dump_parser *p);
+void dump_parser_deinit(struct dump_parser *p);
+/*
+ * Read the dump from input to its end, calling the visitor on each
+ * piece.  Dies if the dump is invalid or cannot be read.
+ */
+void dump_parser_read(struct dump_parser *p, struct line_buffer *input,
+		      const struct dump_visitor *v, void *data);
+
+#endif
@@ -12,128 +12,700 @@
 #include "svndiff.h"
 #include "sliding_window.h"
 #include "line_buffer.h"
+#include "pack_export.h"
+#include "git_tree.h"
+#include "sha1.h"
+#include "metrics.h"
+#include "trace.h"
+#include "profile.h"
+#include "memory.h"
+#include "thread_pool.h"
+#include "split.h"
+#include "blob_set.h"
 
-#define MAX_GITSVN_LINE_LEN 4096
+/*
+ * With more than one thread, the text deltas of a run of nodes are
+ * queued, each read from the dump again on a handle of its own if
+ * the dump is a regular file or else copied to a temporary file.
+ * A flush sends the "cat-blob" requests for their preimages ahead
+ * of reading the answers, applies the deltas at once on a thread
+ * pool, and writes the results out in node order.  A lone delta, or
+ * one with a large preimage, is applied as its preimage is read, on
+ * the window pool of svndiff0_apply() instead.  Writing anything
+ * else to the stream flushes the queue first, as does an "ls" that
+ * a queued node could change the answer to.
+ */
+#define DELTAS_PER_THREAD	4
+#define QUEUED_PREIMAGE_MAX	(4 * 1024 * 1024)
+/*
+ * Bytes of requests sent ahead of the answers read: few enough to
+ * fit in a pipe, so that fast-import can take them all while it
+ * waits for an answer to be read.
+ */
+#define CAT_BLOB_AHEAD_MAX	4096
+
+struct queued_delta {
+	struct strbuf path;
+	uint32_t mode, old_mode;
+	struct strbuf old_data;	/* the preimage's dataref, if any */
+	struct line_buffer dump, delta_copy, preimage_file, postimage;
+	struct line_buffer *delta;	/* &dump or &delta_copy */
+	off_t delta_len, preimage_len, postimage_len;
+	/* The preimage, kept from one delta to the next. */
+	struct strbuf view_buf;
+	uint64_t requested;	/* for tracing */
+	int rv;
+	int streamed;	/* applied as its preimage was read */
+	int name;	/* call name_fn once it is written */
+};
 
-static uint32_t first_commit_done;
-static struct line_buffer postimage = LINE_BUFFER_INIT;
-static struct line_buffer report_buffer = LINE_BUFFER_INIT;
+static void init_delta_queue(struct fast_export *fe);
+static void release_delta_queue(struct fast_export *fe);
+static void flush_deltas(struct fast_export *fe);
+static void maybe_checkpoint(struct fast_export *fe);
 
-/* NEEDSWORK: move to fast_export_init() */
-static int init_postimage(void)
+/*
+ * The same paths are printed again and again (an ls, then a modify),
+ * so keep the quoted form of recent ones.
+ */
+#define QUOTE_CACHE_SIZE 256
+
+struct quoted_path {
+	struct strbuf path;
+	struct strbuf quoted;
+	int no_dq;
+};
+
+static void print_path(struct fast_export *fe, const char *path, int no_dq)
 {
-	static int postimage_initialized;
-	if (postimage_initialized)
+	struct quoted_path *e;
+	uint32_t hash = 2166136261u;	/* FNV-1a */
+	size_t len;
+
+	for (len = 0; path[len]; len++)
+		hash = (hash ^ (unsigned char) path[len]) * 16777619u;
+	e = &fe->quote_cache[(hash ^ no_dq) % QUOTE_CACHE_SIZE];
+	if (!e->path.buf) {
+		strbuf_init(&e->path, 0);
+		strbuf_init(&e->quoted, 0);
+	}
+	if (e->no_dq != no_dq || e->path.len != len ||
+	    memcmp(e->path.buf, path, len)) {
+		strbuf_reset(&e->path);
+		strbuf_add(&e->path, path, len);
+		strbuf_reset(&e->quoted);
+		quote_c_style(path, &e->quoted, NULL, no_dq);
+		e->no_dq = no_dq;
+	}
+	fwrite(e->quoted.buf, 1, e->quoted.len, fe->out);
+}
+
+static void release_quote_cache(struct fast_export *fe)
+{
+	int i;
+	for (i = 0; i < QUOTE_CACHE_SIZE; i++) {
+		if (!fe->quote_cache[i].path.buf)
+			continue;
+		strbuf_release(&fe->quote_cache[i].path);
+		strbuf_release(&fe->quote_cache[i].quoted);
+	}
+	free(fe->quote_cache);
+	fe->quote_cache = NULL;
+}
+
+static int init_postimage(struct fast_export *fe)
+{
+	if (fe->postimage_ready)
 		return 0;
-	postimage_initialized = 1;
-	return buffer_tmpfile_init(&postimage);
+	fe->postimage_ready = 1;
+	return buffer_tmpfile_init(&fe->postimage);
 }
 
-void fast_export_init(int fd)
+void fast_export_set_pack_dir(struct fast_export *fe, const char *dir)
 {
-	first_commit_done = 0;
-	if (buffer_fdinit(&report_buffer, fd))
+	fe->pack_dir = dir;
+}
+
+void fast_export_set_store_dir(struct fast_export *fe, const char *dir)
+{
+	fe->store_dir = dir;
+}
+
+void fast_export_set_threads(struct fast_export *fe, int n)
+{
+	fe->nr_delta_threads = n;
+}
+
+void fast_export_set_checkpoint(struct fast_export *fe,
+				const struct checkpoint_policy *policy)
+{
+	fe->checkpoint = *policy;
+}
+
+void fast_export_set_known_blobs(struct fast_export *fe,
+				 const struct blob_set *known)
+{
+	fe->known_blobs = known;
+}
+
+void fast_export_set_name_blobs(struct fast_export *fe,
+				blob_name_fn fn, void *data)
+{
+	fe->name_blobs = 1;
+	fe->name_fn = fn;
+	fe->name_data = data;
+}
+
+void fast_export_name_queued(struct fast_export *fe)
+{
+	if (!fe->blob_queued || !fe->nr_queued)
+		die("BUG: no queued blob to name");
+	fe->delta_queue[fe->nr_queued - 1].name = 1;
+}
+
+static int checkpoint_enabled(const struct fast_export *fe)
+{
+	return fe->checkpoint.revisions || fe->checkpoint.bytes ||
+		fe->checkpoint.seconds || fe->checkpoint.latency;
+}
+
+int parse_checkpoint_policy(struct checkpoint_policy *policy,
+			    const char *spec)
+{
+	memset(policy, 0, sizeof(*policy));
+	while (*spec) {
+		size_t len = strcspn(spec, ",");
+		const char *val = memchr(spec, '=', len);
+		char *end;
+		uint64_t n;
+		int shift;
+
+		if (!val++)
+			return error("checkpoint policy: expected "
+				     "<limit>=<value>: %.*s", (int) len, spec);
+		if (!strncmp(spec, "latency=", strlen("latency="))) {
+			policy->latency = strtod(val, &end);
+			if (end != spec + len || policy->latency <= 1)
+				return error("checkpoint policy: latency "
+					     "must be a factor above 1");
+			spec += len + !!spec[len];
+			continue;
+		}
+		errno = 0;
+		n = strtoumax(val, &end, 10);
+		shift = 0;
+		switch (*end) {
+		case 'g': case 'G':
+			shift += 10;	/* fall through */
+		case 'm': case 'M':
+			shift += 10;	/* fall through */
+		case 'k': case 'K':
+			shift += 10;
+			end++;
+		}
+		if (end == val || end != spec + len || *val == '-')
+			return error("checkpoint policy: bad number: %.*s",
+				     (int) len, spec);
+		if (errno == ERANGE || n > UINT64_MAX >> shift)
+			return error("checkpoint policy: number too large: "
+				     "%.*s", (int) len, spec);
+		n <<= shift;
+		if (!strncmp(spec, "revisions=", strlen("revisions=")))
+			policy->revisions = n;
+		else if (!strncmp(spec, "bytes=", strlen("bytes=")))
+			policy->bytes = n;
+		else if (!strncmp(spec, "seconds=", strlen("seconds=")))
+			policy->seconds = n;
+		else
+			return error("checkpoint policy: unknown limit: %.*s",
+				     (int) len, spec);
+		spec += len + !!spec[len];
+	}
+	return 0;
+}
+
+static void init_tagged(struct strbuf *sb, int tag)
+{
+	strbuf_init(sb, 0);
+	strbuf_set_tag(sb, tag);
+}
+
+void fast_export_init(struct fast_export *fe, FILE *out, int fd)
+{
+	fe->out = out;
+	fe->report = &fe->report_buffer;
+	fe->first_commit_done = 0;
+	fe->last_commit = 0;
+	fe->postimage_ready = 0;
+	init_tagged(&fe->preimage_buf, MEM_PREIMAGE);
+	fe->stream = fe->lookup_stream = NULL;
+	fe->first_revision = 0;
+	init_tagged(&fe->commit.author, MEM_PARSER);
+	init_tagged(&fe->commit.log, MEM_PROPS);
+	init_tagged(&fe->commit.uuid, MEM_PARSER);
+	init_tagged(&fe->commit.url, MEM_PARSER);
+	fe->delta_queue = NULL;
+	fe->nr_delta_slots = fe->nr_queued = 0;
+	memset(&fe->since_checkpoint, 0, sizeof(fe->since_checkpoint));
+	if (checkpoint_enabled(fe))
+		fe->since_checkpoint.start_ns = metrics_clock_ns();
+	fe->nr_blobs = fe->nr_known_blobs = 0;
+	fe->known_blob_bytes = 0;
+	fe->quote_cache = calloc(QUOTE_CACHE_SIZE, sizeof(*fe->quote_cache));
+	if (!fe->quote_cache)
+		die_errno("cannot allocate quoted path cache");
+	if ((fe->pack_dir || fe->store_dir) && out != stdout)
+		die("BUG: a pack or blob store is written to stdout");
+	if (split_enabled()) {
+		if (fe->pack_dir || fe->store_dir)
+			die("BUG: --split needs a backchannel");
+		init_delta_queue(fe);
+		return;
+	}
+	if (fe->pack_dir) {
+		if (pack_export_init(fe->pack_dir, 0, fe->nr_delta_threads))
+			die("cannot start a pack in %s", fe->pack_dir);
+		return;
+	}
+	if (fe->store_dir) {
+		if (pack_export_init(fe->store_dir, 1,
+				     fe->nr_delta_threads))
+			die("cannot start a blob store in %s", fe->store_dir);
+		return;
+	}
+	if (buffer_fdinit(&fe->report_buffer, fd))
 		die_errno("cannot read from file descriptor %d", fd);
+	init_delta_queue(fe);
+}
+
+static void report_checkpoints(const struct fast_export *fe)
+{
+	const uint32_t *by = fe->since_checkpoint.nr_by;
+	double secs = (metrics_clock_ns() - fe->since_checkpoint.start_ns) / 1e9;
+
+	fprintf(stderr, "Checkpoints: %"PRIu32" (%"PRIu32" for revisions, "
+		"%"PRIu32" for bytes, %"PRIu32" for time, %"PRIu32" for "
+		"latency), %.3f s waiting for them\n",
+		fe->since_checkpoint.nr, by[CHECKPOINT_REVISIONS],
+		by[CHECKPOINT_BYTES], by[CHECKPOINT_TIME],
+		by[CHECKPOINT_LATENCY], fe->since_checkpoint.blocked_ns / 1e9);
+	if (!fe->since_checkpoint.nr)
+		return;
+	fprintf(stderr, "Revisions/s: %.1f before the first checkpoint, "
+		"%.1f before the last",
+		fe->since_checkpoint.first_rate, fe->since_checkpoint.last_rate);
+	if (fe->since_checkpoint.revisions && secs > 0)
+		fprintf(stderr, ", %.1f after it",
+			fe->since_checkpoint.revisions / secs);
+	fputc('\n', stderr);
 }
 
-void fast_export_deinit(void)
+void fast_export_deinit(struct fast_export *fe)
 {
-	if (buffer_deinit(&report_buffer))
+	if (checkpoint_enabled(fe))
+		report_checkpoints(fe);
+	release_delta_queue(fe);
+	if (fe->known_blobs)
+		fprintf(stderr, "Known blobs: %"PRIu32" of %"PRIu32" named "
+			"instead of written, %"PRIu64" bytes left out\n",
+			fe->nr_known_blobs, fe->nr_blobs, fe->known_blob_bytes);
+	release_quote_cache(fe);
+	if (fe->postimage_ready && buffer_deinit(&fe->postimage))
+		die_errno("error closing temporary file for blob retrieval");
+	fe->postimage_ready = 0;
+	strbuf_release(&fe->preimage_buf);
+	strbuf_release(&fe->commit.author);
+	strbuf_release(&fe->commit.log);
+	strbuf_release(&fe->commit.uuid);
+	strbuf_release(&fe->commit.url);
+	if (fe->pack_dir || fe->store_dir) {
+		pack_export_deinit();
+		return;
+	}
+	if (split_enabled())
+		return;
+	if (buffer_deinit(&fe->report_buffer))
 		die_errno("error closing fast-import feedback stream");
 }
 
-void fast_export_delete(const char *path)
+static void print_delete(struct fast_export *fe, const char *path)
+{
+	if (!*path) {
+		fprintf(fe->out, "deleteall\n");
+		return;
+	}
+	fputc('D', fe->out);
+	fputc(' ', fe->out);
+	print_path(fe, path, 0);
+	fputc('\n', fe->out);
+}
+
+static void print_commit(struct fast_export *fe, uint32_t revision,
+			 const char *author, const struct strbuf *log,
+			 const char *uuid, const char *url,
+			 unsigned long timestamp);
+
+static void use_stream(struct fast_export *fe, struct split_stream *s)
 {
-	putchar('D');
-	putchar(' ');
-	quote_c_style(path, NULL, stdout, 0);
-	putchar('\n');
+	fe->stream = s;
+	fe->out = s->out;
+	fe->report = &s->report;
+}
+
+/* Switch to stream s, starting its commit for this revision. */
+static void enter_stream(struct fast_export *fe, struct split_stream *s)
+{
+	struct strbuf url = STRBUF_INIT;
+
+	use_stream(fe, s);
+	if (s->revision == fe->commit.revision)
+		return;
+	if (fe->commit.url.len) {
+		strbuf_add(&url, fe->commit.url.buf, fe->commit.url.len);
+		strbuf_addch(&url, '/');
+		strbuf_add(&url, s->prefix.buf, s->prefix.len);
+	}
+	print_commit(fe, fe->commit.revision, fe->commit.author.buf,
+		     &fe->commit.log, fe->commit.uuid.buf, url.buf,
+		     fe->commit.timestamp);
+	strbuf_release(&url);
+	/* An incremental import continues each project where it was. */
+	if (!s->nr_revs && fe->first_revision > 1)
+		fprintf(fe->out, "from refs/heads/master^0\n");
+	s->revision = fe->commit.revision;
 }
 
-static void fast_export_truncate(const char *path, uint32_t mode)
+/*
+ * With --split, switch to the stream path goes to and return the
+ * path within it, or NULL if it goes to none.
+ */
+static const char *select_stream(struct fast_export *fe, const char *path)
 {
-	fast_export_modify(path, mode, "inline");
-	printf("data 0\n\n");
+	struct split_stream *s;
+	const char *rest;
+
+	if (!split_enabled())
+		return path;
+	s = split_lookup(path, &rest);
+	if (!s)
+		return NULL;
+	enter_stream(fe, s);
+	return rest;
 }
 
-void fast_export_modify(const char *path, uint32_t mode, const char *dataref)
+/* A directory above the prefixes empties the streams below it. */
+static void delete_in_streams(struct fast_export *fe, const char *path)
+{
+	const char *rest = select_stream(fe, path);
+	size_t i, first, end;
+
+	if (rest) {
+		print_delete(fe, rest);
+		return;
+	}
+	split_below(path, &first, &end);
+	for (i = first; i < end; i++) {
+		enter_stream(fe, split_get(i));
+		print_delete(fe, "");
+	}
+}
+
+int fast_export_exports(const char *path)
+{
+	const char *rest;
+	size_t first, end;
+
+	if (!split_enabled() || split_lookup(path, &rest))
+		return 1;
+	split_below(path, &first, &end);
+	return first != end;
+}
+
+void fast_export_delete(struct fast_export *fe, const char *path)
+{
+	flush_deltas(fe);
+	if (fe->pack_dir) {
+		pack_export_delete(path);
+		return;
+	}
+	if (fe->store_dir)
+		pack_export_delete(path);
+	if (split_enabled()) {
+		delete_in_streams(fe, path);
+		return;
+	}
+	print_delete(fe, path);
+}
+
+static void print_modify(struct fast_export *fe, const char *path,
+			 uint32_t mode, const char *dataref)
+{
+	fprintf(fe->out, "M %06"PRIo32" %s ", mode, dataref);
+	print_path(fe, path, 0);
+	fputc('\n', fe->out);
+}
+
+static void fast_export_truncate(struct fast_export *fe, const char *path,
+				 uint32_t mode)
+{
+	print_modify(fe, path, mode, "inline");
+	fprintf(fe->out, "data 0\n\n");
+}
+
+static void print_copied_file(const char *path, uint32_t mode,
+			      const unsigned char sha1[20], void *data)
+{
+	print_modify(data, path, mode, sha1_to_hex(sha1));
+}
+
+/*
+ * Without a backchannel we cannot be sure fast-import has our tree
+ * objects, so copy a directory one file at a time.
+ */
+static void copy_tree(struct fast_export *fe, const char *path)
+{
+	if (*path) {
+		fprintf(fe->out, "D ");
+		print_path(fe, path, 0);
+		fputc('\n', fe->out);
+	} else {
+		fprintf(fe->out, "deleteall\n");
+	}
+	git_tree_for_each_file(path, print_copied_file, fe);
+}
+
+/* With --split, switch to the stream for path and return the rest of it. */
+static const char *stream_path(struct fast_export *fe, const char *path)
+{
+	const char *rest;
+
+	if (!split_enabled())
+		return path;
+	rest = select_stream(fe, path);
+	if (!rest)
+		die("cannot write %s: it is above the --split prefixes", path);
+	return rest;
+}
+
+void fast_export_modify(struct fast_export *fe, const char *path,
+			uint32_t mode, const char *dataref)
 {
 	/* Mode must be 100644, 100755, 120000, or 160000. */
+	flush_deltas(fe);
+	if (fe->pack_dir) {
+		pack_export_modify(path, mode, dataref);
+		return;
+	}
+	if (fe->store_dir) {
+		pack_export_modify(path, mode, dataref);
+		if (mode == REPO_MODE_DIR) {
+			copy_tree(fe, path);
+			return;
+		}
+	}
+	if (split_enabled()) {
+		const char *rest = stream_path(fe, path);
+		if (dataref && strcmp(dataref, "inline") &&
+		    fe->stream != fe->lookup_stream)
+			die("cannot copy to %s from under another --split prefix",
+			    path);
+		path = rest;
+	}
 	if (!dataref) {
-		fast_export_truncate(path, mode);
+		fast_export_truncate(fe, path, mode);
 		return;
 	}
-	printf("M %06"PRIo32" %s ", mode, dataref);
-	quote_c_style(path, NULL, stdout, 0);
-	putchar('\n');
+	print_modify(fe, path, mode, dataref);
 }
 
-static char gitsvnline[MAX_GITSVN_LINE_LEN];
-void fast_export_begin_commit(uint32_t revision, const char *author,
-			const struct strbuf *log,
-			const char *uuid, const char *url,
-			unsigned long timestamp)
+static void print_commit(struct fast_export *fe, uint32_t revision,
+			 const char *author, const struct strbuf *log,
+			 const char *uuid, const char *url,
+			 unsigned long timestamp)
 {
-	static const struct strbuf empty = STRBUF_INIT;
-	if (!log)
-		log = &empty;
 	if (*uuid && *url) {
-		snprintf(gitsvnline, MAX_GITSVN_LINE_LEN,
+		snprintf(fe->gitsvnline, MAX_GITSVN_LINE_LEN,
 				"\n\ngit-svn-id: %s@%"PRIu32" %s\n",
 				 url, revision, uuid);
 	} else {
-		*gitsvnline = '\0';
+		*fe->gitsvnline = '\0';
 	}
-	printf("commit refs/heads/master\n");
-	printf("mark :%"PRIu32"\n", revision);
-	printf("committer %s <%s@%s> %ld +0000\n",
+	fprintf(fe->out, "commit refs/heads/master\n");
+	fprintf(fe->out, "mark :%"PRIu32"\n", revision);
+	fprintf(fe->out, "committer %s <%s@%s> %ld +0000\n",
 		   *author ? author : "nobody",
 		   *author ? author : "nobody",
 		   *uuid ? uuid : "local", timestamp);
-	printf("data %"PRIuMAX"\n",
-		(uintmax_t) (log->len + strlen(gitsvnline)));
-	fwrite(log->buf, log->len, 1, stdout);
-	printf("%s\n", gitsvnline);
-	if (!first_commit_done) {
+	fprintf(fe->out, "data %"PRIuMAX"\n",
+		(uintmax_t) (log->len + strlen(fe->gitsvnline)));
+	fwrite(log->buf, log->len, 1, fe->out);
+	fprintf(fe->out, "%s\n", fe->gitsvnline);
+}
+
+void fast_export_begin_commit(struct fast_export *fe, uint32_t revision,
+			const char *author, const struct strbuf *log,
+			const char *uuid, const char *url,
+			unsigned long timestamp)
+{
+	static const struct strbuf empty = STRBUF_INIT;
+	if (!log)
+		log = &empty;
+	if (fe->pack_dir) {
+		pack_export_begin_commit(revision, author, log,
+					 uuid, url, timestamp);
+		return;
+	}
+	if (fe->store_dir)
+		pack_export_begin_commit(revision, author, log,
+					 uuid, url, timestamp);
+	if (split_enabled()) {
+		if (!fe->first_revision)
+			fe->first_revision = revision;
+		fe->commit.revision = revision;
+		strbuf_reset(&fe->commit.author);
+		strbuf_addstr(&fe->commit.author, author);
+		strbuf_reset(&fe->commit.log);
+		strbuf_add(&fe->commit.log, log->buf, log->len);
+		strbuf_reset(&fe->commit.uuid);
+		strbuf_addstr(&fe->commit.uuid, uuid);
+		strbuf_reset(&fe->commit.url);
+		strbuf_addstr(&fe->commit.url, url);
+		fe->commit.timestamp = timestamp;
+		return;
+	}
+	print_commit(fe, revision, author, log, uuid, url, timestamp);
+	if (!fe->first_commit_done) {
 		if (revision > 1)
-			printf("from :%"PRIu32"\n", revision - 1);
-		first_commit_done = 1;
+			fprintf(fe->out, "from :%"PRIu32"\n", revision - 1);
+		fe->first_commit_done = 1;
 	}
 }
 
-void fast_export_end_commit(uint32_t revision)
+void fast_export_end_commit(struct fast_export *fe, uint32_t revision)
 {
-	printf("progress Imported commit %"PRIu32".\n\n", revision);
+	flush_deltas(fe);
+	fe->last_commit = revision;
+	if (fe->pack_dir) {
+		pack_export_end_commit(revision);
+		return;
+	}
+	if (fe->store_dir)
+		pack_export_end_commit(revision);
+	if (split_enabled()) {
+		size_t i;
+
+		for (i = 0; i < split_nr(); i++) {
+			struct split_stream *s = split_get(i);
+
+			if (s->revision != revision)
+				continue;
+			fprintf(s->out, "progress Imported commit %"PRIu32".\n\n",
+				revision);
+			ALLOC_GROW(s->revs, s->nr_revs + 1, s->revs_alloc);
+			s->revs[s->nr_revs++] = revision;
+			s->revision = 0;
+		}
+	} else {
+		fprintf(fe->out, "progress Imported commit %"PRIu32".\n\n",
+			revision);
+	}
+	maybe_checkpoint(fe);
 }
 
-static void ls_from_rev(uint32_t rev, const char *path)
+static void ls_from_rev(struct fast_export *fe, uint32_t rev, const char *path)
 {
 	/* ls :5 path/to/old/file */
-	printf("ls :%"PRIu32" ", rev);
-	quote_c_style(path, NULL, stdout, 0);
-	putchar('\n');
-	fflush(stdout);
+	metrics_add(METRIC_LS_REV, 1);
+	fprintf(fe->out, "ls :%"PRIu32" ", rev);
+	print_path(fe, path, 0);
+	fputc('\n', fe->out);
+	fflush(fe->out);
 }
 
-static void ls_from_active_commit(const char *path)
+static void ls_from_active_commit(struct fast_export *fe, const char *path)
 {
 	/* ls "path/to/file" */
-	printf("ls \"");
-	quote_c_style(path, NULL, stdout, 1);
-	printf("\"\n");
-	fflush(stdout);
+	metrics_add(METRIC_LS, 1);
+	fprintf(fe->out, "ls \"");
+	print_path(fe, path, 1);
+	fprintf(fe->out, "\"\n");
+	fflush(fe->out);
 }
 
-static const char *get_response_line(void)
+static const char *get_response_line(struct fast_export *fe)
 {
-	const char *line = buffer_read_line(&report_buffer);
+	uint64_t start = metrics_start();
+	uint64_t wait_start = 0, wait;
+	const char *line;
+
+	if (fe->checkpoint.latency || profile_enabled)
+		wait_start = metrics_clock_ns();
+	if (split_enabled())
+		split_wait_for_report(fe->stream);
+	line = buffer_read_line(fe->report);
+	metrics_stop(METRIC_BACKCHANNEL_WAIT_NS, start);
+	if (wait_start) {
+		wait = metrics_clock_ns() - wait_start;
+		profile_add(PROFILE_BACKCHANNEL_NS, wait);
+		fe->since_checkpoint.wait_ns += wait;
+		fe->since_checkpoint.nr_waits++;
+	}
 	if (line)
 		return line;
-	if (buffer_ferror(&report_buffer))
+	if (buffer_ferror(fe->report))
 		die_errno("error reading from fast-import");
 	die("unexpected end of fast-import feedback");
 }
 
+static void checkpoint_streams(struct fast_export *fe)
+{
+	size_t i;
+
+	for (i = 0; i < split_nr(); i++) {
+		struct split_stream *s = split_get(i);
+
+		fprintf(s->out, "checkpoint\n");
+		if (s->nr_revs)
+			fprintf(s->out, "get-mark :%"PRIu32"\n",
+				s->revs[s->nr_revs - 1]);
+		fflush(s->out);
+	}
+	for (i = 0; i < split_nr(); i++) {
+		const char *response;
+
+		if (!split_get(i)->nr_revs)
+			continue;
+		use_stream(fe, split_get(i));
+		response = get_response_line(fe);
+		if (strlen(response) != 40)
+			die("invalid get-mark response: %s", response);
+	}
+}
+
+void fast_export_checkpoint(struct fast_export *fe)
+{
+	const char *response;
+
+	flush_deltas(fe);
+	if (split_enabled()) {
+		checkpoint_streams(fe);
+		return;
+	}
+	if (fe->pack_dir || fe->store_dir || !fe->last_commit) {
+		if (!fe->pack_dir)
+			fprintf(fe->out, "checkpoint\n");
+		fflush(fe->out);
+		return;
+	}
+	/* fast-import answers once everything before is on disk. */
+	fprintf(fe->out, "checkpoint\n");
+	fprintf(fe->out, "get-mark :%"PRIu32"\n", fe->last_commit);
+	fflush(fe->out);
+	response = get_response_line(fe);
+	if (strlen(response) != 40)
+		die("invalid get-mark response: %s", response);
+}
+
 static void die_short_read(struct line_buffer *input)
 {
 	if (buffer_ferror(input))
@@ -141,6 +713,75 @@ static void die_short_read(struct line_buffer *input)
 	die("invalid dump: unexpected end of file");
 }
 
+/* Answers from the importer to average its latency over. */
+#define LATENCY_WINDOW 256
+
+/*
+ * Whether the importer has got slow to answer: the average wait over
+ * the last window, against that over the first after a checkpoint.
+ */
+static int latency_grown(struct fast_export *fe)
+{
+	uint64_t avg;
+
+	if (!fe->checkpoint.latency ||
+	    fe->since_checkpoint.nr_waits < LATENCY_WINDOW)
+		return 0;
+	avg = fe->since_checkpoint.wait_ns / fe->since_checkpoint.nr_waits;
+	fe->since_checkpoint.wait_ns = 0;
+	fe->since_checkpoint.nr_waits = 0;
+	if (!fe->since_checkpoint.baseline_ns) {
+		fe->since_checkpoint.baseline_ns = avg ? avg : 1;
+		return 0;
+	}
+	return avg > fe->checkpoint.latency * fe->since_checkpoint.baseline_ns;
+}
+
+static void maybe_checkpoint(struct fast_export *fe)
+{
+	const struct checkpoint_policy *policy = &fe->checkpoint;
+	enum checkpoint_reason reason;
+	uint64_t now, done;
+	double secs;
+
+	if (!checkpoint_enabled(fe))
+		return;
+	fe->since_checkpoint.revisions++;
+	now = metrics_clock_ns();
+	if (policy->revisions &&
+	    fe->since_checkpoint.revisions >= policy->revisions)
+		reason = CHECKPOINT_REVISIONS;
+	else if (policy->bytes && fe->since_checkpoint.bytes >= policy->bytes)
+		reason = CHECKPOINT_BYTES;
+	else if (policy->seconds && now - fe->since_checkpoint.start_ns >=
+		 policy->seconds * 1000000000)
+		reason = CHECKPOINT_TIME;
+	else if (latency_grown(fe))
+		reason = CHECKPOINT_LATENCY;
+	else
+		return;
+
+	fast_export_checkpoint(fe);
+	done = metrics_clock_ns();
+	metrics_add(METRIC_CHECKPOINTS, 1);
+	metrics_add(METRIC_CHECKPOINT_NS, done - now);
+	secs = (now - fe->since_checkpoint.start_ns) / 1e9;
+	fe->since_checkpoint.last_rate = secs > 0 ?
+		fe->since_checkpoint.revisions / secs : 0.0;
+	if (!fe->since_checkpoint.nr)
+		fe->since_checkpoint.first_rate =
+			fe->since_checkpoint.last_rate;
+	fe->since_checkpoint.nr++;
+	fe->since_checkpoint.nr_by[reason]++;
+	fe->since_checkpoint.blocked_ns += done - now;
+	fe->since_checkpoint.revisions = 0;
+	fe->since_checkpoint.bytes = 0;
+	fe->since_checkpoint.start_ns = done;
+	fe->since_checkpoint.wait_ns = 0;
+	fe->since_checkpoint.nr_waits = 0;
+	fe->since_checkpoint.baseline_ns = 0;
+}
+
 static int ends_with(const char *s, size_t len, const char *suffix)
 {
 	const size_t suffixlen = strlen(suffix);
@@ -180,23 +821,42 @@ static void check_preimage_overflow(off_t a, off_t b)
 		die("blob too large for current definition of off_t");
 }
 
-static long apply_delta(off_t len, struct line_buffer *input,
-			const char *old_data, uint32_t old_mode)
+static void request_blob(struct fast_export *fe, const char *dataref)
 {
-	long ret;
-	struct sliding_view preimage = SLIDING_VIEW_INIT(&report_buffer, 0);
-	FILE *out;
+	metrics_add(METRIC_CAT_BLOB, 1);
+	fprintf(fe->out, "cat-blob %s\n", dataref);
+	fflush(fe->out);
+}
 
-	if (init_postimage() || !(out = buffer_tmpfile_rewind(&postimage)))
-		die("cannot open temporary file for blob retrieval");
-	if (old_data) {
-		const char *response;
-		printf("cat-blob %s\n", old_data);
-		fflush(stdout);
-		response = get_response_line();
-		if (parse_cat_response_line(response, &preimage.max_off))
-			die("invalid cat-blob response: %s", response);
+/* The length of the blob whose answer is next; start is for tracing. */
+static off_t read_blob_header(struct fast_export *fe, const char *dataref,
+			      uint64_t start)
+{
+	const char *response = get_response_line(fe);
+	off_t len;
+
+	trace_end("cat-blob", dataref, start);
+	if (parse_cat_response_line(response, &len))
+		die("invalid cat-blob response: %s", response);
+	return len;
+}
+
+/*
+ * Apply len bytes of delta to the preimage_len bytes of the blob
+ * being read from the backchannel, or to no preimage if that is -1,
+ * writing the postimage to out.
+ */
+static void stream_delta(struct fast_export *fe, struct line_buffer *delta,
+			 off_t len, off_t preimage_len, uint32_t old_mode,
+			 FILE *out)
+{
+	struct sliding_view preimage = SLIDING_VIEW_INIT(fe->report, 0);
+
+	strbuf_swap(&preimage.buf, &fe->preimage_buf);
+	if (preimage_len >= 0) {
+		preimage.max_off = preimage_len;
 		check_preimage_overflow(preimage.max_off, 1);
+		profile_add(PROFILE_PREIMAGE_BYTES, preimage.max_off);
 	}
 	if (old_mode == REPO_MODE_LNK) {
 		strbuf_addstr(&preimage.buf, "link ");
@@ -204,27 +864,334 @@ static long apply_delta(off_t len, struct line_buffer *input,
 		preimage.max_off += strlen("link ");
 		check_preimage_overflow(preimage.max_off, 1);
 	}
-	if (svndiff0_apply(input, len, &preimage, out))
+	if (svndiff0_apply(delta, len, &preimage, out))
 		die("cannot apply delta");
-	if (old_data) {
+	if (preimage_len >= 0) {
 		/* Read the remainder of preimage and trailing newline. */
 		assert(!signed_add_overflows(preimage.max_off, 1));
 		preimage.max_off++;	/* room for newline */
 		if (move_window(&preimage, preimage.max_off - 1, 1))
 			die("cannot seek to end of input");
-		if (preimage.buf.buf[0] != '\n')
+		if (sliding_view_data(&preimage)[0] != '\n')
 			die("missing newline after cat-blob response");
 	}
-	ret = buffer_tmpfile_prepare_to_read(&postimage);
+	strbuf_swap(&preimage.buf, &fe->preimage_buf);
+	strbuf_recycle(&fe->preimage_buf, SLIDING_VIEW_KEEP_MAX);
+}
+
+static off_t apply_delta(struct fast_export *fe, off_t len,
+			struct line_buffer *input,
+			const char *old_data, uint32_t old_mode)
+{
+	off_t ret, preimage_len = -1;
+	FILE *out;
+
+	if (init_postimage(fe) ||
+	    !(out = buffer_tmpfile_rewind(&fe->postimage)))
+		die("cannot open temporary file for blob retrieval");
+	if (old_data) {
+		uint64_t start = trace_begin();
+
+		request_blob(fe, old_data);
+		preimage_len = read_blob_header(fe, old_data, start);
+	}
+	stream_delta(fe, input, len, preimage_len, old_mode, out);
+	ret = buffer_tmpfile_prepare_to_read(&fe->postimage);
 	if (ret < 0)
 		die("cannot read temporary file for blob retrieval");
-	strbuf_release(&preimage.buf);
 	return ret;
 }
 
-void fast_export_data(uint32_t mode, off_t len, struct line_buffer *input)
+static int is_seekable(struct line_buffer *file)
+{
+	off_t pos = ftello(file->infile);
+
+	return pos >= 0 && !fseeko(file->infile, pos, SEEK_SET);
+}
+
+/* The git name of the next len bytes of file, which is left in place. */
+static void hash_blob(struct line_buffer *file, off_t len,
+		      unsigned char *sha1)
+{
+	char buf[8192];
+	struct sha1_ctx ctx;
+	off_t pos = ftello(file->infile);
+
+	if (pos < 0)
+		die_errno("cannot find a blob to name");
+	snprintf(buf, sizeof(buf), "blob %"PRIuMAX, (uintmax_t) len);
+	sha1_init(&ctx);
+	sha1_update(&ctx, buf, strlen(buf) + 1);
+	while (len) {
+		size_t n = len < (off_t) sizeof(buf) ? (size_t) len : sizeof(buf);
+
+		if (fread(buf, 1, n, file->infile) != n)
+			die_short_read(file);
+		sha1_update(&ctx, buf, n);
+		len -= n;
+	}
+	sha1_final(sha1, &ctx);
+	if (fseeko(file->infile, pos, SEEK_SET))
+		die_errno("cannot seek back over a blob");
+}
+
+/*
+ * Modify path to the len bytes of file, by name if the importer
+ * has them.  file must be seekable if there are known blobs.
+ */
+static void write_blob(struct fast_export *fe, const char *path,
+		       uint32_t mode, struct line_buffer *file, off_t len)
+{
+	unsigned char sha1[20];
+
+	if (mode == REPO_MODE_LNK) {
+		/* svn symlink blobs start with "link " */
+		if (len < 5)
+			die("invalid dump: symlink too short for \"link\" prefix");
+		len -= 5;
+		if (buffer_skip_bytes(file, 5) != 5)
+			die_short_read(file);
+	}
+	if (fe->known_blobs || fe->name_blobs) {
+		hash_blob(file, len, sha1);
+		fe->nr_blobs++;
+		if (fe->name_blobs) {
+			memcpy(fe->blob_name, sha1, 20);
+			fe->blob_named = 1;
+		}
+		if (fe->known_blobs &&
+		    blob_set_contains(fe->known_blobs, sha1)) {
+			if (buffer_seek_bytes(file, len) != len)
+				die_short_read(file);
+			fe->nr_known_blobs++;
+			fe->known_blob_bytes += len;
+			print_modify(fe, path, mode, sha1_to_hex(sha1));
+			return;
+		}
+	}
+	print_modify(fe, path, mode, "inline");
+	fe->since_checkpoint.bytes += len;
+	profile_add(PROFILE_BYTES_OUT, len);
+	fprintf(fe->out, "data %"PRIuMAX"\n", (uintmax_t) len);
+	if (len >= LARGE_BLOB_MIN)
+		buffer_tmpfile_fsend_bytes(file, len, fe->out);
+	else
+		buffer_fcopy_bytes(file, len, fe->out);
+	fputc('\n', fe->out);
+}
+
+/* Done with the delta: close the dump if it was read again for it. */
+static int finish_delta_input(struct queued_delta *d)
+{
+	if (d->delta != &d->dump)
+		return 0;
+	return buffer_deinit(&d->dump);
+}
+
+static void apply_queued_delta(void *data)
+{
+	struct queued_delta *d = data;
+	/* The whole preimage is in view_buf: the file is never read. */
+	struct sliding_view preimage =
+		SLIDING_VIEW_INIT(&d->preimage_file, d->preimage_len);
+	FILE *out = buffer_tmpfile_rewind(&d->postimage);
+
+	strbuf_swap(&preimage.buf, &d->view_buf);
+	d->rv = svndiff0_apply_serial(d->delta, d->delta_len, &preimage, out);
+	strbuf_swap(&preimage.buf, &d->view_buf);
+	strbuf_recycle(&d->view_buf, SLIDING_VIEW_KEEP_MAX);
+	if (finish_delta_input(d))
+		d->rv = error("error rereading dump file");
+	if (!d->rv) {
+		d->postimage_len = buffer_tmpfile_prepare_to_read(&d->postimage);
+		if (d->postimage_len < 0)
+			d->rv = -1;
+	}
+}
+
+static size_t request_len(const struct queued_delta *d)
+{
+	return d->old_data.len ? strlen("cat-blob \n") + d->old_data.len : 0;
+}
+
+static void request_preimage(struct fast_export *fe, struct queued_delta *d)
+{
+	if (!d->old_data.len)
+		return;
+	select_stream(fe, d->path.buf);
+	d->requested = trace_begin();
+	request_blob(fe, d->old_data.buf);
+}
+
+/*
+ * Read the answer to the request for the preimage of d, keeping it
+ * if it is small enough and there are other deltas to apply with
+ * it, and otherwise applying the delta to it as it is read.
+ */
+static void read_preimage(struct fast_export *fe, struct queued_delta *d)
+{
+	off_t len = -1;
+
+	if (d->old_data.len) {
+		select_stream(fe, d->path.buf);
+		len = read_blob_header(fe, d->old_data.buf, d->requested);
+	}
+	if (fe->nr_queued == 1 || len > QUEUED_PREIMAGE_MAX) {
+		FILE *out = buffer_tmpfile_rewind(&d->postimage);
+
+		stream_delta(fe, d->delta, d->delta_len, len, d->old_mode, out);
+		if (finish_delta_input(d))
+			die("error rereading dump file");
+		d->postimage_len = buffer_tmpfile_prepare_to_read(&d->postimage);
+		if (d->postimage_len < 0)
+			die("cannot read temporary file for a delta");
+		d->streamed = 1;
+		d->rv = 0;
+		return;
+	}
+	d->streamed = 0;
+	strbuf_reset(&d->view_buf);
+	if (d->old_mode == REPO_MODE_LNK)
+		strbuf_addstr(&d->view_buf, "link ");
+	if (len > 0) {
+		profile_add(PROFILE_PREIMAGE_BYTES, len);
+		if (buffer_read_binary(fe->report, &d->view_buf, len) !=
+		    (size_t) len)
+			die("cannot read cat-blob response");
+	}
+	if (len >= 0 && buffer_read_char(fe->report) != '\n')
+		die("missing newline after cat-blob response");
+	d->preimage_len = d->view_buf.len;
+}
+
+static void flush_deltas(struct fast_export *fe)
+{
+	uint64_t start;
+	size_t i, next = 0, ahead = 0;
+
+	if (!fe->nr_queued)
+		return;
+	for (i = 0; i < fe->nr_queued; i++) {
+		struct queued_delta *d = &fe->delta_queue[i];
+
+		/* Keep requests ahead of the answers, to wait only once. */
+		while (next < fe->nr_queued &&
+		       (next == i || ahead + request_len(&fe->delta_queue[next])
+					<= CAT_BLOB_AHEAD_MAX)) {
+			request_preimage(fe, &fe->delta_queue[next]);
+			ahead += request_len(&fe->delta_queue[next++]);
+		}
+		read_preimage(fe, d);
+		ahead -= request_len(d);
+		if (!d->streamed)
+			thread_pool_submit(&fe->delta_pool, apply_queued_delta,
+					   d);
+	}
+	start = metrics_start();
+	thread_pool_wait(&fe->delta_pool);
+	metrics_stop(METRIC_SVNDIFF_NS, start);
+	for (i = 0; i < fe->nr_queued; i++) {
+		struct queued_delta *d = &fe->delta_queue[i];
+		const char *path;
+
+		if (d->rv)
+			die("cannot apply delta to %s", d->path.buf);
+		path = select_stream(fe, d->path.buf);
+		if (!path)
+			die("BUG: %s is under no --split prefix", d->path.buf);
+		write_blob(fe, path, d->mode, &d->postimage, d->postimage_len);
+		if (d->name)
+			fe->name_fn(fe->name_data, d->path.buf, d->mode,
+				    fe->blob_name);
+	}
+	fe->nr_queued = 0;
+}
+
+/* Whether one path is the other or a directory above it. */
+static int paths_overlap(const char *a, const char *b)
+{
+	size_t len_a = strlen(a), len_b = strlen(b);
+	size_t len = len_a < len_b ? len_a : len_b;
+
+	if (memcmp(a, b, len))
+		return 0;
+	return len_a == len_b || !len ||
+		(len_a < len_b ? b[len] : a[len]) == '/';
+}
+
+static void flush_deltas_for_ls(struct fast_export *fe, const char *path)
+{
+	size_t i;
+
+	for (i = 0; i < fe->nr_queued; i++)
+		if (paths_overlap(path, fe->delta_queue[i].path.buf)) {
+			flush_deltas(fe);
+			return;
+		}
+}
+
+static void init_delta_queue(struct fast_export *fe)
+{
+	size_t i;
+
+	/* Queued deltas would be profiled with whatever node is next. */
+	if (fe->nr_delta_threads <= 1 || fe->pack_dir || fe->store_dir ||
+	    profile_enabled)
+		return;
+	if (thread_pool_init(&fe->delta_pool, fe->nr_delta_threads))
+		return;	/* apply them one at a time, then */
+	thread_pool_on_exit(&fe->delta_pool, svndiff0_release_thread);
+	fe->nr_delta_slots = (size_t) fe->nr_delta_threads * DELTAS_PER_THREAD;
+	fe->delta_queue = calloc(fe->nr_delta_slots, sizeof(*fe->delta_queue));
+	if (!fe->delta_queue)
+		die_errno("cannot allocate delta queue");
+	for (i = 0; i < fe->nr_delta_slots; i++) {
+		strbuf_init(&fe->delta_queue[i].path, 0);
+		strbuf_init(&fe->delta_queue[i].old_data, 0);
+		strbuf_init(&fe->delta_queue[i].view_buf, 0);
+		strbuf_set_tag(&fe->delta_queue[i].path, MEM_PARSER);
+		strbuf_set_tag(&fe->delta_queue[i].old_data, MEM_PARSER);
+		strbuf_set_tag(&fe->delta_queue[i].view_buf, MEM_PREIMAGE);
+	}
+}
+
+static void release_delta_queue(struct fast_export *fe)
+{
+	size_t i;
+
+	if (!fe->nr_delta_slots)
+		return;
+	flush_deltas(fe);
+	thread_pool_release(&fe->delta_pool);
+	for (i = 0; i < fe->nr_delta_slots; i++) {
+		struct queued_delta *d = &fe->delta_queue[i];
+
+		strbuf_release(&d->path);
+		strbuf_release(&d->old_data);
+		strbuf_release(&d->view_buf);
+		if (d->delta_copy.infile)
+			buffer_deinit(&d->delta_copy);
+		if (!d->postimage.infile)
+			continue;
+		buffer_deinit(&d->preimage_file);
+		buffer_deinit(&d->postimage);
+	}
+	free(fe->delta_queue);
+	fe->delta_queue = NULL;
+	fe->nr_delta_slots = 0;
+}
+
+void fast_export_data(struct fast_export *fe, uint32_t mode, off_t len,
+			struct line_buffer *input)
 {
 	assert(len >= 0);
+	flush_deltas(fe);
+	fe->since_checkpoint.bytes += len;
+	profile_add(PROFILE_BYTES_OUT, len);
+	if (fe->pack_dir || fe->store_dir) {
+		pack_export_data(mode, len, input);
+		return;
+	}
 	if (mode == REPO_MODE_LNK) {
 		/* svn symlink blobs start with "link " */
 		if (len < 5)
@@ -233,10 +1200,42 @@ void fast_export_data(uint32_t mode, off_t len, struct line_buffer *input)
 		if (buffer_skip_bytes(input, 5) != 5)
 			die_short_read(input);
 	}
-	printf("data %"PRIuMAX"\n", (uintmax_t) len);
-	if (buffer_copy_bytes(input, len) != len)
+	fprintf(fe->out, "data %"PRIuMAX"\n", (uintmax_t) len);
+	if (buffer_fcopy_bytes(input, len, fe->out) != len)
+		die_short_read(input);
+	fputc('\n', fe->out);
+}
+
+void fast_export_blob(struct fast_export *fe, const char *path,
+			uint32_t mode, off_t len, struct line_buffer *input)
+{
+	FILE *out;
+
+	assert(len >= 0);
+	if ((!fe->known_blobs && !fe->name_blobs) ||
+	    fe->pack_dir || fe->store_dir) {
+		fast_export_modify(fe, path, mode, "inline");
+		fast_export_data(fe, mode, len, input);
+		return;
+	}
+	flush_deltas(fe);
+	path = stream_path(fe, path);
+	/*
+	 * Its name has to be written before it is: read it twice if
+	 * the dump is seekable, or else through a temporary file.
+	 */
+	if (is_seekable(input)) {
+		write_blob(fe, path, mode, input, len);
+		return;
+	}
+	if (init_postimage(fe) ||
+	    !(out = buffer_tmpfile_rewind(&fe->postimage)))
+		die("cannot open temporary file for blob retrieval");
+	if (buffer_fcopy_bytes(input, len, out) != len)
 		die_short_read(input);
-	fputc('\n', stdout);
+	if (buffer_tmpfile_prepare_to_read(&fe->postimage) != len)
+		die("cannot read temporary file for blob retrieval");
+	write_blob(fe, path, mode, &fe->postimage, len);
 }
 
 static int parse_ls_response(const char *response, uint32_t *mode,
@@ -280,32 +1279,125 @@ static int parse_ls_response(const char *response, uint32_t *mode,
 	return 0;
 }
 
-int fast_export_ls_rev(uint32_t rev, const char *path,
+int fast_export_ls_rev(struct fast_export *fe, uint32_t rev, const char *path,
 				uint32_t *mode, struct strbuf *dataref)
 {
-	ls_from_rev(rev, path);
-	return parse_ls_response(get_response_line(), mode, dataref);
+	uint64_t start;
+	const char *response;
+
+	if (fe->pack_dir || fe->store_dir)
+		return pack_export_ls_rev(rev, path, mode, dataref);
+	if (split_enabled()) {
+		const char *rest = select_stream(fe, path);
+		if (!rest)
+			die("cannot copy from %s: it is above the --split prefixes",
+			    path);
+		fe->lookup_stream = fe->stream;
+		rev = split_revision_at(fe->stream, rev);
+		if (!rev) {
+			errno = ENOENT;
+			return -1;
+		}
+		path = rest;
+	}
+	start = trace_begin();
+	ls_from_rev(fe, rev, path);
+	response = get_response_line(fe);
+	trace_end("ls :rev", path, start);
+	return parse_ls_response(response, mode, dataref);
+}
+
+int fast_export_ls(struct fast_export *fe, const char *path,
+			uint32_t *mode, struct strbuf *dataref)
+{
+	uint64_t start;
+	const char *response;
+
+	if (fe->pack_dir || fe->store_dir)
+		return pack_export_ls(path, mode, dataref);
+	flush_deltas_for_ls(fe, path);
+	if (split_enabled()) {
+		const char *rest = select_stream(fe, path);
+		fe->lookup_stream = rest ? fe->stream : NULL;
+		if (!rest) {
+			errno = ENOENT;
+			return -1;
+		}
+		path = rest;
+	}
+	start = trace_begin();
+	ls_from_active_commit(fe, path);
+	response = get_response_line(fe);
+	trace_end("ls", path, start);
+	return parse_ls_response(response, mode, dataref);
 }
 
-int fast_export_ls(const char *path, uint32_t *mode, struct strbuf *dataref)
+static void queue_delta(struct fast_export *fe, const char *path,
+			uint32_t mode, uint32_t old_mode,
+			const char *old_data, off_t len,
+			struct line_buffer *input)
 {
-	ls_from_active_commit(path);
-	return parse_ls_response(get_response_line(), mode, dataref);
+	struct queued_delta *d;
+	FILE *out;
+
+	if (fe->nr_queued == fe->nr_delta_slots)
+		flush_deltas(fe);
+	d = &fe->delta_queue[fe->nr_queued];
+	if (!d->postimage.infile &&
+	    (buffer_tmpfile_init(&d->preimage_file) ||
+	     buffer_tmpfile_init(&d->postimage)))
+		die_errno("cannot open temporary file for a delta");
+
+	d->delta_len = len;
+	if (!buffer_reopen(&d->dump, input)) {
+		d->delta = &d->dump;
+		if (buffer_seek_bytes(input, len) != len)
+			die_short_read(input);
+	} else {
+		if (!d->delta_copy.infile &&
+		    buffer_tmpfile_init(&d->delta_copy))
+			die_errno("cannot open temporary file for a delta");
+		d->delta = &d->delta_copy;
+		out = buffer_tmpfile_rewind(&d->delta_copy);
+		if (buffer_fcopy_bytes(input, len, out) != len)
+			die_short_read(input);
+		if (buffer_tmpfile_prepare_to_read(&d->delta_copy) < 0)
+			die("cannot read temporary file for a delta");
+	}
+
+	if (old_data && !select_stream(fe, path))
+		die("BUG: %s is under no --split prefix", path);
+	strbuf_reset(&d->old_data);
+	if (old_data)
+		strbuf_addstr(&d->old_data, old_data);
+	d->old_mode = old_mode;
+	strbuf_reset(&d->path);
+	strbuf_addstr(&d->path, path);
+	d->mode = mode;
+	d->name = 0;
+	fe->nr_queued++;
+	fe->blob_queued = 1;
 }
 
-void fast_export_blob_delta(uint32_t mode,
-				uint32_t old_mode, const char *old_data,
+void fast_export_blob_delta(struct fast_export *fe, const char *path,
+				uint32_t mode, uint32_t old_mode,
+				const char *old_data,
 				off_t len, struct line_buffer *input)
 {
-	long postimage_len;
+	off_t postimage_len;
 
 	assert(len >= 0);
-	postimage_len = apply_delta(len, input, old_data, old_mode);
-	if (mode == REPO_MODE_LNK) {
-		buffer_skip_bytes(&postimage, strlen("link "));
-		postimage_len -= strlen("link ");
+	if (fe->nr_delta_slots) {
+		queue_delta(fe, path, mode, old_mode, old_data, len, input);
+		return;
+	}
+	if (fe->pack_dir || fe->store_dir) {
+		fast_export_modify(fe, path, mode, "inline");
+		pack_export_blob_delta(mode, old_mode, old_data, len, input);
+		return;
 	}
-	printf("data %ld\n", postimage_len);
-	buffer_copy_bytes(&postimage, postimage_len);
-	fputc('\n', stdout);
+	flush_deltas(fe);
+	path = stream_path(fe, path);
+	postimage_len = apply_delta(fe, len, input, old_data, old_mode);
+	write_blob(fe, path, mode, &fe->postimage, postimage_len);
 }
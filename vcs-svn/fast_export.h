@@ -1,27 +1,187 @@
 #ifndef FAST_EXPORT_H_
 #define FAST_EXPORT_H_
 
-struct strbuf;
-struct line_buffer;
-
-void fast_export_init(int fd);
-void fast_export_deinit(void);
-
-void fast_export_delete(const char *path);
-void fast_export_modify(const char *path, uint32_t mode, const char *dataref);
-void fast_export_begin_commit(uint32_t revision, const char *author,
-			const struct strbuf *log, const char *uuid,
-			const char *url, unsigned long timestamp);
-void fast_export_end_commit(uint32_t revision);
-void fast_export_data(uint32_t mode, off_t len, struct line_buffer *input);
-void fast_export_blob_delta(uint32_t mode,
-			uint32_t old_mode, const char *old_data,
+#include "strbuf.h"
+#include "line_buffer.h"
+#include "thread_pool.h"
+
+#define MAX_GITSVN_LINE_LEN 4096
+
+struct split_stream;
+struct queued_delta;
+struct quoted_path;
+struct blob_set;
+
+/* Called with the name of a queued blob once it is written. */
+typedef void (*blob_name_fn)(void *data, const char *path, uint32_t mode,
+			     const unsigned char sha1[20]);
+
+/* When to ask the importer for a checkpoint; 0 turns a limit off. */
+struct checkpoint_policy {
+	uint32_t revisions;
+	uint64_t bytes;	/* of blob data written */
+	uint64_t seconds;
+	/* times the backchannel latency seen after the last one */
+	double latency;
+};
+
+enum checkpoint_reason {
+	CHECKPOINT_REVISIONS,
+	CHECKPOINT_BYTES,
+	CHECKPOINT_TIME,
+	CHECKPOINT_LATENCY,
+	CHECKPOINT_NR
+};
+
+/*
+ * The output side of one conversion.  Conversions with a context of
+ * their own can run at once on different threads, but a pack or blob
+ * store and --split are kept per process, so only one of them at a
+ * time may use those.
+ *
+ * Start from a zeroed struct; the setters go before fast_export_init().
+ */
+struct fast_export {
+	FILE *out;	/* the stream, or with --split the current one */
+	struct line_buffer report_buffer;
+	struct line_buffer *report;	/* the backchannel for out */
+	const char *pack_dir;	/* write a pack here instead of a stream */
+	const char *store_dir;	/* keep blobs here, not in fast-import */
+	uint32_t first_commit_done;
+	uint32_t last_commit;
+	char gitsvnline[MAX_GITSVN_LINE_LEN];
+
+	/* For applying a text delta on this thread. */
+	int postimage_ready;
+	struct line_buffer postimage;
+	struct strbuf preimage_buf;	/* kept from one delta to the next */
+
+	/*
+	 * With --split, each stream gets a commit for the revisions
+	 * that touch it, started when the first node for it comes up.
+	 */
+	struct split_stream *stream;	/* the current one */
+	struct split_stream *lookup_stream;	/* the last ls answered */
+	uint32_t first_revision;
+	struct {
+		uint32_t revision;
+		struct strbuf author, log, uuid, url;
+		unsigned long timestamp;
+	} commit;
+
+	/* Text deltas of consecutive nodes, applied on a thread pool. */
+	int nr_delta_threads;
+	struct thread_pool delta_pool;
+	struct queued_delta *delta_queue;
+	size_t nr_delta_slots, nr_queued;
+
+	struct quoted_path *quote_cache;
+
+	struct checkpoint_policy checkpoint;
+	struct {
+		uint32_t revisions;
+		uint64_t bytes, start_ns;
+		/* Backchannel waits, averaged over windows of answers. */
+		uint64_t wait_ns, baseline_ns;
+		uint32_t nr_waits;
+
+		/* For the report at the end. */
+		uint32_t nr, nr_by[CHECKPOINT_NR];
+		uint64_t blocked_ns;
+		double first_rate, last_rate;	/* revisions per second */
+	} since_checkpoint;
+
+	/* Blobs the importer has: named instead of written. */
+	const struct blob_set *known_blobs;
+	uint32_t nr_blobs, nr_known_blobs;
+	uint64_t known_blob_bytes;
+
+	/* The name of the last blob written, if name_blobs is set. */
+	int name_blobs, blob_named;
+	unsigned char blob_name[20];
+	/* The last text delta was queued, to be named when written. */
+	int blob_queued;
+	blob_name_fn name_fn;
+	void *name_data;
+};
+
+/* Before fast_export_init(): write a pack in dir, with no backchannel. */
+void fast_export_set_pack_dir(struct fast_export *fe, const char *dir);
+/*
+ * Before fast_export_init(): keep the blobs needed for deltas in a
+ * temporary store in dir and answer "ls" locally, so the stream can
+ * be written without a backchannel.
+ */
+void fast_export_set_store_dir(struct fast_export *fe, const char *dir);
+/*
+ * Before fast_export_init(): with a backchannel, apply the text
+ * deltas of consecutive nodes on up to n threads at once; with a
+ * pack, deflate its objects on n threads.
+ */
+void fast_export_set_threads(struct fast_export *fe, int n);
+/*
+ * Before fast_export_init(): ask for a checkpoint after each commit
+ * that reaches a limit of policy.  parse_checkpoint_policy() reads
+ * one from a string like "revisions=10000,bytes=1g,seconds=600,
+ * latency=4".
+ */
+void fast_export_set_checkpoint(struct fast_export *fe,
+				const struct checkpoint_policy *policy);
+int parse_checkpoint_policy(struct checkpoint_policy *policy,
+			    const char *spec);
+/*
+ * Before fast_export_init(): hash each blob as it is written, and
+ * give the name of those in known instead of their data.
+ */
+void fast_export_set_known_blobs(struct fast_export *fe,
+				 const struct blob_set *known);
+/*
+ * Before fast_export_init(): hash each blob written to the stream
+ * as it is written, setting blob_named and blob_name.  A text delta
+ * queued to be applied with others sets blob_queued instead, and
+ * fast_export_name_queued() has fn called with data when its blob
+ * is written.
+ */
+void fast_export_set_name_blobs(struct fast_export *fe,
+				blob_name_fn fn, void *data);
+void fast_export_name_queued(struct fast_export *fe);
+/*
+ * Write the stream to out and read fast-import's answers from fd.
+ * A pack or blob store is always written to stdout.
+ */
+void fast_export_init(struct fast_export *fe, FILE *out, int fd);
+void fast_export_deinit(struct fast_export *fe);
+
+/* Whether changes to path are written anywhere (see --split). */
+int fast_export_exports(const char *path);
+void fast_export_delete(struct fast_export *fe, const char *path);
+void fast_export_modify(struct fast_export *fe, const char *path,
+			uint32_t mode, const char *dataref);
+void fast_export_begin_commit(struct fast_export *fe, uint32_t revision,
+			const char *author, const struct strbuf *log,
+			const char *uuid, const char *url,
+			unsigned long timestamp);
+void fast_export_end_commit(struct fast_export *fe, uint32_t revision);
+/*
+ * Ask the importer to write out what it has; with a backchannel,
+ * returns only once it has.
+ */
+void fast_export_checkpoint(struct fast_export *fe);
+void fast_export_data(struct fast_export *fe, uint32_t mode, off_t len,
+			struct line_buffer *input);
+/* Modify path to the len bytes of input: fast_export_modify() + _data(). */
+void fast_export_blob(struct fast_export *fe, const char *path,
+			uint32_t mode, off_t len, struct line_buffer *input);
+/* Modify path to the result of a text delta, perhaps later on. */
+void fast_export_blob_delta(struct fast_export *fe, const char *path,
+			uint32_t mode, uint32_t old_mode, const char *old_data,
 			off_t len, struct line_buffer *input);
 
 /* If there is no such file at that rev, returns -1, errno == ENOENT. */
-int fast_export_ls_rev(uint32_t rev, const char *path,
-			uint32_t *mode_out, struct strbuf *dataref_out);
-int fast_export_ls(const char *path,
+int fast_export_ls_rev(struct fast_export *fe, uint32_t rev,
+			const char *path, uint32_t *mode_out,
+			struct strbuf *dataref_out);
+int fast_export_ls(struct fast_export *fe, const char *path,
 			uint32_t *mode_out, struct strbuf *dataref_out);
 
 #endif
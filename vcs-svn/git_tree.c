@@ -0,0 +1,396 @@
+/*
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include "strbuf.h"
+#include "memory.h"
+#include "repo_tree.h"
+#include "sha1.h"
+#include "pack.h"
+#include "git_tree.h"
+
+/*
+ * Trees from earlier commits are never modified: a tree is copied
+ * the first time the current commit changes it, which we can tell
+ * from its generation.  Entries are kept sorted by name for lookup
+ * and put in git's order only when the tree is written out.
+ */
+struct tree_entry {
+	const char *name;
+	size_t len;
+	uint32_t mode;
+	unsigned char sha1[20];
+	struct tree *tree;	/* for directories */
+};
+
+struct tree {
+	uint32_t gen;
+	int valid;	/* sha1 matches the entries */
+	unsigned char sha1[20];
+	struct tree_entry *entries;
+	size_t nr, alloc;
+};
+
+static const unsigned char null_sha1[20];
+
+static uint32_t gen;
+static struct tree *root;
+static struct tree **roots;	/* by revision */
+static size_t roots_nr, roots_alloc;
+static const struct tree *last_found;
+
+/* Everything allocated, so git_tree_reset() can free it. */
+static struct tree **trees;
+static size_t trees_nr, trees_alloc;
+static char **names;
+static size_t names_nr, names_alloc;
+
+static struct tree *new_tree(void)
+{
+	struct tree *t = calloc(1, sizeof(*t));
+	if (!t)
+		die("out of memory");
+	t->gen = gen;
+	ALLOC_GROW(trees, trees_nr + 1, trees_alloc);
+	trees[trees_nr++] = t;
+	return t;
+}
+
+/* Returns a copy of t that the current commit can modify. */
+static struct tree *writable(struct tree *t)
+{
+	struct tree *copy;
+	if (t->gen == gen)
+		return t;
+	copy = new_tree();
+	copy->valid = t->valid;
+	memcpy(copy->sha1, t->sha1, 20);
+	if (t->nr) {
+		ALLOC_GROW(copy->entries, t->nr, copy->alloc);
+		memcpy(copy->entries, t->entries,
+		       t->nr * sizeof(*t->entries));
+	}
+	copy->nr = t->nr;
+	return copy;
+}
+
+static int name_compare(const struct tree_entry *e, const char *name, size_t len)
+{
+	int cmp = memcmp(e->name, name, e->len < len ? e->len : len);
+	if (cmp)
+		return cmp;
+	return e->len < len ? -1 : e->len > len;
+}
+
+/* Returns 1 if found; either way *pos is where the entry belongs. */
+static int find_entry(const struct tree *t, const char *name, size_t len,
+		      size_t *pos)
+{
+	size_t lo = 0, hi = t->nr;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = name_compare(&t->entries[mid], name, len);
+		if (!cmp) {
+			*pos = mid;
+			return 1;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*pos = lo;
+	return 0;
+}
+
+static struct tree_entry *insert_entry(struct tree *t, size_t pos,
+				       const char *name, size_t len)
+{
+	char *copy = malloc(len + 1);
+	struct tree_entry *e;
+
+	if (!copy)
+		die("out of memory");
+	memcpy(copy, name, len);
+	copy[len] = '\0';
+	ALLOC_GROW(names, names_nr + 1, names_alloc);
+	names[names_nr++] = copy;
+
+	ALLOC_GROW(t->entries, t->nr + 1, t->alloc);
+	memmove(t->entries + pos + 1, t->entries + pos,
+		(t->nr - pos) * sizeof(*t->entries));
+	t->nr++;
+	e = &t->entries[pos];
+	memset(e, 0, sizeof(*e));
+	e->name = copy;
+	e->len = len;
+	return e;
+}
+
+static size_t component_len(const char *path)
+{
+	const char *slash = strchr(path, '/');
+	return slash ? (size_t) (slash - path) : strlen(path);
+}
+
+void git_tree_set(const char *path, uint32_t mode, const unsigned char sha1[20])
+{
+	struct tree *subtree = NULL;
+	struct tree *t;
+	struct tree_entry *e;
+	size_t len, pos;
+
+	if (mode == REPO_MODE_DIR) {
+		if (!last_found || !last_found->valid ||
+		    memcmp(last_found->sha1, sha1, 20))
+			die("BUG: tree %s is not known", sha1_to_hex(sha1));
+		subtree = (struct tree *) last_found;
+	}
+	if (!*path) {
+		if (!subtree)
+			die("invalid dump: root of tree is not a directory");
+		root = subtree;
+		return;
+	}
+	root = t = writable(root);
+	for (;;) {
+		len = component_len(path);
+		t->valid = 0;
+		if (!find_entry(t, path, len, &pos))
+			e = insert_entry(t, pos, path, len);
+		else
+			e = &t->entries[pos];
+		if (!path[len])
+			break;
+		/* A file in the way is replaced by a directory. */
+		if (!e->tree) {
+			e->mode = REPO_MODE_DIR;
+			e->tree = new_tree();
+		}
+		t = e->tree = writable(e->tree);
+		path += len + 1;
+	}
+	e->mode = mode;
+	e->tree = subtree;
+	memcpy(e->sha1, sha1, 20);
+}
+
+/* Returns 1 if something was removed from t. */
+static int remove_path(struct tree *t, const char *path)
+{
+	size_t len = component_len(path);
+	struct tree_entry *e;
+	size_t pos;
+
+	if (!find_entry(t, path, len, &pos))
+		return 0;
+	e = &t->entries[pos];
+	if (path[len]) {
+		if (!e->tree)
+			return 0;
+		e->tree = writable(e->tree);
+		if (!remove_path(e->tree, path + len + 1))
+			return 0;
+		t->valid = 0;
+		/* Like fast-import, drop directories that become empty. */
+		if (e->tree->nr)
+			return 1;
+	}
+	t->nr--;
+	memmove(t->entries + pos, t->entries + pos + 1,
+		(t->nr - pos) * sizeof(*t->entries));
+	t->valid = 0;
+	return 1;
+}
+
+void git_tree_remove(const char *path)
+{
+	if (!*path) {
+		root = new_tree();
+		return;
+	}
+	root = writable(root);
+	remove_path(root, path);
+}
+
+static int lookup(const struct tree *t, const char *path,
+		  uint32_t *mode, unsigned char sha1[20])
+{
+	const struct tree_entry *e = NULL;
+
+	if (!*path) {
+		*mode = REPO_MODE_DIR;
+		memcpy(sha1, t->sha1, 20);
+		last_found = t;
+		return 0;
+	}
+	for (;;) {
+		size_t len = component_len(path);
+		size_t pos;
+		if (!t || !find_entry(t, path, len, &pos)) {
+			errno = ENOENT;
+			return -1;
+		}
+		e = &t->entries[pos];
+		if (!path[len])
+			break;
+		t = e->tree;
+		path += len + 1;
+	}
+	*mode = e->mode;
+	if (e->tree) {
+		/* Trees changed in this commit have no name yet. */
+		memcpy(sha1, e->tree->valid ? e->tree->sha1 : null_sha1, 20);
+		last_found = e->tree;
+	} else {
+		memcpy(sha1, e->sha1, 20);
+	}
+	return 0;
+}
+
+int git_tree_lookup(const char *path, uint32_t *mode, unsigned char sha1[20])
+{
+	return lookup(root, path, mode, sha1);
+}
+
+int git_tree_lookup_rev(uint32_t rev, const char *path,
+			uint32_t *mode, unsigned char sha1[20])
+{
+	if (rev >= roots_nr || !roots[rev])
+		die("invalid dump: revision %"PRIu32" was not imported", rev);
+	return lookup(roots[rev], path, mode, sha1);
+}
+
+static void for_each_file(const struct tree *t, struct strbuf *path,
+			  each_file_fn fn, void *data)
+{
+	size_t i, len = path->len;
+
+	for (i = 0; i < t->nr; i++) {
+		const struct tree_entry *e = &t->entries[i];
+		strbuf_setlen(path, len);
+		if (len)
+			strbuf_addch(path, '/');
+		strbuf_add(path, e->name, e->len);
+		if (e->tree)
+			for_each_file(e->tree, path, fn, data);
+		else
+			fn(path->buf, e->mode, e->sha1, data);
+	}
+	strbuf_setlen(path, len);
+}
+
+void git_tree_for_each_file(const char *path, each_file_fn fn, void *data)
+{
+	static struct strbuf buf = STRBUF_INIT_TAGGED(MEM_LOOKUP);
+	unsigned char sha1[20];
+	uint32_t mode;
+
+	if (lookup(root, path, &mode, sha1))
+		return;
+	strbuf_reset(&buf);
+	strbuf_addstr(&buf, path);
+	if (mode != REPO_MODE_DIR)
+		fn(buf.buf, mode, sha1, data);
+	else
+		for_each_file(last_found, &buf, fn, data);
+}
+
+/* Git sorts directories as though their names ended with a slash. */
+static int git_order(const void *a, const void *b)
+{
+	const struct tree_entry *x = *(const struct tree_entry *const *) a;
+	const struct tree_entry *y = *(const struct tree_entry *const *) b;
+	size_t len = x->len < y->len ? x->len : y->len;
+	int cmp = memcmp(x->name, y->name, len);
+	unsigned char cx, cy;
+
+	if (cmp)
+		return cmp;
+	cx = len < x->len ? x->name[len] : x->tree ? '/' : '\0';
+	cy = len < y->len ? y->name[len] : y->tree ? '/' : '\0';
+	return cx - cy;
+}
+
+static void write_tree(struct tree *t)
+{
+	static struct strbuf buf = STRBUF_INIT_TAGGED(MEM_PACK);
+	const struct tree_entry **sorted;
+	size_t i, nr = 0;
+
+	if (t->valid)
+		return;
+	sorted = malloc((t->nr + 1) * sizeof(*sorted));
+	if (!sorted)
+		die("out of memory");
+	for (i = 0; i < t->nr; i++) {
+		struct tree_entry *e = &t->entries[i];
+		if (e->tree) {
+			write_tree(e->tree);
+			if (!e->tree->nr)
+				continue;
+			memcpy(e->sha1, e->tree->sha1, 20);
+		}
+		sorted[nr++] = e;
+	}
+	qsort(sorted, nr, sizeof(*sorted), git_order);
+
+	strbuf_reset(&buf);
+	for (i = 0; i < nr; i++) {
+		char mode[16];
+		snprintf(mode, sizeof(mode), "%"PRIo32" ", sorted[i]->mode);
+		strbuf_addstr(&buf, mode);
+		strbuf_add(&buf, sorted[i]->name, sorted[i]->len + 1);
+		strbuf_add(&buf, sorted[i]->sha1, 20);
+	}
+	free(sorted);
+	pack_write(OBJ_TREE, buf.buf, buf.len, t->sha1);
+	t->valid = 1;
+}
+
+void git_tree_begin(void)
+{
+	gen++;
+}
+
+void git_tree_commit(uint32_t rev, unsigned char root_sha1[20])
+{
+	write_tree(root);
+	memcpy(root_sha1, root->sha1, 20);
+	if (rev >= roots_nr) {
+		ALLOC_GROW(roots, rev + 1, roots_alloc);
+		memset(roots + roots_nr, 0, (rev + 1 - roots_nr) * sizeof(*roots));
+		roots_nr = rev + 1;
+	}
+	roots[rev] = root;
+}
+
+void git_tree_init(void)
+{
+	gen = 1;
+	root = new_tree();
+}
+
+void git_tree_reset(void)
+{
+	size_t i;
+
+	for (i = 0; i < trees_nr; i++) {
+		free(trees[i]->entries);
+		free(trees[i]);
+	}
+	for (i = 0; i < names_nr; i++)
+		free(names[i]);
+	free(trees);
+	free(names);
+	free(roots);
+	trees = NULL;
+	names = NULL;
+	roots = NULL;
+	trees_nr = trees_alloc = names_nr = names_alloc = 0;
+	roots_nr = roots_alloc = 0;
+	root = NULL;
+	last_found = NULL;
+}
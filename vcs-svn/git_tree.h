@@ -0,0 +1,35 @@
+#ifndef GIT_TREE_H_
+#define GIT_TREE_H_
+
+/*
+ * Git trees for each imported revision, kept in memory so the pack
+ * backend can answer "ls" itself.  Unchanged subtrees are shared
+ * between revisions.
+ */
+
+void git_tree_init(void);
+void git_tree_reset(void);
+
+/* Start the next commit from the tree of the previous one. */
+void git_tree_begin(void);
+/* Write changed trees to the pack and remember the root for rev. */
+void git_tree_commit(uint32_t rev, unsigned char root_sha1[20]);
+
+/*
+ * Trees can only be set by name when they were the last one looked
+ * up, which is always so for copies.
+ */
+void git_tree_set(const char *path, uint32_t mode, const unsigned char sha1[20]);
+void git_tree_remove(const char *path);
+
+/* If there is no such path, returns -1, errno == ENOENT. */
+int git_tree_lookup(const char *path, uint32_t *mode, unsigned char sha1[20]);
+int git_tree_lookup_rev(uint32_t rev, const char *path,
+			uint32_t *mode, unsigned char sha1[20]);
+
+/* Calls fn for each file at or below path in the current commit. */
+typedef void (*each_file_fn)(const char *path, uint32_t mode,
+			     const unsigned char sha1[20], void *data);
+void git_tree_for_each_file(const char *path, each_file_fn fn, void *data);
+
+#endif
@@ -3,11 +3,22 @@
  * See LICENSE for details.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* copy_file_range */
+#endif
 #include "compat-util.h"
 #include "line_buffer.h"
 #include "strbuf.h"
+#include <sys/stat.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/sendfile.h>
+#endif
 
 #define COPY_BUFFER_LEN 4096
+/* Shorter skips are cheaper to read than to refill the buffer after. */
+#define SEEK_MIN (64 * 1024)
+#define SEND_CHUNK_LEN (1 << 30)
 
 int buffer_init(struct line_buffer *buf, const char *filename)
 {
@@ -25,6 +36,30 @@ int buffer_fdinit(struct line_buffer *buf, int fd)
 	return 0;
 }
 
+int buffer_reopen(struct line_buffer *buf, struct line_buffer *from)
+{
+	char path[64];
+	struct stat st;
+	off_t pos = ftello(from->infile);
+
+	if (pos < 0 || fstat(fileno(from->infile), &st))
+		return -1;
+	if (!S_ISREG(st.st_mode)) {
+		errno = ESPIPE;
+		return -1;
+	}
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(from->infile));
+	buf->infile = fopen(path, "r");
+	if (!buf->infile)
+		return -1;
+	if (fseeko(buf->infile, pos, SEEK_SET)) {
+		fclose(buf->infile);
+		buf->infile = NULL;
+		return -1;
+	}
+	return 0;
+}
+
 int buffer_tmpfile_init(struct line_buffer *buf)
 {
 	buf->infile = tmpfile();
@@ -49,12 +84,12 @@ FILE *buffer_tmpfile_rewind(struct line_buffer *buf)
 	return buf->infile;
 }
 
-long buffer_tmpfile_prepare_to_read(struct line_buffer *buf)
+off_t buffer_tmpfile_prepare_to_read(struct line_buffer *buf)
 {
-	long pos = ftell(buf->infile);
+	off_t pos = ftello(buf->infile);
 	if (pos < 0)
 		return error("ftell error: %s", strerror(errno));
-	if (fseek(buf->infile, 0, SEEK_SET))
+	if (fseeko(buf->infile, 0, SEEK_SET))
 		return error("seek error: %s", strerror(errno));
 	return pos;
 }
@@ -97,7 +132,7 @@ size_t buffer_read_binary(struct line_buffer *buf,
 	return strbuf_fread(sb, size, buf->infile);
 }
 
-off_t buffer_copy_bytes(struct line_buffer *buf, off_t nbytes)
+off_t buffer_fcopy_bytes(struct line_buffer *buf, off_t nbytes, FILE *out)
 {
 	char byte_buffer[COPY_BUFFER_LEN];
 	off_t done = 0;
@@ -106,13 +141,18 @@ off_t buffer_copy_bytes(struct line_buffer *buf, off_t nbytes)
 		size_t in = len < COPY_BUFFER_LEN ? len : COPY_BUFFER_LEN;
 		in = fread(byte_buffer, 1, in, buf->infile);
 		done += in;
-		fwrite(byte_buffer, 1, in, stdout);
-		if (ferror(stdout))
+		fwrite(byte_buffer, 1, in, out);
+		if (ferror(out))
 			return done + buffer_skip_bytes(buf, nbytes - done);
 	}
 	return done;
 }
 
+off_t buffer_copy_bytes(struct line_buffer *buf, off_t nbytes)
+{
+	return buffer_fcopy_bytes(buf, nbytes, stdout);
+}
+
 off_t buffer_skip_bytes(struct line_buffer *buf, off_t nbytes)
 {
 	char byte_buffer[COPY_BUFFER_LEN];
@@ -124,3 +164,95 @@ off_t buffer_skip_bytes(struct line_buffer *buf, off_t nbytes)
 	}
 	return done;
 }
+
+off_t buffer_seek_bytes(struct line_buffer *buf, off_t nbytes)
+{
+	struct stat st;
+	off_t pos;
+
+	if (nbytes < SEEK_MIN || fstat(fileno(buf->infile), &st) ||
+	    !S_ISREG(st.st_mode))
+		return buffer_skip_bytes(buf, nbytes);
+	pos = ftello(buf->infile);
+	if (pos < 0 || nbytes > st.st_size - pos ||
+	    fseeko(buf->infile, pos + nbytes, SEEK_SET))
+		return buffer_skip_bytes(buf, nbytes);
+	return nbytes;
+}
+
+#ifdef __linux__
+
+/*
+ * Copy with copy_file_range() while out is a regular file, then
+ * with sendfile(), which takes a pipe too.  Both read at an explicit
+ * offset, so the stream position of buf is only moved at the end.
+ * Returns the number of bytes sent, or -1 if neither call works
+ * here and nothing was sent.
+ */
+static off_t send_bytes(int in, off_t pos, int out, off_t nbytes)
+{
+	static int no_copy_file_range, no_sendfile;
+	off_t done = 0;
+
+	while (done < nbytes && !no_sendfile) {
+		off_t off = pos + done;
+		size_t len = nbytes - done < SEND_CHUNK_LEN ?
+					nbytes - done : SEND_CHUNK_LEN;
+		ssize_t n;
+
+		if (!no_copy_file_range) {
+			n = copy_file_range(in, &off, out, NULL, len, 0);
+			if (n < 0 && (errno == EINVAL || errno == EXDEV ||
+				      errno == EBADF || errno == ENOSYS ||
+				      errno == EOPNOTSUPP)) {
+				no_copy_file_range = 1;
+				continue;
+			}
+		} else {
+			n = sendfile(out, in, &off, len);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				no_sendfile = 1;
+				break;
+			}
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	return done || !no_sendfile ? done : -1;
+}
+
+off_t buffer_tmpfile_fsend_bytes(struct line_buffer *buf, off_t nbytes,
+				 FILE *out)
+{
+	off_t pos = ftello(buf->infile);
+	off_t done;
+
+	if (pos < 0 || fileno(out) < 0 || fflush(out))
+		return buffer_fcopy_bytes(buf, nbytes, out);
+	done = send_bytes(fileno(buf->infile), pos, fileno(out), nbytes);
+	if (done < 0)
+		return buffer_fcopy_bytes(buf, nbytes, out);
+	if (fseeko(buf->infile, pos + done, SEEK_SET))
+		return done;
+	if (done < nbytes)
+		done += buffer_fcopy_bytes(buf, nbytes - done, out);
+	return done;
+}
+
+#else
+
+off_t buffer_tmpfile_fsend_bytes(struct line_buffer *buf, off_t nbytes,
+				 FILE *out)
+{
+	return buffer_fcopy_bytes(buf, nbytes, out);
+}
+
+#endif
+
+off_t buffer_tmpfile_send_bytes(struct line_buffer *buf, off_t nbytes)
+{
+	return buffer_tmpfile_fsend_bytes(buf, nbytes, stdout);
+}
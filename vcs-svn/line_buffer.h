@@ -13,11 +13,13 @@ struct line_buffer {
 
 int buffer_init(struct line_buffer *buf, const char *filename);
 int buffer_fdinit(struct line_buffer *buf, int fd);
+/* Open the regular file from reads again, at its position. */
+int buffer_reopen(struct line_buffer *buf, struct line_buffer *from);
 int buffer_deinit(struct line_buffer *buf);
 
 int buffer_tmpfile_init(struct line_buffer *buf);
 FILE *buffer_tmpfile_rewind(struct line_buffer *buf);	/* prepare to write. */
-long buffer_tmpfile_prepare_to_read(struct line_buffer *buf);
+off_t buffer_tmpfile_prepare_to_read(struct line_buffer *buf);
 
 int buffer_ferror(struct line_buffer *buf);
 char *buffer_read_line(struct line_buffer *buf);
@@ -25,6 +27,17 @@ int buffer_read_char(struct line_buffer *buf);
 size_t buffer_read_binary(struct line_buffer *buf, struct strbuf *sb, size_t len);
 /* Returns number of bytes read (not necessarily written). */
 off_t buffer_copy_bytes(struct line_buffer *buf, off_t len);
+off_t buffer_fcopy_bytes(struct line_buffer *buf, off_t len, FILE *out);
 off_t buffer_skip_bytes(struct line_buffer *buf, off_t len);
+/* Like buffer_skip_bytes, seeking past long runs in a regular file. */
+off_t buffer_seek_bytes(struct line_buffer *buf, off_t len);
+/*
+ * Like buffer_copy_bytes, for a temporary file being re-read; worth
+ * it from about LARGE_BLOB_MIN bytes.
+ */
+#define LARGE_BLOB_MIN (1024 * 1024)
+off_t buffer_tmpfile_send_bytes(struct line_buffer *buf, off_t len);
+off_t buffer_tmpfile_fsend_bytes(struct line_buffer *buf, off_t len,
+				 FILE *out);
 
 #endif
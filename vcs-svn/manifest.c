@@ -0,0 +1,969 @@
+/*
+ * Record what a conversion imports, and check a repository against
+ * that record afterwards.
+ *
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "strbuf.h"
+#include "line_buffer.h"
+#include "repo_tree.h"
+#include "sha1.h"
+#include "md5.h"
+#include "manifest.h"
+
+void manifest_revision(FILE *out, uint32_t revision)
+{
+	fprintf(out, "r%"PRIu32"\n", revision);
+}
+
+void manifest_modify(FILE *out, uint32_t mode, const char *checksum,
+		     const char *path)
+{
+	fprintf(out, "M %06"PRIo32" %s %s\n", mode, checksum, path);
+}
+
+void manifest_copy(FILE *out, uint32_t mode, uint32_t from_rev,
+		   const char *from_path, const char *path)
+{
+	fprintf(out, "C %06"PRIo32" %"PRIu32" %s\t%s\n",
+		mode, from_rev, path, from_path);
+}
+
+void manifest_delete(FILE *out, const char *path)
+{
+	fprintf(out, "D %s\n", path);
+}
+
+/*
+ * The verifier.  Workers take runs of CHUNK_REVISIONS revisions at a
+ * time.  For each revision, "git diff-tree" lists what the commit
+ * changes, and each change must be under a path the dump changed;
+ * "git ls-tree" gives the mode and object of each path the dump
+ * changed, to be checked against its entry.  Each worker keeps a
+ * "git cat-file --batch" to read blobs whose checksum is to be
+ * checked, and a "--batch-check" to find the sources of copies.
+ */
+#define CHUNK_REVISIONS 16
+#define LS_TREE_MAX_PATHS 512
+
+struct manifest_entry {
+	char type;
+	uint32_t mode, from_rev;
+	/* Offsets into the pool. */
+	size_t checksum, path, from_path;
+};
+
+struct manifest_rev {
+	uint32_t revision;
+	size_t first, nr;	/* its entries */
+	struct strbuf report;
+	uint32_t nr_mismatches;
+};
+
+struct verifier {
+	struct strbuf pool;
+	struct manifest_entry *entries;
+	size_t nr_entries, entries_alloc;
+	struct manifest_rev *revs;
+	size_t nr_revs, revs_alloc;
+	char (*marks)[41];	/* by revision; "" if there is none */
+	size_t marks_alloc;
+
+	pthread_mutex_t lock;
+	size_t next_rev;	/* the first not handed out yet */
+};
+
+/* A path the dump changes, and the last of its entries to. */
+struct entry_path {
+	const char *path;
+	size_t last;
+};
+
+/* A line of "git ls-tree". */
+struct tree_entry {
+	const char *path;
+	uint32_t mode;
+	unsigned char sha1[20];
+};
+
+struct worker {
+	struct verifier *v;
+	pthread_t thread;
+	pid_t batch_pid, check_pid;
+	FILE *batch_in, *batch_out, *check_in, *check_out;
+	struct strbuf out;	/* from diff-tree and ls-tree */
+	struct entry_path *paths;
+	size_t nr_paths, paths_alloc;
+	struct tree_entry *found;
+	size_t nr_found, found_alloc;
+	const char **argv;
+	size_t argv_alloc;
+	char chunk[65536];
+};
+
+static const char *pool_str(const struct verifier *v, size_t off)
+{
+	return v->pool.buf + off;
+}
+
+static size_t pool_add(struct verifier *v, const char *s, size_t len)
+{
+	size_t off = v->pool.len;
+
+	strbuf_add(&v->pool, s, len);
+	strbuf_addch(&v->pool, '\0');
+	return off;
+}
+
+static int parse_entry(struct verifier *v, const char *t)
+{
+	struct manifest_entry *e;
+	const char *end, *sep;
+	char *num_end;
+
+	ALLOC_GROW(v->entries, v->nr_entries + 1, v->entries_alloc);
+	e = &v->entries[v->nr_entries];
+	memset(e, 0, sizeof(*e));
+	e->type = t[0];
+	if (t[0] && t[1] != ' ')
+		return -1;
+	switch (t[0]) {
+	case 'D':
+		e->path = pool_add(v, t + 2, strlen(t + 2));
+		break;
+	case 'M':
+		e->mode = strtoul(t + 2, &num_end, 8);
+		if (*num_end != ' ' || !(sep = strchr(num_end + 1, ' ')))
+			return -1;
+		e->checksum = pool_add(v, num_end + 1, sep - num_end - 1);
+		e->path = pool_add(v, sep + 1, strlen(sep + 1));
+		break;
+	case 'C':
+		e->mode = strtoul(t + 2, &num_end, 8);
+		if (*num_end != ' ')
+			return -1;
+		e->from_rev = strtoul(num_end + 1, &num_end, 10);
+		if (*num_end != ' ' || !(sep = strchr(num_end + 1, '\t')))
+			return -1;
+		end = num_end + 1;
+		e->path = pool_add(v, end, sep - end);
+		e->from_path = pool_add(v, sep + 1, strlen(sep + 1));
+		break;
+	default:
+		return -1;
+	}
+	v->nr_entries++;
+	v->revs[v->nr_revs - 1].nr++;
+	return 0;
+}
+
+static int load_manifest(struct verifier *v, const char *path)
+{
+	struct line_buffer input = LINE_BUFFER_INIT;
+	uintmax_t lineno = 0;
+	const char *t;
+
+	if (buffer_init(&input, path))
+		return error("cannot open %s: %s", path, strerror(errno));
+	while ((t = buffer_read_line(&input))) {
+		struct manifest_rev *r;
+
+		lineno++;
+		if (*t != 'r') {
+			if (!v->nr_revs || parse_entry(v, t))
+				goto bad_line;
+			continue;
+		}
+		ALLOC_GROW(v->revs, v->nr_revs + 1, v->revs_alloc);
+		r = &v->revs[v->nr_revs++];
+		r->revision = strtoul(t + 1, NULL, 10);
+		r->first = v->nr_entries;
+		r->nr = 0;
+		strbuf_init(&r->report, 0);
+		r->nr_mismatches = 0;
+	}
+	if (buffer_deinit(&input))
+		return error("error reading %s", path);
+	return 0;
+bad_line:
+	buffer_deinit(&input);
+	return error("%s:%"PRIuMAX": not a manifest line", path, lineno);
+}
+
+static int load_marks(struct verifier *v, const char *path)
+{
+	struct line_buffer input = LINE_BUFFER_INIT;
+	unsigned char sha1[20];
+	const char *t;
+
+	if (buffer_init(&input, path))
+		return error("cannot open %s: %s", path, strerror(errno));
+	while ((t = buffer_read_line(&input))) {
+		char *end = NULL;
+		unsigned long mark = 0;
+		size_t old = v->marks_alloc;
+
+		if (*t == ':')
+			mark = strtoul(t + 1, &end, 10);
+		if (!end || *end != ' ' || get_sha1_hex(end + 1, sha1) ||
+		    end[41]) {
+			buffer_deinit(&input);
+			return error("%s: not a marks line: %s", path, t);
+		}
+		if (mark >= old) {
+			ALLOC_GROW(v->marks, mark + 1, v->marks_alloc);
+			memset(v->marks + old, 0,
+			       (v->marks_alloc - old) * sizeof(*v->marks));
+		}
+		memcpy(v->marks[mark], end + 1, 41);
+	}
+	if (buffer_deinit(&input))
+		return error("error reading %s", path);
+	return 0;
+}
+
+static const char *commit_of(const struct verifier *v, uint32_t revision)
+{
+	if (revision >= v->marks_alloc || !*v->marks[revision])
+		return NULL;
+	return v->marks[revision];
+}
+
+/* The threads fork, so no pipe may be open without close-on-exec. */
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cloexec_pipe(int fd[2])
+{
+	if (pipe(fd) || fcntl(fd[0], F_SETFD, FD_CLOEXEC) ||
+	    fcntl(fd[1], F_SETFD, FD_CLOEXEC))
+		die_errno("cannot make a pipe to git");
+}
+
+/* Start git with argv, writing to *out and, unless in is NULL, reading *in. */
+static pid_t start_git(const char **argv, int *in, int *out)
+{
+	int to[2], from[2];
+	pid_t pid;
+
+	pthread_mutex_lock(&spawn_lock);
+	cloexec_pipe(from);
+	if (in)
+		cloexec_pipe(to);
+	pid = fork();
+	if (!pid) {
+		if (in)
+			dup2(to[0], 0);
+		dup2(from[1], 1);
+		execvp("git", (char *const *) argv);
+		_exit(127);
+	}
+	if (pid < 0)
+		die_errno("cannot run git");
+	close(from[1]);
+	*out = from[0];
+	if (in) {
+		close(to[0]);
+		*in = to[1];
+	}
+	pthread_mutex_unlock(&spawn_lock);
+	return pid;
+}
+
+static int finish_git(pid_t pid)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			die_errno("cannot wait for git");
+	return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+/* Run git with argv, adding what it writes to out. */
+static int run_git(struct worker *w, const char **argv, struct strbuf *out)
+{
+	int fd;
+	pid_t pid = start_git(argv, NULL, &fd);
+	ssize_t n;
+
+	while ((n = read(fd, w->chunk, sizeof(w->chunk))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			die_errno("cannot read from git");
+		strbuf_add(out, w->chunk, n);
+	}
+	close(fd);
+	return finish_git(pid);
+}
+
+static void start_batch(const char *option, pid_t *pid, FILE **in, FILE **out)
+{
+	const char *argv[] = { "git", "cat-file", option, NULL };
+	int to, from;
+
+	*pid = start_git(argv, &to, &from);
+	*in = fdopen(to, "w");
+	*out = fdopen(from, "r");
+	if (!*in || !*out)
+		die_errno("cannot talk to git cat-file");
+}
+
+static void stop_batch(pid_t pid, FILE *in, FILE *out)
+{
+	fclose(in);
+	fclose(out);
+	finish_git(pid);
+}
+
+static void mismatch(struct manifest_rev *r, const char *path,
+		     const char *what)
+{
+	char head[32];
+
+	snprintf(head, sizeof(head), "r%"PRIu32": ", r->revision);
+	strbuf_addstr(&r->report, head);
+	if (path) {
+		strbuf_addstr(&r->report, path);
+		strbuf_addstr(&r->report, ": ");
+	}
+	strbuf_addstr(&r->report, what);
+	strbuf_addch(&r->report, '\n');
+	r->nr_mismatches++;
+}
+
+static void to_hex(const unsigned char *p, size_t len, char *hex)
+{
+	static const char digits[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hex[2 * i] = digits[p[i] >> 4];
+		hex[2 * i + 1] = digits[p[i] & 0xf];
+	}
+	hex[2 * len] = '\0';
+}
+
+/* Compare the first len bytes of a (holding no NUL) with b. */
+static int compare_prefix(const char *a, size_t len, const char *b)
+{
+	int cmp = strncmp(a, b, len);
+
+	if (cmp)
+		return cmp;
+	return b[len] ? -1 : 0;
+}
+
+static int entry_path_cmp(const void *a, const void *b)
+{
+	const struct entry_path *x = a, *y = b;
+	int cmp = strcmp(x->path, y->path);
+
+	if (cmp)
+		return cmp;
+	return (x->last > y->last) - (x->last < y->last);
+}
+
+/* The paths the revision changes, sorted, each with its last entry. */
+static void index_paths(struct worker *w, const struct manifest_rev *r)
+{
+	const struct verifier *v = w->v;
+	size_t i, j;
+
+	w->nr_paths = 0;
+	ALLOC_GROW(w->paths, r->nr, w->paths_alloc);
+	for (i = 0; i < r->nr; i++) {
+		w->paths[i].path = pool_str(v, v->entries[r->first + i].path);
+		w->paths[i].last = i;
+	}
+	qsort(w->paths, r->nr, sizeof(*w->paths), entry_path_cmp);
+	for (i = j = 0; i < r->nr; i++) {
+		if (j && !strcmp(w->paths[j - 1].path, w->paths[i].path))
+			j--;
+		w->paths[j++] = w->paths[i];
+	}
+	w->nr_paths = j;
+}
+
+/* The index of the first path not below the first len bytes of path. */
+static size_t lower_bound(const struct worker *w, const char *path,
+			  size_t len)
+{
+	size_t lo = 0, hi = w->nr_paths;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (compare_prefix(path, len, w->paths[mid].path) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static const struct entry_path *find_path(const struct worker *w,
+					  const char *path, size_t len)
+{
+	size_t pos = lower_bound(w, path, len);
+
+	if (pos < w->nr_paths && !compare_prefix(path, len, w->paths[pos].path))
+		return &w->paths[pos];
+	return NULL;
+}
+
+/*
+ * The last entry of the revision for path or a directory above it,
+ * or -1 if there is none.
+ */
+static long last_entry_above(const struct worker *w, const char *path)
+{
+	size_t len = strlen(path);
+	long last = -1;
+
+	for (;;) {
+		const struct entry_path *p = find_path(w, path, len);
+
+		if (p && (long) p->last > last)
+			last = p->last;
+		if (!len)
+			return last;
+		while (len && path[len - 1] != '/')
+			len--;
+		if (len)
+			len--;	/* the slash */
+	}
+}
+
+/* Whether an entry after the index-th changes something below path. */
+static int changed_below(const struct worker *w, const char *path,
+			 size_t index)
+{
+	size_t len = strlen(path);
+	size_t pos;
+
+	for (pos = lower_bound(w, path, len); pos < w->nr_paths; pos++) {
+		const char *p = w->paths[pos].path;
+
+		if (strncmp(p, path, len))
+			break;
+		if (p[len] == '/' && w->paths[pos].last > index)
+			return 1;
+	}
+	return 0;
+}
+
+static int tree_entry_cmp(const void *a, const void *b)
+{
+	const struct tree_entry *x = a, *y = b;
+
+	return strcmp(x->path, y->path);
+}
+
+static const struct tree_entry *find_tree_entry(const struct worker *w,
+						const char *path)
+{
+	struct tree_entry key;
+
+	key.path = path;
+	return bsearch(&key, w->found, w->nr_found, sizeof(*w->found),
+		       tree_entry_cmp);
+}
+
+/* What the commit changes must be under paths the dump changes. */
+static int check_changes(struct worker *w, struct manifest_rev *r,
+			 const char *commit)
+{
+	const char *argv[] = { "git", "diff-tree", "-r", "-z", "--raw",
+		"--no-abbrev", "--no-renames", "--root", commit, NULL };
+	const char *p, *end;
+
+	strbuf_reset(&w->out);
+	if (run_git(w, argv, &w->out)) {
+		mismatch(r, NULL, "cannot read its commit");
+		return -1;
+	}
+	p = w->out.buf;
+	end = p + w->out.len;
+	/* The commit itself, then ":<modes> <objects> <status>\0<path>\0"... */
+	if (p < end && *p != ':')
+		p += strlen(p) + 1;
+	while (p < end) {
+		const char *path = p + strlen(p) + 1;
+
+		if (path >= end)
+			break;
+		if (last_entry_above(w, path) < 0)
+			mismatch(r, path, "changed, but not in the dump");
+		p = path + strlen(path) + 1;
+	}
+	return 0;
+}
+
+/* The entries "git ls-tree -z" wrote to out, sorted by path. */
+static void parse_tree(struct strbuf *out, struct tree_entry **list,
+		       size_t *nr, size_t *alloc)
+{
+	const char *p, *end;
+
+	/* "<mode> <type> <object>\t<path>\0" */
+	*nr = 0;
+	for (p = out->buf, end = p + out->len; p < end; p += strlen(p) + 1) {
+		struct tree_entry *e;
+		const char *obj = strchr(p, ' '), *tab = strchr(p, '\t');
+
+		if (!obj || !tab || !(obj = strchr(obj + 1, ' ')))
+			die("unexpected git ls-tree output: %s", p);
+		ALLOC_GROW(*list, *nr + 1, *alloc);
+		e = &(*list)[(*nr)++];
+		e->mode = strtoul(p, NULL, 8);
+		if (get_sha1_hex(obj + 1, e->sha1))
+			die("unexpected git ls-tree output: %s", p);
+		e->path = tab + 1;
+	}
+	qsort(*list, *nr, sizeof(**list), tree_entry_cmp);
+}
+
+/* Look up the paths of the revision that are to be checked. */
+static int list_paths(struct worker *w, struct manifest_rev *r,
+		      const char *commit)
+{
+	size_t i, nr_args, fixed;
+
+	strbuf_reset(&w->out);
+	ALLOC_GROW(w->argv, LS_TREE_MAX_PATHS + 8, w->argv_alloc);
+	w->argv[0] = "git";
+	w->argv[1] = "ls-tree";
+	w->argv[2] = "-z";
+	w->argv[3] = "-t";
+	w->argv[4] = "--full-tree";
+	w->argv[5] = commit;
+	w->argv[6] = "--";
+	fixed = nr_args = 7;
+	for (i = 0; i <= w->nr_paths; i++) {
+		if (nr_args > fixed &&
+		    (i == w->nr_paths || nr_args - fixed == LS_TREE_MAX_PATHS)) {
+			w->argv[nr_args] = NULL;
+			if (run_git(w, w->argv, &w->out)) {
+				mismatch(r, NULL, "cannot read its tree");
+				return -1;
+			}
+			nr_args = fixed;
+		}
+		if (i < w->nr_paths && *w->paths[i].path)
+			w->argv[nr_args++] = w->paths[i].path;
+	}
+
+	parse_tree(&w->out, &w->found, &w->nr_found, &w->found_alloc);
+	return 0;
+}
+
+static int hex_to_bytes(const char *hex, unsigned char *out, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		unsigned int byte;
+
+		if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+			return -1;
+		out[i] = byte;
+	}
+	return hex[2 * len] ? -1 : 0;
+}
+
+/* The md5 or sha1 of the blob as Subversion has it: with "link " for a link. */
+static void svn_checksum(struct worker *w, const unsigned char *blob,
+			 uint32_t mode, int md5, unsigned char *digest)
+{
+	struct md5_ctx md5_ctx;
+	struct sha1_ctx sha1_ctx;
+	char line[128];
+	uintmax_t size;
+
+	to_hex(blob, 20, line);
+	fprintf(w->batch_in, "%s\n", line);
+	fflush(w->batch_in);
+	if (!fgets(line, sizeof(line), w->batch_out) ||
+	    sscanf(line, "%*s blob %"SCNuMAX, &size) != 1)
+		die("unexpected git cat-file output: %s", line);
+	md5_init(&md5_ctx);
+	sha1_init(&sha1_ctx);
+	if (mode == REPO_MODE_LNK) {
+		md5_update(&md5_ctx, "link ", 5);
+		sha1_update(&sha1_ctx, "link ", 5);
+	}
+	while (size) {
+		size_t n = size < sizeof(w->chunk) ? size : sizeof(w->chunk);
+
+		if (fread(w->chunk, 1, n, w->batch_out) != n)
+			die("short read from git cat-file");
+		if (md5)
+			md5_update(&md5_ctx, w->chunk, n);
+		else
+			sha1_update(&sha1_ctx, w->chunk, n);
+		size -= n;
+	}
+	if (fgetc(w->batch_out) != '\n')
+		die("unexpected git cat-file output");
+	if (md5)
+		md5_final(digest, &md5_ctx);
+	else
+		sha1_final(digest, &sha1_ctx);
+}
+
+static void check_content(struct worker *w, struct manifest_rev *r,
+			  const struct manifest_entry *e,
+			  const struct tree_entry *found)
+{
+	const char *checksum = pool_str(w->v, e->checksum);
+	const char *path = pool_str(w->v, e->path);
+	unsigned char expect[20], digest[20];
+	char msg[160], hex[41];
+	size_t len;
+	int md5;
+
+	if (!strcmp(checksum, "-"))
+		return;
+	if (!strncmp(checksum, "git:", 4)) {
+		if (get_sha1_hex(checksum + 4, expect))
+			die("bad checksum in the manifest: %s", checksum);
+		if (memcmp(expect, found->sha1, 20)) {
+			to_hex(found->sha1, 20, hex);
+			snprintf(msg, sizeof(msg), "blob %s, expected %s",
+				 hex, checksum + 4);
+			mismatch(r, path, msg);
+		}
+		return;
+	}
+	md5 = !strncmp(checksum, "md5:", 4);
+	if (!md5 && strncmp(checksum, "sha1:", 5))
+		die("unknown checksum in the manifest: %s", checksum);
+	len = md5 ? 16 : 20;
+	if (hex_to_bytes(strchr(checksum, ':') + 1, expect, len))
+		die("bad checksum in the manifest: %s", checksum);
+	svn_checksum(w, found->sha1, e->mode, md5, digest);
+	if (memcmp(expect, digest, len)) {
+		to_hex(digest, len, hex);
+		snprintf(msg, sizeof(msg), "content has %s %s, expected %s",
+			 md5 ? "md5" : "sha1", hex, strchr(checksum, ':') + 1);
+		mismatch(r, path, msg);
+	}
+}
+
+/* The object at path in commit, in hex; NULL if there is none. */
+static const char *lookup_object(struct worker *w, const char *commit,
+				 const char *path, char *hex)
+{
+	char line[256];
+
+	fprintf(w->check_in, "%s:%s\n", commit, path);
+	fflush(w->check_in);
+	if (!fgets(line, sizeof(line), w->check_out))
+		die("git cat-file --batch-check stopped");
+	if (!strchr(line, '\n'))
+		die("unexpected git cat-file output: %s", line);
+	if (strlen(line) < 41 || line[40] != ' ' ||
+	    !strncmp(line + 41, "missing", 7))
+		return NULL;
+	memcpy(hex, line, 40);
+	hex[40] = '\0';
+	return hex;
+}
+
+static void check_copy(struct worker *w, struct manifest_rev *r,
+		       const struct manifest_entry *e,
+		       const struct tree_entry *found)
+{
+	const char *path = pool_str(w->v, e->path);
+	const char *from_commit = commit_of(w->v, e->from_rev);
+	const char *from;
+	char hex[41], from_hex[41], msg[200];
+
+	if (!from_commit)
+		return;
+	from = lookup_object(w, from_commit, pool_str(w->v, e->from_path),
+			     from_hex);
+	if (!found && !from)
+		return;
+	if (!found || !from) {
+		snprintf(msg, sizeof(msg), "%s, but copied from %s@%"PRIu32
+			 " which %s", found ? "present" : "missing",
+			 pool_str(w->v, e->from_path), e->from_rev,
+			 from ? "exists" : "does not");
+		mismatch(r, path, msg);
+		return;
+	}
+	to_hex(found->sha1, 20, hex);
+	if (strcmp(hex, from)) {
+		snprintf(msg, sizeof(msg), "%s, expected %s as copied from "
+			 "%s@%"PRIu32, hex, from, pool_str(w->v, e->from_path),
+			 e->from_rev);
+		mismatch(r, path, msg);
+	}
+}
+
+/* The files at or below path in commit, into out and list. */
+static int list_subtree(struct worker *w, const char *commit,
+			const char *path, struct strbuf *out,
+			struct tree_entry **list, size_t *nr, size_t *alloc)
+{
+	const char *argv[] = { "git", "ls-tree", "-r", "-z", "--full-tree",
+		commit, "--", path, NULL };
+
+	if (!*path)
+		argv[6] = NULL;
+	if (run_git(w, argv, out))
+		return -1;
+	parse_tree(out, list, nr, alloc);
+	return 0;
+}
+
+/* The part of a path below prefix, with no slash at the start. */
+static const char *below(const char *path, size_t prefix_len)
+{
+	path += prefix_len;
+	return *path == '/' ? path + 1 : path;
+}
+
+static void check_copied_file(struct worker *w, struct manifest_rev *r,
+			      const struct manifest_entry *e, const char *path,
+			      const struct tree_entry *found,
+			      const struct tree_entry *from)
+{
+	char hex[41], from_hex[41], msg[200];
+
+	if (!from) {
+		mismatch(r, path, "present, but not in the source of "
+			 "its copy");
+		return;
+	}
+	if (!found) {
+		mismatch(r, path, "missing, but in the source of its copy");
+		return;
+	}
+	if (found->mode == from->mode && !memcmp(found->sha1, from->sha1, 20))
+		return;
+	to_hex(found->sha1, 20, hex);
+	to_hex(from->sha1, 20, from_hex);
+	snprintf(msg, sizeof(msg), "%06"PRIo32" %s, expected %06"PRIo32
+		 " %s as copied from %s@%"PRIu32, found->mode, hex,
+		 from->mode, from_hex, pool_str(w->v, e->from_path),
+		 e->from_rev);
+	mismatch(r, path, msg);
+}
+
+/*
+ * A directory copied and then changed below: each file under it
+ * must be that of its source, unless a later entry covers it.
+ */
+static void check_copied_tree(struct worker *w, struct manifest_rev *r,
+			      const struct manifest_entry *e, size_t index,
+			      const char *commit)
+{
+	const char *path = pool_str(w->v, e->path);
+	const char *from_path = pool_str(w->v, e->from_path);
+	const char *from_commit = commit_of(w->v, e->from_rev);
+	struct strbuf copy_out = STRBUF_INIT, from_out = STRBUF_INIT;
+	struct strbuf target = STRBUF_INIT;
+	struct tree_entry *copy = NULL, *from = NULL;
+	size_t nr_copy, copy_alloc = 0, nr_from, from_alloc = 0, i, j;
+	size_t len = strlen(path), from_len = strlen(from_path);
+
+	if (!from_commit)
+		return;
+	if (list_subtree(w, commit, path, &copy_out,
+			 &copy, &nr_copy, &copy_alloc) ||
+	    list_subtree(w, from_commit, from_path, &from_out,
+			 &from, &nr_from, &from_alloc)) {
+		mismatch(r, path, "cannot read the tree of its copy");
+		goto out;
+	}
+	for (i = j = 0; i < nr_copy || j < nr_from;) {
+		const char *rel;
+		int cmp;
+
+		if (i == nr_copy)
+			cmp = 1;
+		else if (j == nr_from)
+			cmp = -1;
+		else
+			cmp = strcmp(below(copy[i].path, len),
+				     below(from[j].path, from_len));
+		rel = cmp <= 0 ? below(copy[i].path, len) :
+				 below(from[j].path, from_len);
+		strbuf_reset(&target);
+		strbuf_addstr(&target, path);
+		if (*rel) {
+			strbuf_addch(&target, '/');
+			strbuf_addstr(&target, rel);
+		}
+		/* A path a later entry covers is checked by that one. */
+		if (last_entry_above(w, target.buf) <= (long) index)
+			check_copied_file(w, r, e, target.buf,
+					  cmp <= 0 ? &copy[i] : NULL,
+					  cmp >= 0 ? &from[j] : NULL);
+		i += cmp <= 0;
+		j += cmp >= 0;
+	}
+out:
+	strbuf_release(&copy_out);
+	strbuf_release(&from_out);
+	strbuf_release(&target);
+	free(copy);
+	free(from);
+}
+
+static void check_entry(struct worker *w, struct manifest_rev *r,
+			size_t index, const char *commit)
+{
+	const struct manifest_entry *e = &w->v->entries[r->first + index];
+	const char *path = pool_str(w->v, e->path);
+	const struct tree_entry *found;
+	char msg[80];
+
+	/* The root is checked by what is under it. */
+	if (!*path || last_entry_above(w, path) != (long) index)
+		return;
+	/*
+	 * A directory deleted and then changed below is checked below
+	 * it, and one copied is checked against its source but there.
+	 */
+	if (e->type == 'C' && changed_below(w, path, index)) {
+		check_copied_tree(w, r, e, index, commit);
+		return;
+	}
+	if (e->type == 'D' && changed_below(w, path, index))
+		return;
+	found = find_tree_entry(w, path);
+	if (e->type == 'D') {
+		if (found)
+			mismatch(r, path, "present, but deleted in the dump");
+		return;
+	}
+	if (found && found->mode != e->mode) {
+		snprintf(msg, sizeof(msg), "mode %06"PRIo32", expected "
+			 "%06"PRIo32, found->mode, e->mode);
+		mismatch(r, path, msg);
+	}
+	if (e->type == 'C') {
+		check_copy(w, r, e, found);
+		return;
+	}
+	if (!found) {
+		mismatch(r, path, "missing");
+		return;
+	}
+	if (found->mode != REPO_MODE_DIR)
+		check_content(w, r, e, found);
+}
+
+static void verify_rev(struct worker *w, struct manifest_rev *r)
+{
+	const char *commit = commit_of(w->v, r->revision);
+	size_t i;
+
+	if (!commit) {
+		mismatch(r, NULL, "no commit in the marks");
+		return;
+	}
+	index_paths(w, r);
+	if (check_changes(w, r, commit) || list_paths(w, r, commit))
+		return;
+	for (i = 0; i < r->nr; i++)
+		check_entry(w, r, i, commit);
+}
+
+static void *verify_thread(void *data)
+{
+	struct worker *w = data;
+	struct verifier *v = w->v;
+
+	start_batch("--batch", &w->batch_pid, &w->batch_in, &w->batch_out);
+	start_batch("--batch-check", &w->check_pid, &w->check_in,
+		    &w->check_out);
+	for (;;) {
+		size_t i, end;
+
+		pthread_mutex_lock(&v->lock);
+		i = v->next_rev;
+		end = i + CHUNK_REVISIONS;
+		if (end > v->nr_revs)
+			end = v->nr_revs;
+		v->next_rev = end;
+		pthread_mutex_unlock(&v->lock);
+		if (i >= end)
+			break;
+		for (; i < end; i++)
+			verify_rev(w, &v->revs[i]);
+	}
+	stop_batch(w->batch_pid, w->batch_in, w->batch_out);
+	stop_batch(w->check_pid, w->check_in, w->check_out);
+	return NULL;
+}
+
+int manifest_verify(const char *manifest, const char *marks, int nr_threads)
+{
+	struct verifier v;
+	struct worker *workers;
+	uint32_t nr_mismatches = 0, nr_bad_revs = 0;
+	size_t i;
+	int n, err;
+
+	memset(&v, 0, sizeof(v));
+	strbuf_init(&v.pool, 0);
+	pthread_mutex_init(&v.lock, NULL);
+	if (load_manifest(&v, manifest) || load_marks(&v, marks))
+		return -1;
+	/* Paths are passed to git as they are. */
+	if (setenv("GIT_LITERAL_PATHSPECS", "1", 1))
+		return error("cannot set GIT_LITERAL_PATHSPECS");
+	if (nr_threads < 1)
+		nr_threads = 1;
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers)
+		die_errno("cannot allocate verifier threads");
+	for (n = 0; n < nr_threads; n++) {
+		workers[n].v = &v;
+		strbuf_init(&workers[n].out, 0);
+		err = pthread_create(&workers[n].thread, NULL, verify_thread,
+				     &workers[n]);
+		if (err)
+			die("cannot start a verifier thread: %s",
+			    strerror(err));
+	}
+	for (n = 0; n < nr_threads; n++) {
+		pthread_join(workers[n].thread, NULL);
+		strbuf_release(&workers[n].out);
+		free(workers[n].paths);
+		free(workers[n].found);
+		free(workers[n].argv);
+	}
+	free(workers);
+
+	for (i = 0; i < v.nr_revs; i++) {
+		struct manifest_rev *r = &v.revs[i];
+
+		fwrite(r->report.buf, 1, r->report.len, stdout);
+		nr_mismatches += r->nr_mismatches;
+		nr_bad_revs += !!r->nr_mismatches;
+		strbuf_release(&r->report);
+	}
+	fprintf(stderr, "Verified %"PRIuMAX" revisions, %"PRIuMAX" changes on "
+		"%d threads: %"PRIu32" mismatches in %"PRIu32" revisions\n",
+		(uintmax_t) v.nr_revs, (uintmax_t) v.nr_entries, nr_threads,
+		nr_mismatches, nr_bad_revs);
+	free(v.revs);
+	free(v.entries);
+	free(v.marks);
+	strbuf_release(&v.pool);
+	pthread_mutex_destroy(&v.lock);
+	return nr_mismatches ? -1 : 0;
+}
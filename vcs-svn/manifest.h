@@ -0,0 +1,37 @@
+#ifndef MANIFEST_H_
+#define MANIFEST_H_
+
+/*
+ * What a conversion should have imported, path by path, for checking
+ * the git repository against afterwards without Subversion.
+ *
+ * A manifest is a text file with a line "r<revision>" for each commit
+ * written, followed by a line for each change the dump makes in it:
+ *
+ *	M <mode> <checksum> <path>
+ *	C <mode> <from-revision> <path> TAB <from-path>
+ *	D <path>
+ *
+ * A checksum is that of the full text from the dump ("md5:<hex>",
+ * "sha1:<hex>"), the name of the blob written ("git:<hex>"), or "-"
+ * if neither is known.  Subversion paths hold no control characters,
+ * so they are written as they are.
+ */
+
+void manifest_revision(FILE *out, uint32_t revision);
+void manifest_modify(FILE *out, uint32_t mode, const char *checksum,
+		     const char *path);
+void manifest_copy(FILE *out, uint32_t mode, uint32_t from_rev,
+		   const char *from_path, const char *path);
+void manifest_delete(FILE *out, const char *path);
+
+/*
+ * Check the commits named in marks (":<revision> <commit>" lines, as
+ * from git fast-import --export-marks) in the repository git finds
+ * from the current directory against the manifest, on up to
+ * nr_threads threads.  Mismatches are written to stdout by revision;
+ * returns -1 if there are any.
+ */
+int manifest_verify(const char *manifest, const char *marks, int nr_threads);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef MD5_H_
+#define MD5_H_
+
+struct md5_ctx {
+	uint32_t h[4];
+	uint64_t len;
+	unsigned char block[64];
+};
+
+extern void md5_init(struct md5_ctx *ctx);
+extern void md5_update(struct md5_ctx *ctx, const void *data, size_t len);
+extern void md5_final(unsigned char md5[16], struct md5_ctx *ctx);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include "memory.h"
+
+#ifdef MEMORY_ACCOUNTING
+
+#include <pthread.h>
+
+static const char *const tag_names[MEM_NR] = {
+	[MEM_OTHER] = "other",
+	[MEM_PARSER] = "parser",
+	[MEM_PROPS] = "props",
+	[MEM_DELTA_WINDOW] = "delta window",
+	[MEM_PREIMAGE] = "preimage",
+	[MEM_POSTIMAGE] = "postimage",
+	[MEM_LOOKUP] = "lookup",
+	[MEM_PACK] = "pack",
+};
+
+/*
+ * Delta windows grow on worker threads.  Buffers are only accounted
+ * when they are reallocated or freed, so a lock costs little.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct memory_stats stats[MEM_NR + 1];
+
+void memory_account(int tag, size_t old_alloc, size_t new_alloc)
+{
+	struct memory_stats *total = &stats[MEM_NR];
+	int i;
+
+	if (tag < 0 || tag >= MEM_NR)
+		die("BUG: bad memory tag %d", tag);
+	pthread_mutex_lock(&lock);
+	if (!old_alloc && new_alloc) {
+		stats[tag].allocations++;
+		total->allocations++;
+	}
+	stats[tag].current += new_alloc;
+	stats[tag].current -= old_alloc;
+	total->current += new_alloc;
+	total->current -= old_alloc;
+	if (stats[tag].current > stats[tag].peak)
+		stats[tag].peak = stats[tag].current;
+	if (total->current > total->peak) {
+		total->peak = total->current;
+		for (i = 0; i <= MEM_NR; i++)
+			stats[i].at_peak = stats[i].current;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+const char *memory_tag_name(int tag)
+{
+	return tag < MEM_NR ? tag_names[tag] : "total";
+}
+
+void memory_get_stats(struct memory_stats out[MEM_NR + 1])
+{
+	pthread_mutex_lock(&lock);
+	memcpy(out, stats, sizeof(stats));
+	pthread_mutex_unlock(&lock);
+}
+
+void memory_report(void)
+{
+	struct memory_stats s[MEM_NR + 1];
+	int i;
+
+	memory_get_stats(s);
+	fprintf(stderr, "%-13s %12s %12s %12s %12s\n", "Memory",
+		"current", "peak", "at peak", "allocations");
+	for (i = 0; i <= MEM_NR; i++)
+		fprintf(stderr, "%-13s %12"PRIu64" %12"PRIu64" %12"PRIu64
+			" %12"PRIu64"\n", memory_tag_name(i), s[i].current,
+			s[i].peak, s[i].at_peak, s[i].allocations);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef MEMORY_H_
+#define MEMORY_H_
+
+/*
+ * Which strbufs hold the memory, when built with -DMEMORY_ACCOUNTING
+ * ("make MEMORY_ACCOUNTING=1").  A strbuf is counted under the tag
+ * it was initialized with (STRBUF_INIT_TAGGED or strbuf_set_tag);
+ * untagged ones count as "other".  Without the flag, strbufs carry
+ * no tag and nothing is counted.
+ */
+
+enum memory_tag {
+	MEM_OTHER,
+	MEM_PARSER,	/* dump headers: paths, author, uuid */
+	MEM_PROPS,	/* property keys and values, svn:log */
+	MEM_DELTA_WINDOW,	/* svndiff instructions and new data */
+	MEM_PREIMAGE,	/* sliding views of delta preimages */
+	MEM_POSTIMAGE,	/* reconstructed windows */
+	MEM_LOOKUP,	/* ls results and tree walks */
+	MEM_PACK,	/* objects being written or read back */
+	MEM_NR
+};
+
+#ifdef MEMORY_ACCOUNTING
+
+struct memory_stats {
+	uint64_t current, peak, allocations;
+	uint64_t at_peak;	/* held when the total was at its peak */
+};
+
+/* Called by strbuf when a buffer of tag grows from old to new bytes. */
+void memory_account(int tag, size_t old_alloc, size_t new_alloc);
+
+const char *memory_tag_name(int tag);
+/* stats[MEM_NR] is the total. */
+void memory_get_stats(struct memory_stats stats[MEM_NR + 1]);
+void memory_report(void);
+
+#else
+
+static inline void memory_report(void)
+{
+}
+
+#endif
+
+#endif
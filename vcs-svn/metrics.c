@@ -0,0 +1,342 @@
+/*
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "strbuf.h"
+#include "metrics.h"
+#include "memory.h"
+
+int metrics_enabled;
+uint64_t metrics[METRIC_NR];
+
+static const char *metrics_file;
+static uint64_t start_ns, last_write_ns;
+
+/*
+ * stdout is usually a pipe to fast-import, so its bytes are counted
+ * by a thread forwarding them from a pipe of our own.
+ */
+static int real_stdout = -1;
+static int output_pipe = -1;
+static pthread_t forwarder;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t output_bytes;
+
+static const struct {
+	const char *family, *help, *unit, *label;
+	enum metric first;
+	int nr;
+} families[] = {
+	{ "svnfe_input_bytes", "Bytes of dump parsed.", "bytes",
+	  NULL, METRIC_INPUT_BYTES, 1 },
+	{ "svnfe_revisions", "Revisions read.", NULL,
+	  NULL, METRIC_REVISIONS, 1 },
+	{ "svnfe_nodes", "Nodes by action.", NULL,
+	  "action", METRIC_NODES_CHANGE, 4 },
+	{ "svnfe_text_bytes", "Bytes of node text by representation.",
+	  "bytes", "kind", METRIC_FULLTEXT_BYTES, 2 },
+	{ "svnfe_backchannel_requests", "Requests to the importer.", NULL,
+	  "command", METRIC_LS, 3 },
+	{ "svnfe_backchannel_wait_seconds",
+	  "Time spent waiting for the importer.", "seconds",
+	  NULL, METRIC_BACKCHANNEL_WAIT_NS, 1 },
+	{ "svnfe_svndiff_apply_seconds", "Time spent applying text deltas.",
+	  "seconds", NULL, METRIC_SVNDIFF_NS, 1 },
+	{ "svnfe_checkpoints", "Checkpoints asked of the importer.", NULL,
+	  NULL, METRIC_CHECKPOINTS, 1 },
+	{ "svnfe_checkpoint_seconds", "Time spent waiting for checkpoints.",
+	  "seconds", NULL, METRIC_CHECKPOINT_NS, 1 },
+};
+
+static const char *const label_values[METRIC_NR] = {
+	[METRIC_NODES_CHANGE] = "change",
+	[METRIC_NODES_ADD] = "add",
+	[METRIC_NODES_DELETE] = "delete",
+	[METRIC_NODES_REPLACE] = "replace",
+	[METRIC_FULLTEXT_BYTES] = "fulltext",
+	[METRIC_DELTA_BYTES] = "delta",
+	[METRIC_LS] = "ls",
+	[METRIC_LS_REV] = "ls-rev",
+	[METRIC_CAT_BLOB] = "cat-blob",
+};
+
+uint64_t metrics_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *forward_output(void *data)
+{
+	char buf[65536];
+	ssize_t len;
+
+	(void) data;
+	while ((len = read(output_pipe, buf, sizeof(buf))) != 0) {
+		ssize_t done = 0;
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("cannot read output pipe");
+		}
+		while (done < len) {
+			ssize_t n = write(real_stdout, buf + done, len - done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				die_errno("cannot write output");
+			done += n;
+		}
+		pthread_mutex_lock(&output_lock);
+		output_bytes += len;
+		pthread_mutex_unlock(&output_lock);
+	}
+	return NULL;
+}
+
+static uint64_t get_output_bytes(void)
+{
+	uint64_t n;
+	pthread_mutex_lock(&output_lock);
+	n = output_bytes;
+	pthread_mutex_unlock(&output_lock);
+	return n;
+}
+
+int metrics_init(const char *file)
+{
+	int fd[2], err;
+
+	fflush(stdout);
+	real_stdout = dup(1);
+	if (real_stdout < 0 || pipe(fd))
+		return error("cannot count output: %s", strerror(errno));
+	if (dup2(fd[1], 1) < 0)
+		return error("cannot count output: %s", strerror(errno));
+	close(fd[1]);
+	output_pipe = fd[0];
+	err = pthread_create(&forwarder, NULL, forward_output, NULL);
+	if (err)
+		return error("cannot count output: %s", strerror(err));
+
+	metrics_file = file;
+	metrics_enabled = 1;
+	start_ns = last_write_ns = metrics_clock_ns();
+	return 0;
+}
+
+static void add_sample(struct strbuf *out, const char *family,
+		       const char *label, enum metric m, const char *value)
+{
+	strbuf_addstr(out, family);
+	strbuf_addstr(out, "_total");
+	if (label) {
+		strbuf_addch(out, '{');
+		strbuf_addstr(out, label);
+		strbuf_addstr(out, "=\"");
+		strbuf_addstr(out, label_values[m]);
+		strbuf_addstr(out, "\"}");
+	}
+	strbuf_addch(out, ' ');
+	strbuf_addstr(out, value);
+	strbuf_addch(out, '\n');
+}
+
+static void add_family(struct strbuf *out, const char *family,
+		       const char *help, const char *unit)
+{
+	strbuf_addstr(out, "# TYPE ");
+	strbuf_addstr(out, family);
+	strbuf_addstr(out, " counter\n");
+	if (unit) {
+		strbuf_addstr(out, "# UNIT ");
+		strbuf_addstr(out, family);
+		strbuf_addch(out, ' ');
+		strbuf_addstr(out, unit);
+		strbuf_addch(out, '\n');
+	}
+	strbuf_addstr(out, "# HELP ");
+	strbuf_addstr(out, family);
+	strbuf_addch(out, ' ');
+	strbuf_addstr(out, help);
+	strbuf_addch(out, '\n');
+}
+
+#ifdef MEMORY_ACCOUNTING
+static void add_memory_gauge(struct strbuf *out, const char *family,
+			     const char *help, const uint64_t values[MEM_NR])
+{
+	char value[64];
+	int i;
+
+	strbuf_addstr(out, "# TYPE ");
+	strbuf_addstr(out, family);
+	strbuf_addstr(out, " gauge\n# UNIT ");
+	strbuf_addstr(out, family);
+	strbuf_addstr(out, " bytes\n# HELP ");
+	strbuf_addstr(out, family);
+	strbuf_addch(out, ' ');
+	strbuf_addstr(out, help);
+	strbuf_addch(out, '\n');
+	for (i = 0; i < MEM_NR; i++) {
+		snprintf(value, sizeof(value), "%"PRIu64, values[i]);
+		strbuf_addstr(out, family);
+		strbuf_addstr(out, "{tag=\"");
+		strbuf_addstr(out, memory_tag_name(i));
+		strbuf_addstr(out, "\"} ");
+		strbuf_addstr(out, value);
+		strbuf_addch(out, '\n');
+	}
+}
+
+static void add_memory_metrics(struct strbuf *out)
+{
+	struct memory_stats s[MEM_NR + 1];
+	uint64_t current[MEM_NR], peak[MEM_NR];
+	char value[64];
+	int i;
+
+	memory_get_stats(s);
+	for (i = 0; i < MEM_NR; i++) {
+		current[i] = s[i].current;
+		peak[i] = s[i].peak;
+	}
+	add_memory_gauge(out, "svnfe_strbuf_bytes",
+			 "Bytes held in strbufs.", current);
+	add_memory_gauge(out, "svnfe_strbuf_peak_bytes",
+			 "Most bytes held in strbufs at once.", peak);
+	add_family(out, "svnfe_strbuf_allocations",
+		   "Buffers allocated from empty.", NULL);
+	for (i = 0; i < MEM_NR; i++) {
+		strbuf_addstr(out, "svnfe_strbuf_allocations_total{tag=\"");
+		strbuf_addstr(out, memory_tag_name(i));
+		snprintf(value, sizeof(value), "\"} %"PRIu64"\n",
+			 s[i].allocations);
+		strbuf_addstr(out, value);
+	}
+}
+#endif
+
+static void format_metrics(struct strbuf *out, uint64_t now)
+{
+	char value[64];
+	size_t i;
+	int j;
+
+	for (i = 0; i < sizeof(families) / sizeof(*families); i++) {
+		add_family(out, families[i].family, families[i].help,
+			   families[i].unit);
+		for (j = 0; j < families[i].nr; j++) {
+			enum metric m = families[i].first + j;
+			if (m == METRIC_BACKCHANNEL_WAIT_NS ||
+			    m == METRIC_SVNDIFF_NS ||
+			    m == METRIC_CHECKPOINT_NS)
+				snprintf(value, sizeof(value), "%.6f",
+					 metrics[m] / 1e9);
+			else
+				snprintf(value, sizeof(value), "%"PRIu64,
+					 metrics[m]);
+			add_sample(out, families[i].family, families[i].label,
+				   m, value);
+		}
+	}
+	add_family(out, "svnfe_output_bytes", "Bytes of stream written.",
+		   "bytes");
+	snprintf(value, sizeof(value), "%"PRIu64, get_output_bytes());
+	add_sample(out, "svnfe_output_bytes", NULL, 0, value);
+
+#ifdef MEMORY_ACCOUNTING
+	add_memory_metrics(out);
+#endif
+	strbuf_addstr(out, "# TYPE svnfe_elapsed_seconds gauge\n"
+		      "# UNIT svnfe_elapsed_seconds seconds\n"
+		      "svnfe_elapsed_seconds ");
+	snprintf(value, sizeof(value), "%.6f", (now - start_ns) / 1e9);
+	strbuf_addstr(out, value);
+	strbuf_addstr(out, "\n# EOF\n");
+}
+
+/* Replace the file in one go, for scrapers that read it meanwhile. */
+static void write_metrics(uint64_t now)
+{
+	static struct strbuf out = STRBUF_INIT;
+	static struct strbuf tmp = STRBUF_INIT;
+	FILE *f;
+
+	if (!metrics_file)
+		return;
+	strbuf_reset(&out);
+	format_metrics(&out, now);
+	strbuf_reset(&tmp);
+	strbuf_addstr(&tmp, metrics_file);
+	strbuf_addstr(&tmp, ".tmp");
+	f = fopen(tmp.buf, "w");
+	if (!f)
+		die_errno("cannot write %s", tmp.buf);
+	fwrite(out.buf, 1, out.len, f);
+	if (fclose(f))
+		die_errno("cannot write %s", tmp.buf);
+	if (rename(tmp.buf, metrics_file))
+		die_errno("cannot rename %s to %s", tmp.buf, metrics_file);
+	last_write_ns = now;
+}
+
+void metrics_tick(void)
+{
+	uint64_t now;
+
+	if (!metrics_enabled)
+		return;
+	now = metrics_clock_ns();
+	if (now - last_write_ns >= 1000000000)
+		write_metrics(now);
+}
+
+void metrics_finish(void)
+{
+	uint64_t now;
+	double secs;
+
+	if (!metrics_enabled)
+		return;
+	/* Closing our end of the pipe lets the forwarder finish. */
+	fflush(stdout);
+	if (dup2(real_stdout, 1) < 0)
+		die_errno("cannot restore stdout");
+	pthread_join(forwarder, NULL);
+	close(output_pipe);
+	close(real_stdout);
+
+	now = metrics_clock_ns();
+	write_metrics(now);
+	secs = (now - start_ns) / 1e9;
+	fprintf(stderr, "Input: %"PRIu64" bytes, %"PRIu64" revisions"
+		" in %.3f s (%.1f MB/s)\n",
+		metrics[METRIC_INPUT_BYTES], metrics[METRIC_REVISIONS], secs,
+		secs > 0 ? metrics[METRIC_INPUT_BYTES] / secs / 1e6 : 0.0);
+	fprintf(stderr, "Nodes: %"PRIu64" added, %"PRIu64" changed, "
+		"%"PRIu64" deleted, %"PRIu64" replaced\n",
+		metrics[METRIC_NODES_ADD], metrics[METRIC_NODES_CHANGE],
+		metrics[METRIC_NODES_DELETE], metrics[METRIC_NODES_REPLACE]);
+	fprintf(stderr, "Text: %"PRIu64" bytes fulltext, "
+		"%"PRIu64" bytes delta, %.3f s applying deltas\n",
+		metrics[METRIC_FULLTEXT_BYTES], metrics[METRIC_DELTA_BYTES],
+		metrics[METRIC_SVNDIFF_NS] / 1e9);
+	fprintf(stderr, "Backchannel: %"PRIu64" ls, %"PRIu64" ls :rev, "
+		"%"PRIu64" cat-blob, %.3f s waiting\n",
+		metrics[METRIC_LS], metrics[METRIC_LS_REV],
+		metrics[METRIC_CAT_BLOB],
+		metrics[METRIC_BACKCHANNEL_WAIT_NS] / 1e9);
+	if (metrics[METRIC_CHECKPOINTS])
+		fprintf(stderr, "Checkpoints: %"PRIu64", %.3f s waiting\n",
+			metrics[METRIC_CHECKPOINTS],
+			metrics[METRIC_CHECKPOINT_NS] / 1e9);
+	fprintf(stderr, "Output: %"PRIu64" bytes\n", get_output_bytes());
+	metrics_enabled = 0;
+}
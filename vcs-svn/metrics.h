@@ -0,0 +1,57 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+/*
+ * Counters and timers for finding out where an import spends its
+ * time.  When metrics are off, each update costs one test of
+ * metrics_enabled, and timers do not read the clock.
+ */
+
+enum metric {
+	METRIC_INPUT_BYTES,
+	METRIC_REVISIONS,
+	METRIC_NODES_CHANGE,	/* in the order of svndump's NODEACT_* */
+	METRIC_NODES_ADD,
+	METRIC_NODES_DELETE,
+	METRIC_NODES_REPLACE,
+	METRIC_FULLTEXT_BYTES,
+	METRIC_DELTA_BYTES,
+	METRIC_LS,
+	METRIC_LS_REV,
+	METRIC_CAT_BLOB,
+	METRIC_BACKCHANNEL_WAIT_NS,
+	METRIC_SVNDIFF_NS,
+	METRIC_CHECKPOINTS,
+	METRIC_CHECKPOINT_NS,
+	METRIC_NR
+};
+
+extern int metrics_enabled;
+extern uint64_t metrics[METRIC_NR];
+
+#define metrics_add(m, n) \
+	do { \
+		if (metrics_enabled) \
+			metrics[m] += (n); \
+	} while (0)
+
+uint64_t metrics_clock_ns(void);
+
+/* uint64_t start = metrics_start(); ...; metrics_stop(METRIC_X_NS, start); */
+static inline uint64_t metrics_start(void)
+{
+	return metrics_enabled ? metrics_clock_ns() : 0;
+}
+#define metrics_stop(m, start) metrics_add(m, metrics_clock_ns() - (start))
+
+/*
+ * Start counting, including the bytes written to stdout, and rewrite
+ * file in the OpenMetrics text format at most once a second from
+ * metrics_tick().
+ */
+int metrics_init(const char *file);
+void metrics_tick(void);
+/* Write the file a last time and a summary to stderr. */
+void metrics_finish(void);
+
+#endif
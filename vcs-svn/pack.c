@@ -0,0 +1,840 @@
+/*
+ * Write a git packfile (version 2) and its index directly.
+ *
+ * Objects are named as they come, so that duplicates are dropped
+ * before they are stored.  With a thread pool, each is deflated on it
+ * into a slot of its own, and a batch of slots is appended to the pack
+ * in order once they are all full; without one, or for a blob too
+ * large to hold in memory, objects are deflated as they are written,
+ * truncating the pack back if the name is only known after the object
+ * has been streamed out.  The object count and trailing checksum are
+ * fixed up when the pack is closed.
+ *
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "strbuf.h"
+#include "memory.h"
+#include "line_buffer.h"
+#include "sha1.h"
+#include "thread_pool.h"
+#include "pack.h"
+
+#define PACK_CHUNK 65536
+#define SLOTS_PER_THREAD 4
+/* Larger blobs are deflated as they are read, on the main thread. */
+#define SLOT_BLOB_MAX (8 << 20)
+#define SLOT_KEEP_MAX (1 << 20)
+
+struct pack_entry {
+	unsigned char sha1[20];
+	off_t offset;
+	uint32_t crc;
+	unsigned char type;	/* as stored */
+	unsigned char depth;	/* length of delta chain */
+};
+
+static struct pack_entry *entries;
+static size_t nr_entries, entries_alloc;
+static uint32_t *table;	/* entry index + 1, open addressing */
+static size_t table_size;
+
+static struct strbuf pack_dir = STRBUF_INIT;
+static struct strbuf pack_tmp = STRBUF_INIT;
+static FILE *pack_out;
+static int compression;
+static z_stream deflater;
+static int deflater_ready;
+static off_t pack_off;
+static uint32_t pack_crc;
+
+/* An object deflated on the pool, waiting to be appended. */
+struct pack_slot {
+	/* Indices into entries, which can move as it grows. */
+	size_t entry, base_entry;	/* the latter for a delta */
+	unsigned char type;
+	struct strbuf data, deflated;
+	z_stream z;
+	int z_ready;
+};
+
+static struct thread_pool pool;
+static int pool_ready;
+static struct pack_slot *slots;
+static size_t nr_slots, nr_filled;
+
+static const char *const type_names[] = {
+	NULL, "commit", "tree", "blob"
+};
+
+static size_t table_slot(const unsigned char *sha1)
+{
+	size_t pos = ((size_t) sha1[0] << 24 | sha1[1] << 16 |
+			sha1[2] << 8 | sha1[3]) & (table_size - 1);
+	while (table[pos] &&
+	       memcmp(entries[table[pos] - 1].sha1, sha1, 20))
+		pos = (pos + 1) & (table_size - 1);
+	return pos;
+}
+
+static struct pack_entry *find_entry(const unsigned char *sha1)
+{
+	size_t pos;
+	if (!table_size)
+		return NULL;
+	pos = table_slot(sha1);
+	return table[pos] ? &entries[table[pos] - 1] : NULL;
+}
+
+static void grow_table(void)
+{
+	size_t i;
+
+	free(table);
+	table_size = table_size ? table_size * 2 : 1024;
+	table = calloc(table_size, sizeof(*table));
+	if (!table)
+		die("out of memory");
+	for (i = 0; i < nr_entries; i++)
+		table[table_slot(entries[i].sha1)] = i + 1;
+}
+
+static struct pack_entry *add_entry(const unsigned char *sha1, off_t offset,
+				enum object_type type, int depth)
+{
+	struct pack_entry *e;
+
+	if (2 * (nr_entries + 1) > table_size)
+		grow_table();
+	ALLOC_GROW(entries, nr_entries + 1, entries_alloc);
+	e = &entries[nr_entries++];
+	memcpy(e->sha1, sha1, 20);
+	e->offset = offset;
+	e->crc = pack_crc;
+	e->type = type;
+	e->depth = depth;
+	table[table_slot(sha1)] = nr_entries;
+	return e;
+}
+
+int pack_has_object(const unsigned char sha1[20])
+{
+	return !!find_entry(sha1);
+}
+
+static void write_or_die(const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, pack_out) != len)
+		die_errno("cannot write pack");
+	pack_crc = crc32(pack_crc, buf, len);
+	pack_off += len;
+}
+
+static void write_object_header(enum object_type type, uintmax_t size)
+{
+	unsigned char hdr[16];
+	size_t n = 0;
+
+	pack_crc = crc32(0, NULL, 0);
+	hdr[n] = type << 4 | (size & 0xf);
+	size >>= 4;
+	while (size) {
+		hdr[n++] |= 0x80;
+		hdr[n] = size & 0x7f;
+		size >>= 7;
+	}
+	write_or_die(hdr, n + 1);
+}
+
+/*
+ * One zlib stream is reset for each object, since setting one up
+ * allocates a few hundred kilobytes.
+ */
+static void deflate_begin(void)
+{
+	if (deflater_ready) {
+		deflateReset(&deflater);
+		return;
+	}
+	memset(&deflater, 0, sizeof(deflater));
+	if (deflateInit(&deflater, compression) != Z_OK)
+		die("cannot initialize zlib");
+	deflater_ready = 1;
+}
+
+/* Deflate len bytes and write the result; finish the stream if asked. */
+static void deflate_write(const void *buf, size_t len, int finish)
+{
+	unsigned char out[PACK_CHUNK];
+	z_stream *z = &deflater;
+	int status;
+
+	z->next_in = (unsigned char *) buf;
+	z->avail_in = len;
+	do {
+		z->next_out = out;
+		z->avail_out = sizeof(out);
+		status = deflate(z, finish ? Z_FINISH : Z_NO_FLUSH);
+		if (status == Z_STREAM_ERROR)
+			die("zlib error while writing pack");
+		write_or_die(out, sizeof(out) - z->avail_out);
+	} while (z->avail_out == 0 || (finish && status != Z_STREAM_END));
+}
+
+/* The distance back to a delta's base, as encoded by git's pack-objects. */
+static void write_base_offset(off_t rel)
+{
+	unsigned char ofs[16];
+	size_t pos = sizeof(ofs) - 1;
+
+	ofs[pos] = rel & 0x7f;
+	while (rel >>= 7)
+		ofs[--pos] = 0x80 | (--rel & 0x7f);
+	write_or_die(ofs + pos, sizeof(ofs) - pos);
+}
+
+/* Deflate the data of a slot in one go; runs on the pool. */
+static void deflate_slot(void *data)
+{
+	struct pack_slot *slot = data;
+	z_stream *z = &slot->z;
+	uLong bound;
+
+	if (slot->z_ready) {
+		deflateReset(z);
+	} else {
+		memset(z, 0, sizeof(*z));
+		if (deflateInit(z, compression) != Z_OK)
+			die("cannot initialize zlib");
+		slot->z_ready = 1;
+	}
+	bound = deflateBound(z, slot->data.len);
+	strbuf_reset(&slot->deflated);
+	strbuf_grow(&slot->deflated, bound);
+	z->next_in = (unsigned char *) slot->data.buf;
+	z->avail_in = slot->data.len;
+	z->next_out = (unsigned char *) slot->deflated.buf;
+	z->avail_out = bound;
+	if (deflate(z, Z_FINISH) != Z_STREAM_END)
+		die("zlib error while writing pack");
+	strbuf_setlen(&slot->deflated, bound - z->avail_out);
+}
+
+static void append_slot(struct pack_slot *slot)
+{
+	struct pack_entry *e = &entries[slot->entry];
+
+	e->offset = pack_off;
+	write_object_header(slot->type, slot->data.len);
+	if (slot->type == OBJ_OFS_DELTA)
+		write_base_offset(e->offset - entries[slot->base_entry].offset);
+	write_or_die(slot->deflated.buf, slot->deflated.len);
+	e->crc = pack_crc;
+	strbuf_recycle(&slot->data, SLOT_KEEP_MAX);
+	strbuf_recycle(&slot->deflated, SLOT_KEEP_MAX);
+}
+
+/* Wait for the objects on the pool and append them in order. */
+static void flush_slots(void)
+{
+	size_t i;
+
+	if (!nr_filled)
+		return;
+	thread_pool_wait(&pool);
+	for (i = 0; i < nr_filled; i++)
+		append_slot(&slots[i]);
+	nr_filled = 0;
+}
+
+/* An empty slot for the next object, to be filled and then queued. */
+static struct pack_slot *next_slot(void)
+{
+	struct pack_slot *slot;
+
+	if (nr_filled == nr_slots)
+		flush_slots();
+	slot = &slots[nr_filled];
+	strbuf_reset(&slot->data);
+	return slot;
+}
+
+/* Deflate the slot's data as object sha1 on the pool. */
+static void queue_slot(struct pack_slot *slot, const unsigned char *sha1,
+		       enum object_type type, size_t base_entry, int depth)
+{
+	add_entry(sha1, -1, type, depth);
+	slot->entry = nr_entries - 1;
+	slot->base_entry = base_entry;
+	slot->type = type;
+	nr_filled++;
+	thread_pool_submit(&pool, deflate_slot, slot);
+}
+
+static void object_header_sha1(struct sha1_ctx *ctx, enum object_type type,
+				uintmax_t len)
+{
+	char hdr[64];
+	int n = snprintf(hdr, sizeof(hdr), "%s %"PRIuMAX, type_names[type], len);
+	sha1_init(ctx);
+	sha1_update(ctx, hdr, n + 1);
+}
+
+void hash_object(enum object_type type, const void *buf, size_t len,
+		 unsigned char sha1[20])
+{
+	struct sha1_ctx ctx;
+	object_header_sha1(&ctx, type, len);
+	sha1_update(&ctx, buf, len);
+	sha1_final(sha1, &ctx);
+}
+
+void pack_write(enum object_type type, const void *buf, size_t len,
+		unsigned char sha1[20])
+{
+	off_t offset = pack_off;
+
+	hash_object(type, buf, len, sha1);
+	if (find_entry(sha1))
+		return;
+	if (pool_ready) {
+		struct pack_slot *slot = next_slot();
+
+		strbuf_add(&slot->data, buf, len);
+		queue_slot(slot, sha1, type, 0, 0);
+		return;
+	}
+	write_object_header(type, len);
+	deflate_begin();
+	deflate_write(buf, len, 1);
+	add_entry(sha1, offset, type, 0);
+}
+
+/* Forget the last object written, which turned out to be a duplicate. */
+static void truncate_pack(off_t offset)
+{
+	if (fflush(pack_out) || ftruncate(fileno(pack_out), offset) ||
+	    fseeko(pack_out, offset, SEEK_SET))
+		die_errno("cannot truncate pack");
+	pack_off = offset;
+}
+
+int hash_blob(struct line_buffer *input, off_t len, unsigned char sha1[20])
+{
+	static struct strbuf chunk = STRBUF_INIT_TAGGED(MEM_PACK);
+	struct sha1_ctx ctx;
+	off_t done;
+
+	object_header_sha1(&ctx, OBJ_BLOB, len);
+	for (done = 0; done < len; done += chunk.len) {
+		size_t n = len - done < PACK_CHUNK ? len - done : PACK_CHUNK;
+		strbuf_reset(&chunk);
+		if (buffer_read_binary(input, &chunk, n) != n)
+			return -1;
+		sha1_update(&ctx, chunk.buf, chunk.len);
+	}
+	sha1_final(sha1, &ctx);
+	return 0;
+}
+
+int pack_write_blob(struct line_buffer *input, off_t len,
+		    unsigned char sha1[20], FILE *copy)
+{
+	static struct strbuf chunk = STRBUF_INIT_TAGGED(MEM_PACK);
+	off_t offset;
+	struct sha1_ctx ctx;
+	off_t done;
+
+	if (pool_ready && len <= SLOT_BLOB_MAX) {
+		struct pack_slot *slot = next_slot();
+
+		if (buffer_read_binary(input, &slot->data, len) != (size_t) len)
+			return -1;
+		if (copy)
+			fwrite(slot->data.buf, 1, len, copy);
+		hash_object(OBJ_BLOB, slot->data.buf, len, sha1);
+		if (!find_entry(sha1))
+			queue_slot(slot, sha1, OBJ_BLOB, 0, 0);
+		return 0;
+	}
+	flush_slots();
+	offset = pack_off;
+	object_header_sha1(&ctx, OBJ_BLOB, len);
+	write_object_header(OBJ_BLOB, len);
+	deflate_begin();
+	for (done = 0; done < len; done += chunk.len) {
+		size_t n = len - done < PACK_CHUNK ? len - done : PACK_CHUNK;
+		strbuf_reset(&chunk);
+		if (buffer_read_binary(input, &chunk, n) != n) {
+			truncate_pack(offset);
+			return -1;
+		}
+		sha1_update(&ctx, chunk.buf, chunk.len);
+		deflate_write(chunk.buf, chunk.len, 0);
+		if (copy)
+			fwrite(chunk.buf, 1, chunk.len, copy);
+	}
+	deflate_write(NULL, 0, 1);
+	sha1_final(sha1, &ctx);
+	if (find_entry(sha1))
+		truncate_pack(offset);
+	else
+		add_entry(sha1, offset, OBJ_BLOB, 0);
+	return 0;
+}
+
+static size_t encode_delta_size(unsigned char *buf, uintmax_t size)
+{
+	size_t n = 0;
+	do {
+		buf[n] = size & 0x7f;
+		size >>= 7;
+		if (size)
+			buf[n] |= 0x80;
+		n++;
+	} while (size);
+	return n;
+}
+
+void pack_write_blob_delta(const unsigned char base[20], off_t base_len,
+			   const unsigned char sha1[20], off_t len,
+			   const void *delta, size_t delta_len)
+{
+	const struct pack_entry *b = find_entry(base);
+	off_t offset = pack_off;
+	unsigned char sizes[32];
+	size_t nr_sizes;
+
+	if (find_entry(sha1))
+		return;
+	if (!b || b->depth >= PACK_MAX_DELTA_DEPTH)
+		die("BUG: invalid delta base %s", sha1_to_hex(base));
+
+	nr_sizes = encode_delta_size(sizes, base_len);
+	nr_sizes += encode_delta_size(sizes + nr_sizes, len);
+	if (pool_ready) {
+		size_t base_entry = b - entries;
+		struct pack_slot *slot = next_slot();
+
+		strbuf_add(&slot->data, sizes, nr_sizes);
+		strbuf_add(&slot->data, delta, delta_len);
+		queue_slot(slot, sha1, OBJ_OFS_DELTA, base_entry,
+			   entries[base_entry].depth + 1);
+		return;
+	}
+	write_object_header(OBJ_OFS_DELTA, nr_sizes + delta_len);
+	write_base_offset(offset - b->offset);
+	deflate_begin();
+	deflate_write(sizes, nr_sizes, 0);
+	deflate_write(delta, delta_len, 1);
+	add_entry(sha1, offset, OBJ_OFS_DELTA, b->depth + 1);
+}
+
+int pack_delta_depth(const unsigned char sha1[20])
+{
+	const struct pack_entry *e = find_entry(sha1);
+	return e ? e->depth : -1;
+}
+
+/* Reading objects back */
+
+static int read_at(off_t offset, void *buf, size_t len)
+{
+	ssize_t n = pread(fileno(pack_out), buf, len, offset);
+	if (n < 0)
+		return error("cannot read pack: %s", strerror(errno));
+	return n;
+}
+
+/*
+ * Parse the object header at offset; on return *offset points at the
+ * deflated data and *base_offset is set for deltas.
+ */
+static int read_object_header(off_t *offset, enum object_type *type,
+			      uintmax_t *size, off_t *base_offset)
+{
+	unsigned char hdr[32];
+	int n = read_at(*offset, hdr, sizeof(hdr));
+	int pos = 0, shift = 4;
+
+	if (n < 1)
+		return error("truncated pack");
+	*type = (hdr[0] >> 4) & 7;
+	*size = hdr[0] & 0xf;
+	while (hdr[pos] & 0x80) {
+		if (++pos >= n)
+			return error("truncated pack");
+		*size |= (uintmax_t) (hdr[pos] & 0x7f) << shift;
+		shift += 7;
+	}
+	pos++;
+	if (*type == OBJ_OFS_DELTA) {
+		off_t rel = hdr[pos] & 0x7f;
+		while (hdr[pos] & 0x80) {
+			if (++pos >= n)
+				return error("truncated pack");
+			rel = ((rel + 1) << 7) | (hdr[pos] & 0x7f);
+		}
+		pos++;
+		*base_offset = *offset - rel;
+	}
+	*offset += pos;
+	return 0;
+}
+
+/* Inflate the data at offset, to out if given, else appended to sb. */
+static int inflate_at(off_t offset, uintmax_t size, FILE *out,
+		      struct strbuf *sb)
+{
+	unsigned char in[PACK_CHUNK], buf[PACK_CHUNK];
+	uintmax_t done = 0;
+	int status = Z_OK;
+	z_stream z;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK)
+		return error("cannot initialize zlib");
+	while (status != Z_STREAM_END) {
+		int n;
+		if (!z.avail_in) {
+			n = read_at(offset, in, sizeof(in));
+			if (n <= 0)
+				break;
+			offset += n;
+			z.next_in = in;
+			z.avail_in = n;
+		}
+		z.next_out = buf;
+		z.avail_out = sizeof(buf);
+		status = inflate(&z, Z_NO_FLUSH);
+		if (status != Z_OK && status != Z_STREAM_END)
+			break;
+		n = sizeof(buf) - z.avail_out;
+		done += n;
+		if (out && fwrite(buf, 1, n, out) != (size_t) n)
+			status = Z_ERRNO;
+		if (sb)
+			strbuf_add(sb, buf, n);
+	}
+	inflateEnd(&z);
+	if (status != Z_STREAM_END || done != size)
+		return error("corrupt object in pack");
+	return 0;
+}
+
+static uintmax_t delta_size(const unsigned char **p, const unsigned char *end)
+{
+	uintmax_t size = 0;
+	int shift = 0;
+	while (*p != end) {
+		unsigned char c = *(*p)++;
+		size |= (uintmax_t) (c & 0x7f) << shift;
+		shift += 7;
+		if (!(c & 0x80))
+			break;
+	}
+	return size;
+}
+
+static int apply_git_delta(const struct strbuf *base, const struct strbuf *delta,
+			   struct strbuf *out)
+{
+	const unsigned char *p = (const unsigned char *) delta->buf;
+	const unsigned char *end = p + delta->len;
+
+	if (delta_size(&p, end) != base->len)
+		return error("delta base size mismatch");
+	strbuf_grow(out, delta_size(&p, end));
+	while (p != end) {
+		unsigned char op = *p++;
+		if (op & 0x80) {
+			uint32_t off = 0, len = 0;
+			int i;
+			for (i = 0; i < 4; i++)
+				if (op & (1 << i))
+					off |= (uint32_t) *p++ << (8 * i);
+			for (i = 0; i < 3; i++)
+				if (op & (0x10 << i))
+					len |= (uint32_t) *p++ << (8 * i);
+			if (!len)
+				len = 0x10000;
+			if (off > base->len || len > base->len - off)
+				return error("delta copies outside its base");
+			strbuf_add(out, base->buf + off, len);
+		} else if (op) {
+			if (op > end - p)
+				return error("truncated delta");
+			strbuf_add(out, p, op);
+			p += op;
+		} else {
+			return error("unexpected delta opcode 0");
+		}
+	}
+	return 0;
+}
+
+static int read_object_at(off_t offset, struct strbuf *out, FILE *to)
+{
+	enum object_type type;
+	uintmax_t size;
+	off_t base_offset = 0;
+
+	if (read_object_header(&offset, &type, &size, &base_offset))
+		return -1;
+	if (type != OBJ_OFS_DELTA)
+		return inflate_at(offset, size, to, out);
+	{
+		struct strbuf base = STRBUF_INIT_TAGGED(MEM_PACK);
+		struct strbuf delta = STRBUF_INIT_TAGGED(MEM_PACK);
+		struct strbuf result = STRBUF_INIT_TAGGED(MEM_PACK);
+		int rv = -1;
+
+		if (!read_object_at(base_offset, &base, NULL) &&
+		    !inflate_at(offset, size, NULL, &delta) &&
+		    !apply_git_delta(&base, &delta, &result)) {
+			rv = 0;
+			if (out)
+				strbuf_add(out, result.buf, result.len);
+			if (to && fwrite(result.buf, 1, result.len, to) != result.len)
+				rv = error("cannot write blob: %s", strerror(errno));
+		}
+		strbuf_release(&base);
+		strbuf_release(&delta);
+		strbuf_release(&result);
+		return rv;
+	}
+}
+
+off_t pack_read_blob(const unsigned char sha1[20], FILE *out)
+{
+	const struct pack_entry *e = find_entry(sha1);
+	off_t start = ftello(out);
+
+	if (!e)
+		return error("blob %s is not in the pack", sha1_to_hex(sha1));
+	flush_slots();
+	if (fflush(pack_out))
+		return error("cannot flush pack: %s", strerror(errno));
+	if (read_object_at(e->offset, NULL, out))
+		return -1;
+	return ftello(out) - start;
+}
+
+/* Opening and closing */
+
+int pack_open(const char *dir, int level, int nr_threads)
+{
+	static const unsigned char hdr[12] = { 'P', 'A', 'C', 'K', 0, 0, 0, 2 };
+	size_t i;
+	int fd;
+
+	strbuf_reset(&pack_dir);
+	strbuf_addstr(&pack_dir, dir);
+	strbuf_reset(&pack_tmp);
+	strbuf_addstr(&pack_tmp, dir);
+	strbuf_addstr(&pack_tmp, "/tmp_pack_XXXXXX");
+	fd = mkstemp(pack_tmp.buf);
+	if (fd < 0 || !(pack_out = fdopen(fd, "w+")))
+		return error("cannot create pack in %s: %s", dir, strerror(errno));
+	pack_off = 0;
+	compression = level;
+	write_or_die(hdr, sizeof(hdr));
+	if (nr_threads <= 1 || thread_pool_init(&pool, nr_threads))
+		return 0;	/* deflate objects as they come, then */
+	pool_ready = 1;
+	nr_slots = (size_t) nr_threads * SLOTS_PER_THREAD;
+	slots = calloc(nr_slots, sizeof(*slots));
+	if (!slots)
+		die_errno("cannot allocate pack slots");
+	for (i = 0; i < nr_slots; i++) {
+		strbuf_init(&slots[i].data, 0);
+		strbuf_set_tag(&slots[i].data, MEM_PACK);
+		strbuf_init(&slots[i].deflated, 0);
+		strbuf_set_tag(&slots[i].deflated, MEM_PACK);
+	}
+	return 0;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* Checksum the pack as written and append the trailer. */
+static int finish_pack(unsigned char pack_sha1[20])
+{
+	unsigned char buf[PACK_CHUNK];
+	struct sha1_ctx ctx;
+	off_t offset = 0;
+
+	flush_slots();
+	put_be32(buf, nr_entries);
+	if (fflush(pack_out) ||
+	    pwrite(fileno(pack_out), buf, 4, 8) != 4)
+		return error("cannot write pack: %s", strerror(errno));
+	sha1_init(&ctx);
+	while (offset < pack_off) {
+		int n = read_at(offset, buf, sizeof(buf));
+		if (n <= 0)
+			return error("cannot reread pack");
+		sha1_update(&ctx, buf, n);
+		offset += n;
+	}
+	sha1_final(pack_sha1, &ctx);
+	if (fseeko(pack_out, 0, SEEK_END))
+		return error("cannot write pack: %s", strerror(errno));
+	write_or_die(pack_sha1, 20);
+	if (fclose(pack_out))
+		return error("cannot write pack: %s", strerror(errno));
+	pack_out = NULL;
+	return 0;
+}
+
+static int sha1_order(const void *a, const void *b)
+{
+	const struct pack_entry *const *x = a, *const *y = b;
+	return memcmp((*x)->sha1, (*y)->sha1, 20);
+}
+
+static void idx_write(FILE *f, struct sha1_ctx *ctx, const void *buf, size_t len)
+{
+	sha1_update(ctx, buf, len);
+	fwrite(buf, 1, len, f);
+}
+
+static int write_index(const char *path, const unsigned char pack_sha1[20])
+{
+	static const unsigned char hdr[8] = { 0xff, 't', 'O', 'c', 0, 0, 0, 2 };
+	struct pack_entry **sorted;
+	unsigned char word[8], idx_sha1[20];
+	struct sha1_ctx ctx;
+	uint32_t nr_large = 0;
+	size_t i, j;
+	FILE *f;
+
+	sorted = calloc(nr_entries + 1, sizeof(*sorted));
+	if (!sorted || !(f = fopen(path, "w")))
+		return error("cannot write %s: %s", path, strerror(errno));
+	for (i = 0; i < nr_entries; i++)
+		sorted[i] = &entries[i];
+	qsort(sorted, nr_entries, sizeof(*sorted), sha1_order);
+
+	sha1_init(&ctx);
+	idx_write(f, &ctx, hdr, sizeof(hdr));
+	for (i = 0, j = 0; i < 256; i++) {
+		while (j < nr_entries && sorted[j]->sha1[0] <= i)
+			j++;
+		put_be32(word, j);
+		idx_write(f, &ctx, word, 4);
+	}
+	for (i = 0; i < nr_entries; i++)
+		idx_write(f, &ctx, sorted[i]->sha1, 20);
+	for (i = 0; i < nr_entries; i++) {
+		put_be32(word, sorted[i]->crc);
+		idx_write(f, &ctx, word, 4);
+	}
+	for (i = 0; i < nr_entries; i++) {
+		if (sorted[i]->offset < 0x80000000)
+			put_be32(word, sorted[i]->offset);
+		else
+			put_be32(word, 0x80000000 | nr_large++);
+		idx_write(f, &ctx, word, 4);
+	}
+	for (i = 0; i < nr_entries; i++) {
+		uint64_t offset = sorted[i]->offset;
+		if (offset < 0x80000000)
+			continue;
+		put_be32(word, offset >> 32);
+		put_be32(word + 4, offset);
+		idx_write(f, &ctx, word, 8);
+	}
+	idx_write(f, &ctx, pack_sha1, 20);
+	sha1_final(idx_sha1, &ctx);
+	fwrite(idx_sha1, 1, 20, f);
+	free(sorted);
+	if (ferror(f) | fclose(f) || chmod(path, 0444))
+		return error("cannot write %s: %s", path, strerror(errno));
+	return 0;
+}
+
+static void release_index(void)
+{
+	size_t i;
+
+	if (pool_ready)
+		thread_pool_release(&pool);
+	for (i = 0; i < nr_slots; i++) {
+		if (slots[i].z_ready)
+			deflateEnd(&slots[i].z);
+		strbuf_release(&slots[i].data);
+		strbuf_release(&slots[i].deflated);
+	}
+	free(slots);
+	slots = NULL;
+	nr_slots = nr_filled = 0;
+	pool_ready = 0;
+	if (deflater_ready)
+		deflateEnd(&deflater);
+	deflater_ready = 0;
+	free(entries);
+	free(table);
+	entries = NULL;
+	table = NULL;
+	nr_entries = entries_alloc = table_size = 0;
+}
+
+off_t pack_size(void)
+{
+	flush_slots();
+	return pack_off;
+}
+
+int pack_discard(void)
+{
+	int rv = 0;
+
+	if (pack_out)
+		flush_slots();
+	if (pack_out && fclose(pack_out))
+		rv = error("cannot close %s: %s", pack_tmp.buf, strerror(errno));
+	pack_out = NULL;
+	if (unlink(pack_tmp.buf))
+		rv = error("cannot remove %s: %s", pack_tmp.buf, strerror(errno));
+	release_index();
+	return rv;
+}
+
+int pack_close(unsigned char pack_sha1[20])
+{
+	struct strbuf name = STRBUF_INIT;
+	int rv = -1;
+
+	if (finish_pack(pack_sha1))
+		goto out;
+	strbuf_addstr(&name, pack_dir.buf);
+	strbuf_addstr(&name, "/pack-");
+	strbuf_addstr(&name, sha1_to_hex(pack_sha1));
+	strbuf_addstr(&name, ".idx");
+	if (write_index(name.buf, pack_sha1))
+		goto out;
+	strbuf_setlen(&name, name.len - strlen("idx"));
+	strbuf_addstr(&name, "pack");
+	if (chmod(pack_tmp.buf, 0444) || rename(pack_tmp.buf, name.buf)) {
+		rv = error("cannot rename pack to %s: %s", name.buf,
+			   strerror(errno));
+		goto out;
+	}
+	rv = 0;
+out:
+	strbuf_release(&name);
+	release_index();
+	return rv;
+}
@@ -0,0 +1,55 @@
+#ifndef PACK_H_
+#define PACK_H_
+
+struct line_buffer;
+
+#define PACK_MAX_DELTA_DEPTH 50	/* git's default */
+
+enum object_type {
+	OBJ_COMMIT = 1,
+	OBJ_TREE = 2,
+	OBJ_BLOB = 3,
+	OBJ_OFS_DELTA = 6
+};
+
+/*
+ * Start writing a pack in dir, compressing at the given zlib level
+ * (-1 for zlib's default) on nr_threads threads.  Returns -1 on error.
+ */
+extern int pack_open(const char *dir, int level, int nr_threads);
+/*
+ * Write the trailer and an index, and give both their final names
+ * (pack-<sha1>.pack and .idx).  Returns -1 on error.
+ */
+extern int pack_close(unsigned char pack_sha1[20]);
+/* Remove the pack, for when it only served as a temporary store. */
+extern int pack_discard(void);
+extern off_t pack_size(void);
+
+extern void hash_object(enum object_type type, const void *buf, size_t len,
+			unsigned char sha1[20]);
+/* Reads len bytes of input; returns -1 on short read. */
+extern int hash_blob(struct line_buffer *input, off_t len,
+			unsigned char sha1[20]);
+extern int pack_has_object(const unsigned char sha1[20]);
+/* Length of the delta chain for an object, or -1 if it is not there. */
+extern int pack_delta_depth(const unsigned char sha1[20]);
+
+/* Each of these stores an object unless it is already in the pack. */
+extern void pack_write(enum object_type type, const void *buf, size_t len,
+			unsigned char sha1[20]);
+/*
+ * Copies len bytes of input, and to copy as well unless it is NULL.
+ * Returns -1 on short read.
+ */
+extern int pack_write_blob(struct line_buffer *input, off_t len,
+			unsigned char sha1[20], FILE *copy);
+/* Stores blob sha1 as git delta instructions against base. */
+extern void pack_write_blob_delta(const unsigned char base[20], off_t base_len,
+			const unsigned char sha1[20], off_t len,
+			const void *delta, size_t delta_len);
+
+/* Write the contents of a blob to out.  Returns its length or -1. */
+extern off_t pack_read_blob(const unsigned char sha1[20], FILE *out);
+
+#endif
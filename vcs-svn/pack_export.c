@@ -0,0 +1,307 @@
+/*
+ * Write revisions straight to a git pack instead of a fast-import
+ * stream.  Blobs changed by svndiff deltas are stored as git deltas
+ * against their preimage when the translation is small enough.
+ *
+ * In stream mode the pack is only a local store of blobs, so that
+ * fast_export can do without the cat-blob backchannel; blob contents
+ * are written to stdout as fast-import "data" commands, and commits
+ * are left to fast-import.
+ *
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include "strbuf.h"
+#include "memory.h"
+#include "line_buffer.h"
+#include "sliding_window.h"
+#include "svndiff.h"
+#include "repo_tree.h"
+#include "sha1.h"
+#include "pack.h"
+#include "git_tree.h"
+#include "pack_export.h"
+
+#define MAX_GITSVN_LINE_LEN 4096
+
+static struct line_buffer preimage_file = LINE_BUFFER_INIT;
+static struct line_buffer postimage = LINE_BUFFER_INIT;
+
+/* Path waiting for the blob that follows an "inline" modify. */
+static struct strbuf pending_path = STRBUF_INIT;
+static uint32_t pending_mode;
+static int have_pending;
+
+static int stream;
+
+static struct strbuf commit_tail = STRBUF_INIT_TAGGED(MEM_PACK);
+static unsigned char parent[20];
+static int have_parent;
+
+int pack_export_init(const char *dir, int stream_mode, int nr_threads)
+{
+	if (buffer_tmpfile_init(&preimage_file) ||
+	    buffer_tmpfile_init(&postimage))
+		return error("cannot open temporary file for blob retrieval");
+	/* The blob store only lives as long as the import, so favor speed. */
+	if (pack_open(dir, stream_mode ? 1 : -1, nr_threads))
+		return -1;
+	git_tree_init();
+	have_parent = 0;
+	have_pending = 0;
+	stream = stream_mode;
+	return 0;
+}
+
+void pack_export_deinit(void)
+{
+	unsigned char pack_sha1[20];
+
+	if (stream) {
+		fprintf(stderr, "Blob store: %"PRIuMAX" bytes\n",
+			(uintmax_t) pack_size());
+		pack_discard();
+	} else if (pack_close(pack_sha1)) {
+		die("cannot write pack");
+	}
+	git_tree_reset();
+	buffer_deinit(&preimage_file);
+	buffer_deinit(&postimage);
+	strbuf_release(&pending_path);
+	strbuf_release(&commit_tail);
+}
+
+static void die_short_read(struct line_buffer *input)
+{
+	if (buffer_ferror(input))
+		die_errno("error reading dump file");
+	die("invalid dump: unexpected end of file");
+}
+
+static void parse_dataref(const char *dataref, unsigned char sha1[20])
+{
+	if (get_sha1_hex(dataref, sha1) || dataref[40])
+		die("BUG: not an object name: %s", dataref);
+}
+
+static void set_pending(const unsigned char sha1[20])
+{
+	if (!have_pending)
+		die("BUG: blob data without a path");
+	git_tree_set(pending_path.buf, pending_mode, sha1);
+	have_pending = 0;
+}
+
+void pack_export_delete(const char *path)
+{
+	git_tree_remove(path);
+}
+
+void pack_export_modify(const char *path, uint32_t mode, const char *dataref)
+{
+	unsigned char sha1[20];
+
+	if (dataref && !strcmp(dataref, "inline")) {
+		strbuf_reset(&pending_path);
+		strbuf_addstr(&pending_path, path);
+		pending_mode = mode;
+		have_pending = 1;
+		return;
+	}
+	if (!dataref)
+		pack_write(OBJ_BLOB, "", 0, sha1);
+	else
+		parse_dataref(dataref, sha1);
+	git_tree_set(path, mode, sha1);
+}
+
+void pack_export_begin_commit(uint32_t revision, const char *author,
+			const struct strbuf *log,
+			const char *uuid, const char *url,
+			unsigned long timestamp)
+{
+	char ident[MAX_GITSVN_LINE_LEN];
+	char gitsvnline[MAX_GITSVN_LINE_LEN];
+
+	git_tree_begin();
+	snprintf(ident, sizeof(ident), "%s <%s@%s> %lu +0000",
+		 *author ? author : "nobody",
+		 *author ? author : "nobody",
+		 *uuid ? uuid : "local", timestamp);
+	if (*uuid && *url)
+		snprintf(gitsvnline, sizeof(gitsvnline),
+			 "\n\ngit-svn-id: %s@%"PRIu32" %s\n",
+			 url, revision, uuid);
+	else
+		*gitsvnline = '\0';
+
+	/* fast-import uses the committer as author when there is none. */
+	strbuf_reset(&commit_tail);
+	strbuf_addstr(&commit_tail, "author ");
+	strbuf_addstr(&commit_tail, ident);
+	strbuf_addstr(&commit_tail, "\ncommitter ");
+	strbuf_addstr(&commit_tail, ident);
+	strbuf_addstr(&commit_tail, "\n\n");
+	if (log)
+		strbuf_add(&commit_tail, log->buf, log->len);
+	strbuf_addstr(&commit_tail, gitsvnline);
+}
+
+void pack_export_end_commit(uint32_t revision)
+{
+	static struct strbuf commit = STRBUF_INIT_TAGGED(MEM_PACK);
+	unsigned char tree[20];
+
+	git_tree_commit(revision, tree);
+	if (stream)
+		return;
+	strbuf_reset(&commit);
+	strbuf_addstr(&commit, "tree ");
+	strbuf_addstr(&commit, sha1_to_hex(tree));
+	strbuf_addch(&commit, '\n');
+	if (have_parent) {
+		strbuf_addstr(&commit, "parent ");
+		strbuf_addstr(&commit, sha1_to_hex(parent));
+		strbuf_addch(&commit, '\n');
+	}
+	strbuf_add(&commit, commit_tail.buf, commit_tail.len);
+	pack_write(OBJ_COMMIT, commit.buf, commit.len, parent);
+	have_parent = 1;
+	printf(":%"PRIu32" %s\n", revision, sha1_to_hex(parent));
+}
+
+void pack_export_data(uint32_t mode, off_t len, struct line_buffer *input)
+{
+	unsigned char sha1[20];
+
+	assert(len >= 0);
+	if (mode == REPO_MODE_LNK) {
+		/* svn symlink blobs start with "link " */
+		if (len < 5)
+			die("invalid dump: symlink too short for \"link\" prefix");
+		len -= 5;
+		if (buffer_skip_bytes(input, 5) != 5)
+			die_short_read(input);
+	}
+	if (stream)
+		printf("data %"PRIuMAX"\n", (uintmax_t) len);
+	if (pack_write_blob(input, len, sha1, stream ? stdout : NULL))
+		die_short_read(input);
+	if (stream)
+		fputc('\n', stdout);
+	set_pending(sha1);
+}
+
+/*
+ * A git delta is only worth storing if it is much smaller than the
+ * blob; the limit while translating keeps memory use bounded by the
+ * size of the svndiff.  An empty blob is stored whole, as git
+ * refuses a delta of less than four bytes.
+ */
+static int use_git_delta(const struct git_delta *git, off_t len)
+{
+	return git->ok && len && git->ops.len <= (uintmax_t) len / 2;
+}
+
+void pack_export_blob_delta(uint32_t mode,
+				uint32_t old_mode, const char *old_data,
+				off_t len, struct line_buffer *input)
+{
+	static struct git_delta git = {
+		STRBUF_INIT_TAGGED(MEM_DELTA_WINDOW), 0, 0
+	};
+	static struct strbuf preimage_buf = STRBUF_INIT_TAGGED(MEM_PREIMAGE);
+	struct sliding_view preimage = SLIDING_VIEW_INIT(&preimage_file, 0);
+	unsigned char base[20], sha1[20];
+	off_t preimage_len = 0;
+	off_t postimage_len;
+	FILE *out;
+
+	assert(len >= 0);
+	strbuf_swap(&preimage.buf, &preimage_buf);
+	if (old_data) {
+		parse_dataref(old_data, base);
+		out = buffer_tmpfile_rewind(&preimage_file);
+		preimage_len = pack_read_blob(base, out);
+		if (preimage_len < 0 ||
+		    buffer_tmpfile_prepare_to_read(&preimage_file) < 0)
+			die("cannot read delta preimage %s", old_data);
+		preimage.max_off = preimage_len;
+	}
+	if (old_mode == REPO_MODE_LNK) {
+		strbuf_addstr(&preimage.buf, "link ");
+		preimage.max_off += strlen("link ");
+	}
+
+	/* Git has no "link " prefix to copy from, so no deltas for links. */
+	strbuf_reset(&git.ops);
+	git.max_len = 2 * len + 1024;
+	git.ok = old_data && old_mode != REPO_MODE_LNK &&
+		mode != REPO_MODE_LNK &&
+		pack_delta_depth(base) < PACK_MAX_DELTA_DEPTH;
+
+	out = buffer_tmpfile_rewind(&postimage);
+	if (svndiff0_apply_git(input, len, &preimage, out, &git))
+		die("cannot apply delta");
+	strbuf_swap(&preimage.buf, &preimage_buf);
+	strbuf_recycle(&preimage_buf, SLIDING_VIEW_KEEP_MAX);
+	postimage_len = buffer_tmpfile_prepare_to_read(&postimage);
+	if (postimage_len < 0)
+		die("cannot read temporary file for blob retrieval");
+	if (mode == REPO_MODE_LNK) {
+		buffer_skip_bytes(&postimage, strlen("link "));
+		postimage_len -= strlen("link ");
+	}
+
+	if (!use_git_delta(&git, postimage_len)) {
+		if (stream)
+			printf("data %"PRIuMAX"\n", (uintmax_t) postimage_len);
+		if (pack_write_blob(&postimage, postimage_len, sha1,
+				    stream ? stdout : NULL))
+			die("cannot read temporary file for blob retrieval");
+	} else {
+		if (hash_blob(&postimage, postimage_len, sha1))
+			die("cannot read temporary file for blob retrieval");
+		pack_write_blob_delta(base, preimage_len, sha1, postimage_len,
+				      git.ops.buf, git.ops.len);
+		if (stream) {
+			if (buffer_tmpfile_prepare_to_read(&postimage) < 0)
+				die("cannot read temporary file for blob retrieval");
+			if (mode == REPO_MODE_LNK)
+				buffer_skip_bytes(&postimage, strlen("link "));
+			printf("data %"PRIuMAX"\n",
+			       (uintmax_t) postimage_len);
+			if (postimage_len >= LARGE_BLOB_MIN)
+				buffer_tmpfile_send_bytes(&postimage,
+							  postimage_len);
+			else
+				buffer_copy_bytes(&postimage, postimage_len);
+		}
+	}
+	if (stream)
+		fputc('\n', stdout);
+	set_pending(sha1);
+}
+
+int pack_export_ls_rev(uint32_t rev, const char *path,
+				uint32_t *mode, struct strbuf *dataref)
+{
+	unsigned char sha1[20];
+
+	if (git_tree_lookup_rev(rev, path, mode, sha1))
+		return -1;
+	strbuf_addstr(dataref, sha1_to_hex(sha1));
+	return 0;
+}
+
+int pack_export_ls(const char *path, uint32_t *mode, struct strbuf *dataref)
+{
+	unsigned char sha1[20];
+
+	if (git_tree_lookup(path, mode, sha1))
+		return -1;
+	strbuf_addstr(dataref, sha1_to_hex(sha1));
+	return 0;
+}
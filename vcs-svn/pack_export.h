@@ -0,0 +1,34 @@
+#ifndef PACK_EXPORT_H_
+#define PACK_EXPORT_H_
+
+struct strbuf;
+struct line_buffer;
+
+/*
+ * Same interface as fast_export.h, but the objects are written to a
+ * pack in dir and ":<rev> <commit>" marks are printed to stdout.
+ *
+ * With stream_mode, the pack is a temporary store of blobs and trees
+ * only, and removed at the end; blob data is printed as fast-import
+ * "data" commands.  Objects are deflated on nr_threads threads.
+ */
+int pack_export_init(const char *dir, int stream_mode, int nr_threads);
+void pack_export_deinit(void);
+
+void pack_export_delete(const char *path);
+void pack_export_modify(const char *path, uint32_t mode, const char *dataref);
+void pack_export_begin_commit(uint32_t revision, const char *author,
+			const struct strbuf *log, const char *uuid,
+			const char *url, unsigned long timestamp);
+void pack_export_end_commit(uint32_t revision);
+void pack_export_data(uint32_t mode, off_t len, struct line_buffer *input);
+void pack_export_blob_delta(uint32_t mode,
+			uint32_t old_mode, const char *old_data,
+			off_t len, struct line_buffer *input);
+
+int pack_export_ls_rev(uint32_t rev, const char *path,
+			uint32_t *mode_out, struct strbuf *dataref_out);
+int pack_export_ls(const char *path,
+			uint32_t *mode_out, struct strbuf *dataref_out);
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include <pthread.h>
+#include "metrics.h"
+#include "profile.h"
+
+#define PROFILE_TOP 10	/* nodes and revisions kept per counter */
+
+struct profile_entry {
+	uint64_t value;
+	uint32_t revision;
+	char *path;	/* NULL for a revision */
+};
+
+/* A min-heap of the PROFILE_TOP largest values offered. */
+struct profile_heap {
+	struct profile_entry entries[PROFILE_TOP];
+	size_t nr;
+};
+
+static const struct {
+	const char *title;
+	int is_ns;
+} counters[PROFILE_NR] = {
+	{ "Slowest nodes", 1 },
+	{ "Most bytes read", 0 },
+	{ "Most blob bytes written", 0 },
+	{ "Most delta instructions", 0 },
+	{ "Largest delta preimages", 0 },
+	{ "Longest backchannel waits", 1 },
+	{ "Most property bytes", 0 },
+};
+
+int profile_enabled;
+_Thread_local uint64_t profile_node[PROFILE_NR];
+
+static _Thread_local uint64_t node_start;
+static _Thread_local uint32_t node_revision;
+/* Node times so far in the revision being read. */
+static _Thread_local uint32_t revision;
+static _Thread_local uint64_t revision_ns;
+
+static pthread_mutex_t heaps_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct profile_heap nodes[PROFILE_NR];
+static struct profile_heap revisions;
+static FILE *report_out;
+
+static int entry_less(const struct profile_entry *a,
+		      const struct profile_entry *b)
+{
+	return a->value < b->value;
+}
+
+static void sift_down(struct profile_heap *h, size_t i)
+{
+	for (;;) {
+		size_t min = i, l = 2 * i + 1, r = l + 1;
+		struct profile_entry tmp;
+
+		if (l < h->nr && entry_less(&h->entries[l], &h->entries[min]))
+			min = l;
+		if (r < h->nr && entry_less(&h->entries[r], &h->entries[min]))
+			min = r;
+		if (min == i)
+			return;
+		tmp = h->entries[i];
+		h->entries[i] = h->entries[min];
+		h->entries[min] = tmp;
+		i = min;
+	}
+}
+
+static void sift_up(struct profile_heap *h, size_t i)
+{
+	while (i && entry_less(&h->entries[i], &h->entries[(i - 1) / 2])) {
+		struct profile_entry tmp = h->entries[i];
+
+		h->entries[i] = h->entries[(i - 1) / 2];
+		h->entries[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+static void offer(struct profile_heap *h, uint64_t value, uint32_t rev,
+		  const char *path)
+{
+	struct profile_entry *e;
+
+	if (!value)
+		return;
+	if (h->nr == PROFILE_TOP && value <= h->entries[0].value)
+		return;
+	if (h->nr < PROFILE_TOP) {
+		e = &h->entries[h->nr++];
+	} else {
+		e = &h->entries[0];
+		free(e->path);
+	}
+	e->value = value;
+	e->revision = rev;
+	e->path = NULL;
+	if (path) {
+		e->path = strdup(path);
+		if (!e->path)
+			die_errno("cannot keep a path to profile");
+	}
+	if (e == &h->entries[0])
+		sift_down(h, 0);
+	else
+		sift_up(h, h->nr - 1);
+}
+
+static void end_revision(void)
+{
+	if (!revision_ns)
+		return;
+	pthread_mutex_lock(&heaps_lock);
+	offer(&revisions, revision_ns, revision, NULL);
+	pthread_mutex_unlock(&heaps_lock);
+	revision_ns = 0;
+}
+
+void profile_begin_node(uint32_t rev)
+{
+	if (!profile_enabled)
+		return;
+	memset(profile_node, 0, sizeof(profile_node));
+	node_revision = rev;
+	node_start = metrics_clock_ns();
+}
+
+void profile_end_node(const char *path)
+{
+	int i;
+
+	if (!profile_enabled)
+		return;
+	profile_node[PROFILE_NS] = metrics_clock_ns() - node_start;
+	if (node_revision != revision) {
+		end_revision();
+		revision = node_revision;
+	}
+	revision_ns += profile_node[PROFILE_NS];
+	pthread_mutex_lock(&heaps_lock);
+	for (i = 0; i < PROFILE_NR; i++)
+		offer(&nodes[i], profile_node[i], node_revision, path);
+	pthread_mutex_unlock(&heaps_lock);
+}
+
+int profile_init(const char *file)
+{
+	report_out = fopen(file, "w");
+	if (!report_out)
+		return error("cannot open %s: %s", file, strerror(errno));
+	profile_enabled = 1;
+	return 0;
+}
+
+static int entry_greater(const void *a, const void *b)
+{
+	const struct profile_entry *x = a, *y = b;
+
+	return (x->value < y->value) - (x->value > y->value);
+}
+
+static void report(FILE *out, const char *title, int is_ns,
+		   struct profile_heap *h)
+{
+	size_t i;
+
+	if (!h->nr)
+		return;
+	qsort(h->entries, h->nr, sizeof(*h->entries), entry_greater);
+	fprintf(out, "%s:\n", title);
+	for (i = 0; i < h->nr; i++) {
+		const struct profile_entry *e = &h->entries[i];
+
+		if (is_ns)
+			fprintf(out, "%14.3f s", e->value / 1e9);
+		else
+			fprintf(out, "%16"PRIu64, e->value);
+		fprintf(out, "  r%-8"PRIu32" %s\n", e->revision,
+			e->path ? e->path : "");
+		free(e->path);
+	}
+	h->nr = 0;
+	fputc('\n', out);
+}
+
+void profile_finish(void)
+{
+	int i;
+
+	if (!profile_enabled)
+		return;
+	profile_enabled = 0;
+	end_revision();
+	for (i = 0; i < PROFILE_NR; i++)
+		report(report_out, counters[i].title, counters[i].is_ns,
+		       &nodes[i]);
+	report(report_out, "Slowest revisions (time in their nodes)", 1,
+	       &revisions);
+	if (fclose(report_out))
+		die_errno("cannot write profile");
+	report_out = NULL;
+}
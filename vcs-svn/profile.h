@@ -0,0 +1,39 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+/*
+ * What each node of a dump costs, for finding the few paths that
+ * make a conversion crawl: the worst nodes by each counter, and the
+ * worst revisions by time, are kept and reported at the end.  When
+ * profiling is off, each update costs one test of profile_enabled.
+ */
+
+enum profile_counter {
+	PROFILE_NS,	/* from the node's headers to its end */
+	PROFILE_BYTES_IN,	/* properties and text in the dump */
+	PROFILE_BYTES_OUT,	/* blob data written */
+	PROFILE_DELTA_INSNS,	/* svndiff instructions applied */
+	PROFILE_PREIMAGE_BYTES,
+	PROFILE_BACKCHANNEL_NS,
+	PROFILE_PROP_BYTES,	/* node property keys and values */
+	PROFILE_NR
+};
+
+extern int profile_enabled;
+/* The counters of the node being converted on this thread. */
+extern _Thread_local uint64_t profile_node[PROFILE_NR];
+
+#define profile_add(c, n) \
+	do { \
+		if (profile_enabled) \
+			profile_node[c] += (n); \
+	} while (0)
+
+void profile_begin_node(uint32_t revision);
+void profile_end_node(const char *path);
+
+/* Start profiling, to be reported in file by profile_finish(). */
+int profile_init(const char *file);
+void profile_finish(void);
+
+#endif
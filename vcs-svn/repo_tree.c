@@ -5,16 +5,17 @@
 
 #include "compat-util.h"
 #include "strbuf.h"
+#include "memory.h"
 #include "repo_tree.h"
 #include "fast_export.h"
 
-const char *repo_read_path(const char *path, uint32_t *mode_out)
+const char *repo_read_path(struct fast_export *fe, const char *path,
+			   uint32_t *mode_out, struct strbuf *buf)
 {
 	int err;
-	static struct strbuf buf = STRBUF_INIT;
 
-	strbuf_reset(&buf);
-	err = fast_export_ls(path, mode_out, &buf);
+	strbuf_reset(buf);
+	err = fast_export_ls(fe, path, mode_out, buf);
 	if (err) {
 		if (errno != ENOENT)
 			die_errno("BUG: unexpected fast_export_ls error");
@@ -22,27 +23,28 @@ const char *repo_read_path(const char *path, uint32_t *mode_out)
 		*mode_out = REPO_MODE_DIR;
 		return NULL;
 	}
-	return buf.buf;
+	return buf->buf;
 }
 
-void repo_copy(uint32_t revision, const char *src, const char *dst)
+void repo_copy(struct fast_export *fe, uint32_t revision,
+	       const char *src, const char *dst)
 {
 	int err;
 	uint32_t mode;
-	static struct strbuf data = STRBUF_INIT;
+	struct strbuf data = STRBUF_INIT_TAGGED(MEM_LOOKUP);
 
-	strbuf_reset(&data);
-	err = fast_export_ls_rev(revision, src, &mode, &data);
+	err = fast_export_ls_rev(fe, revision, src, &mode, &data);
 	if (err) {
 		if (errno != ENOENT)
 			die_errno("BUG: unexpected fast_export_ls_rev error");
-		fast_export_delete(dst);
-		return;
+		fast_export_delete(fe, dst);
+	} else {
+		fast_export_modify(fe, dst, mode, data.buf);
 	}
-	fast_export_modify(dst, mode, data.buf);
+	strbuf_release(&data);
 }
 
-void repo_delete(const char *path)
+void repo_delete(struct fast_export *fe, const char *path)
 {
-	fast_export_delete(path);
+	fast_export_delete(fe, path);
 }
@@ -2,6 +2,7 @@
 #define REPO_TREE_H_
 
 struct strbuf;
+struct fast_export;
 
 #define REPO_MODE_DIR 0040000
 #define REPO_MODE_BLB 0100644
@@ -9,10 +10,13 @@ struct strbuf;
 #define REPO_MODE_LNK 0120000
 
 uint32_t next_blob_mark(void);
-void repo_copy(uint32_t revision, const char *src, const char *dst);
+void repo_copy(struct fast_export *fe, uint32_t revision,
+	       const char *src, const char *dst);
 void repo_add(const char *path, uint32_t mode, uint32_t blob_mark);
-const char *repo_read_path(const char *path, uint32_t *mode_out);
-void repo_delete(const char *path);
+/* The dataref of path, kept in buf, or NULL for a directory. */
+const char *repo_read_path(struct fast_export *fe, const char *path,
+			   uint32_t *mode_out, struct strbuf *buf);
+void repo_delete(struct fast_export *fe, const char *path);
 void repo_commit(uint32_t revision, const char *author,
 		const struct strbuf *log, const char *uuid, const char *url,
 		long unsigned timestamp);
@@ -0,0 +1,142 @@
+/*
+ * SHA-1 as specified in FIPS 180-4.
+ *
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include "sha1.h"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(struct sha1_ctx *ctx, const unsigned char *p)
+{
+	uint32_t w[80];
+	uint32_t a, b, c, d, e;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 |
+		       (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (; i < 80; i++)
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = ctx->h[0];
+	b = ctx->h[1];
+	c = ctx->h[2];
+	d = ctx->h[3];
+	e = ctx->h[4];
+	for (i = 0; i < 80; i++) {
+		uint32_t f, k, t;
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+	ctx->h[0] += a;
+	ctx->h[1] += b;
+	ctx->h[2] += c;
+	ctx->h[3] += d;
+	ctx->h[4] += e;
+}
+
+void sha1_init(struct sha1_ctx *ctx)
+{
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xefcdab89;
+	ctx->h[2] = 0x98badcfe;
+	ctx->h[3] = 0x10325476;
+	ctx->h[4] = 0xc3d2e1f0;
+	ctx->len = 0;
+}
+
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t used = ctx->len % 64;
+
+	ctx->len += len;
+	if (used) {
+		size_t n = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->block + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha1_block(ctx, ctx->block);
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		sha1_block(ctx, p);
+	memcpy(ctx->block, p, len);
+}
+
+void sha1_final(unsigned char sha1[20], struct sha1_ctx *ctx)
+{
+	static const unsigned char pad[64] = { 0x80 };
+	unsigned char bits[8];
+	uint64_t len = ctx->len * 8;
+	int i;
+
+	for (i = 7; i >= 0; i--, len >>= 8)
+		bits[i] = len & 0xff;
+	sha1_update(ctx, pad, 1 + (119 - ctx->len % 64) % 64);
+	sha1_update(ctx, bits, 8);
+	for (i = 0; i < 20; i++)
+		sha1[i] = ctx->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+const char *sha1_to_hex(const unsigned char *sha1)
+{
+	static const char hex[] = "0123456789abcdef";
+	static char buffers[4][41];
+	static int next;
+	char *buf = buffers[next++ % 4];
+	int i;
+
+	for (i = 0; i < 20; i++) {
+		buf[2 * i] = hex[sha1[i] >> 4];
+		buf[2 * i + 1] = hex[sha1[i] & 0xf];
+	}
+	buf[40] = '\0';
+	return buf;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+int get_sha1_hex(const char *hex, unsigned char *sha1)
+{
+	int i;
+	for (i = 0; i < 20; i++) {
+		int hi = hexval(hex[2 * i]);
+		int lo = hi < 0 ? -1 : hexval(hex[2 * i + 1]);
+		if (lo < 0)
+			return -1;
+		sha1[i] = hi << 4 | lo;
+	}
+	return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef SHA1_H_
+#define SHA1_H_
+
+struct sha1_ctx {
+	uint32_t h[5];
+	uint64_t len;
+	unsigned char block[64];
+};
+
+extern void sha1_init(struct sha1_ctx *ctx);
+extern void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len);
+extern void sha1_final(unsigned char sha1[20], struct sha1_ctx *ctx);
+
+/* Returns one of a few static buffers, like git's sha1_to_hex(). */
+extern const char *sha1_to_hex(const unsigned char *sha1);
+extern int get_sha1_hex(const char *hex, unsigned char *sha1);
+
+#endif
@@ -31,6 +31,19 @@ static int read_to_fill_or_whine(struct line_buffer *file,
 	return 0;
 }
 
+/*
+ * Discard the bytes before the start of the view once they outweigh
+ * the bytes still in it, so each byte read is moved at most once on
+ * average instead of once per window it overlaps.
+ */
+static void compact_view(struct sliding_view *view)
+{
+	if (view->start < view->buf.len - view->start)
+		return;
+	strbuf_remove(&view->buf, 0, view->start);
+	view->start = 0;
+}
+
 static int check_offset_overflow(off_t offset, uintmax_t len)
 {
 	if (len > maximum_signed_value_of_type(off_t))
@@ -47,8 +60,9 @@ int move_window(struct sliding_view *view, off_t off, size_t width)
 {
 	off_t file_offset;
 	assert(view);
-	assert(view->width <= view->buf.len);
-	assert(!check_offset_overflow(view->off, view->buf.len));
+	assert(view->start <= view->buf.len);
+	assert(view->width <= view->buf.len - view->start);
+	assert(!check_offset_overflow(view->off, view->buf.len - view->start));
 
 	if (check_offset_overflow(off, width))
 		return -1;
@@ -57,20 +71,23 @@ int move_window(struct sliding_view *view, off_t off, size_t width)
 	if (view->max_off >= 0 && view->max_off < off + (off_t) width)
 		return error("delta preimage ends early");
 
-	file_offset = view->off + view->buf.len;
+	file_offset = view->off + view->buf.len - view->start;
 	if (off < file_offset) {
-		/* Move the overlapping region into place. */
-		strbuf_remove(&view->buf, 0, off - view->off);
+		/* Keep the overlapping region where it is. */
+		view->start += off - view->off;
+		compact_view(view);
 	} else {
 		/* Seek ahead to skip the gap. */
 		if (skip_or_whine(view->file, off - file_offset))
 			return -1;
 		strbuf_setlen(&view->buf, 0);
+		view->start = 0;
 	}
 
-	if (view->buf.len > width)
+	if (view->buf.len - view->start > width)
 		; /* Already read. */
-	else if (read_to_fill_or_whine(view->file, &view->buf, width))
+	else if (read_to_fill_or_whine(view->file, &view->buf,
+					view->start + width))
 		return -1;
 
 	view->off = off;
@@ -2,6 +2,7 @@
 #define SLIDING_WINDOW_H_
 
 #include "strbuf.h"
+#include "memory.h"
 
 struct sliding_view {
 	struct line_buffer *file;
@@ -9,9 +10,22 @@ struct sliding_view {
 	size_t width;
 	off_t max_off;	/* -1 means unlimited */
 	struct strbuf buf;
+	size_t start;	/* the view begins at buf.buf + start */
 };
 
-#define SLIDING_VIEW_INIT(input, len)	{ (input), 0, 0, (len), STRBUF_INIT }
+#define SLIDING_VIEW_INIT(input, len)	{ (input), 0, 0, (len), \
+					STRBUF_INIT_TAGGED(MEM_PREIMAGE), 0 }
+
+/*
+ * Views are short-lived, but their buffers can be handed on to the
+ * next one (see strbuf_recycle) if they are not too big.
+ */
+#define SLIDING_VIEW_KEEP_MAX	(16 * 1024 * 1024)
+
+static inline const char *sliding_view_data(const struct sliding_view *view)
+{
+	return view->buf.buf + view->start;
+}
 
 extern int move_window(struct sliding_view *view, off_t off, size_t width);
 
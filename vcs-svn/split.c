@@ -0,0 +1,367 @@
+/*
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#define _GNU_SOURCE	/* fopencookie */
+#include "compat-util.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "strbuf.h"
+#include "memory.h"
+#include "split.h"
+
+/* Past this much pending output, wait for that importer. */
+#define SPLIT_PENDING_MAX	(64 * 1024 * 1024)
+#define SPLIT_STDIO_BUFFER	(64 * 1024)
+
+static struct split_stream *streams;
+static size_t nr_streams;
+static struct pollfd *pfd;
+
+int split_enabled(void)
+{
+	return nr_streams != 0;
+}
+
+size_t split_nr(void)
+{
+	return nr_streams;
+}
+
+struct split_stream *split_get(size_t i)
+{
+	return &streams[i];
+}
+
+static size_t pending_len(const struct split_stream *s)
+{
+	return s->pending.len - s->pending_off;
+}
+
+/* Hand each importer what it takes without blocking. */
+static void write_pending(void)
+{
+	size_t i;
+
+	for (i = 0; i < nr_streams; i++) {
+		struct split_stream *s = &streams[i];
+
+		while (pending_len(s)) {
+			ssize_t n = write(s->fd, s->pending.buf + s->pending_off,
+					  pending_len(s));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if (n <= 0)
+				die_errno("cannot write to the importer for %s",
+					  s->prefix.buf);
+			s->pending_off += n;
+		}
+		if (!pending_len(s)) {
+			strbuf_setlen(&s->pending, 0);
+			s->pending_off = 0;
+		} else if (s->pending_off > s->pending.len / 2) {
+			memmove(s->pending.buf, s->pending.buf + s->pending_off,
+				pending_len(s));
+			strbuf_setlen(&s->pending, pending_len(s));
+			s->pending_off = 0;
+		}
+	}
+}
+
+/*
+ * Keep writing until s has at most limit bytes pending or, with
+ * want_report, its backchannel has something to read.
+ */
+static void pump(struct split_stream *s, size_t limit, int want_report)
+{
+	for (;;) {
+		size_t i, n = 0;
+
+		write_pending();
+		if (!want_report && pending_len(s) <= limit)
+			return;
+		for (i = 0; i < nr_streams; i++) {
+			if (!pending_len(&streams[i]))
+				continue;
+			pfd[n].fd = streams[i].fd;
+			pfd[n].events = POLLOUT;
+			n++;
+		}
+		if (want_report) {
+			pfd[n].fd = fileno(s->report.infile);
+			pfd[n].events = POLLIN;
+			n++;
+		}
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("poll failed");
+		}
+		if (want_report && pfd[n - 1].revents)
+			return;
+	}
+}
+
+static ssize_t stream_write(void *cookie, const char *buf, size_t len)
+{
+	struct split_stream *s = cookie;
+
+	strbuf_add(&s->pending, buf, len);
+	if (pending_len(s) > SPLIT_PENDING_MAX)
+		pump(s, SPLIT_PENDING_MAX / 2, 0);
+	else
+		write_pending();
+	return len;
+}
+
+void split_wait_for_report(struct split_stream *s)
+{
+	fflush(s->out);
+	pump(s, 0, 1);
+}
+
+static struct split_stream *find(const char *prefix, size_t len)
+{
+	size_t lo = 0, hi = nr_streams;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const char *p = streams[mid].prefix.buf;
+		int cmp = strncmp(p, prefix, len);
+		if (!cmp && p[len])
+			cmp = 1;
+		if (!cmp)
+			return &streams[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+struct split_stream *split_lookup(const char *path, const char **rest)
+{
+	const char *p = path;
+
+	for (;;) {
+		struct split_stream *s;
+
+		p = strchrnul(p, '/');
+		s = find(path, p - path);
+		if (s) {
+			*rest = *p ? p + 1 : p;
+			return s;
+		}
+		if (!*p)
+			return NULL;
+		p++;
+	}
+}
+
+void split_below(const char *path, size_t *first, size_t *end)
+{
+	size_t len = strlen(path);
+	struct split_stream *s;
+	size_t i;
+
+	*first = *end = 0;
+	if (!len) {
+		*end = nr_streams;
+		return;
+	}
+	s = find(path, len);
+	if (s) {
+		*first = s - streams;
+		*end = *first + 1;
+		return;
+	}
+	for (i = 0; i < nr_streams; i++) {
+		const char *p = streams[i].prefix.buf;
+		if (!strncmp(p, path, len) && p[len] == '/')
+			break;
+	}
+	*first = *end = i;
+	while (*end < nr_streams &&
+	       !strncmp(streams[*end].prefix.buf, path, len) &&
+	       streams[*end].prefix.buf[len] == '/')
+		++*end;
+}
+
+uint32_t split_revision_at(const struct split_stream *s, uint32_t rev)
+{
+	size_t lo = 0, hi = s->nr_revs;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (s->revs[mid] <= rev)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? s->revs[lo - 1] : 0;
+}
+
+struct map_entry {
+	char *prefix, *output, *report;
+};
+
+static int compare_prefix(const void *a, const void *b)
+{
+	const struct map_entry *x = a, *y = b;
+	return strcmp(x->prefix, y->prefix);
+}
+
+static int parse_map(const char *file, struct map_entry **map,
+		     size_t *nr, size_t *alloc)
+{
+	struct line_buffer in = LINE_BUFFER_INIT;
+	char *line;
+	int rv = 0;
+
+	if (buffer_init(&in, file))
+		return error("cannot open %s: %s", file, strerror(errno));
+	while ((line = buffer_read_line(&in))) {
+		char *fields[3];
+		struct map_entry *e;
+		size_t len;
+		int n;
+
+		for (n = 0; n < 3; n++) {
+			line += strspn(line, " \t");
+			if (!*line || *line == '#')
+				break;
+			fields[n] = line;
+			line += strcspn(line, " \t");
+			if (*line)
+				*line++ = '\0';
+		}
+		if (!n)
+			continue;
+		line += strspn(line, " \t");
+		if (n < 3 || *line) {
+			rv = error("%s: expected \"<prefix> <output> "
+				   "<backchannel>\": %s", file, fields[0]);
+			break;
+		}
+		fields[0] += strspn(fields[0], "/");
+		len = strlen(fields[0]);
+		while (len && fields[0][len - 1] == '/')
+			fields[0][--len] = '\0';
+		ALLOC_GROW(*map, *nr + 1, *alloc);
+		e = &(*map)[(*nr)++];
+		e->prefix = strdup(fields[0]);
+		e->output = strdup(fields[1]);
+		e->report = strdup(fields[2]);
+		if (!e->prefix || !e->output || !e->report)
+			die_errno("cannot read %s", file);
+	}
+	if (!rv && buffer_ferror(&in))
+		rv = error("cannot read %s: %s", file, strerror(errno));
+	buffer_deinit(&in);
+	return rv;
+}
+
+static int open_stream(struct split_stream *s, const char *output,
+		       const char *report)
+{
+	static const cookie_io_functions_t io = { NULL, stream_write, NULL, NULL };
+	int flags;
+
+	s->fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (s->fd < 0)
+		return error("cannot open %s: %s", output, strerror(errno));
+	flags = fcntl(s->fd, F_GETFL);
+	if (flags < 0 || fcntl(s->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return error("cannot make %s non-blocking: %s", output,
+			     strerror(errno));
+	s->out = fopencookie(s, "w", io);
+	if (!s->out ||
+	    setvbuf(s->out, NULL, _IOFBF, SPLIT_STDIO_BUFFER))
+		return error("cannot set up a stream for %s", output);
+	if (buffer_init(&s->report, report))
+		return error("cannot open %s: %s", report, strerror(errno));
+	return 0;
+}
+
+int split_init(const char *file)
+{
+	struct map_entry *map = NULL;
+	size_t i, nr = 0, alloc = 0;
+	int rv;
+
+	rv = parse_map(file, &map, &nr, &alloc);
+	if (!rv && !nr)
+		rv = error("%s lists no prefixes", file);
+	if (!rv)
+		qsort(map, nr, sizeof(*map), compare_prefix);
+	for (i = 0; !rv && i < nr; i++) {
+		const char *a = map[i].prefix;
+		size_t j, len = strlen(a);
+
+		if (!len)
+			rv = error("%s: empty prefix", file);
+		/* Paths that start with a are sorted right after it. */
+		for (j = i + 1; !rv && j < nr &&
+		     !strncmp(a, map[j].prefix, len); j++) {
+			const char *b = map[j].prefix;
+			if (!b[len] || b[len] == '/')
+				rv = error("%s: prefix \"%s\" is listed twice "
+					   "or contains \"%s\"", file, a, b);
+		}
+	}
+	if (!rv) {
+		streams = calloc(nr, sizeof(*streams));
+		pfd = calloc(nr + 1, sizeof(*pfd));
+		if (!streams || !pfd)
+			die_errno("cannot allocate %"PRIuMAX" streams",
+				  (uintmax_t) nr);
+	}
+	for (i = 0; !rv && i < nr; i++) {
+		struct split_stream *s = &streams[i];
+
+		strbuf_init(&s->prefix, 0);
+		strbuf_init(&s->pending, 0);
+		strbuf_addstr(&s->prefix, map[i].prefix);
+		nr_streams++;
+		rv = open_stream(s, map[i].output, map[i].report);
+	}
+	for (i = 0; i < nr; i++) {
+		free(map[i].prefix);
+		free(map[i].output);
+		free(map[i].report);
+	}
+	free(map);
+	return rv;
+}
+
+void split_deinit(void)
+{
+	size_t i;
+
+	for (i = 0; i < nr_streams; i++)
+		fflush(streams[i].out);
+	for (i = 0; i < nr_streams; i++)
+		pump(&streams[i], 0, 0);
+	for (i = 0; i < nr_streams; i++) {
+		struct split_stream *s = &streams[i];
+
+		fclose(s->out);
+		if (close(s->fd))
+			die_errno("error closing the stream for %s",
+				  s->prefix.buf);
+		buffer_deinit(&s->report);
+		strbuf_release(&s->prefix);
+		strbuf_release(&s->pending);
+		free(s->revs);
+	}
+	free(streams);
+	free(pfd);
+	streams = NULL;
+	pfd = NULL;
+	nr_streams = 0;
+}
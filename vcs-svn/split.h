@@ -0,0 +1,56 @@
+#ifndef SPLIT_H_
+#define SPLIT_H_
+
+#include "strbuf.h"
+#include "line_buffer.h"
+
+/*
+ * Output streams for a fan-out import: the nodes under each path
+ * prefix go to an importer of their own, with a backchannel of its
+ * own.  Writes never block on one importer while another could take
+ * data; what an importer has not taken yet is buffered.
+ */
+
+struct split_stream {
+	struct strbuf prefix;	/* "project", no trailing slash */
+	FILE *out;
+	int fd;
+	struct strbuf pending;	/* written, but not yet taken */
+	size_t pending_off;
+	struct line_buffer report;
+
+	/* Revisions with a commit in this stream, in order. */
+	uint32_t *revs;
+	size_t nr_revs, revs_alloc;
+	uint32_t revision;	/* the commit being written, or 0 */
+};
+
+/*
+ * Read lines of "<prefix> <output> <backchannel>" from file and open
+ * each output for writing, then its backchannel for reading.
+ */
+int split_init(const char *file);
+/* Write out what is buffered and close the streams. */
+void split_deinit(void);
+int split_enabled(void);
+
+size_t split_nr(void);
+struct split_stream *split_get(size_t i);
+/*
+ * The stream path goes to, with *rest pointing at the path within
+ * it, or NULL if path is in no stream.
+ */
+struct split_stream *split_lookup(const char *path, const char **rest);
+/*
+ * The streams whose prefix is path or below it, as a range of
+ * indices for split_get(); none if path is below a prefix.
+ */
+void split_below(const char *path, size_t *first, size_t *end);
+
+/* Flush s and wait for its importer to answer, writing to the rest. */
+void split_wait_for_report(struct split_stream *s);
+
+/* Last revision with a commit in s up to rev, or 0 if none. */
+uint32_t split_revision_at(const struct split_stream *s, uint32_t rev);
+
+#endif
@@ -6,7 +6,16 @@
 #include "compat-util.h"
 #include "sliding_window.h"
 #include "line_buffer.h"
+#include "thread_pool.h"
 #include "svndiff.h"
+#include "metrics.h"
+#include "trace.h"
+#include "profile.h"
+#include "memory.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
  * svndiff0 applier
@@ -44,14 +53,46 @@
 #define VLI_DIGIT_MASK	0x7f
 #define VLI_BITS_PER_DIGIT 7
 
+/*
+ * Windows are applied on a thread pool when the whole preimage fits
+ * in memory, since then each one only depends on its own source view.
+ */
+#define PARALLEL_PREIMAGE_MAX	(256 * 1024 * 1024)
+#define WINDOWS_PER_THREAD	4
+
+static int nr_threads = 1;
+static struct thread_pool window_pool;
+
 struct window {
-	struct sliding_view *in;
+	const char *in;	/* source view */
+	size_t in_len;
+	off_t in_off;	/* offset of the source view in the preimage */
+	size_t out_len;
 	struct strbuf out;
 	struct strbuf instructions;
 	struct strbuf data;
+	int rv;
+	size_t nr_insns;	/* executed, for the profile */
 };
 
-#define WINDOW_INIT(w)	{ (w), STRBUF_INIT, STRBUF_INIT, STRBUF_INIT }
+#define WINDOW_INIT(in, len, off)	{ (in), (len), (off), 0, \
+				STRBUF_INIT_TAGGED(MEM_POSTIMAGE), \
+				STRBUF_INIT_TAGGED(MEM_DELTA_WINDOW), \
+				STRBUF_INIT_TAGGED(MEM_DELTA_WINDOW), 0, 0 }
+
+/*
+ * Window buffers are reused from one window to the next, so that
+ * applying a delta in the steady state allocates nothing; one left
+ * big by an unusual window is freed instead.
+ */
+#define WINDOW_KEEP_MAX	(1024 * 1024)
+
+static void window_recycle(struct window *ctx)
+{
+	strbuf_recycle(&ctx->out, WINDOW_KEEP_MAX);
+	strbuf_recycle(&ctx->instructions, WINDOW_KEEP_MAX);
+	strbuf_recycle(&ctx->data, WINDOW_KEEP_MAX);
+}
 
 static void window_release(struct window *ctx)
 {
@@ -60,6 +101,17 @@ static void window_release(struct window *ctx)
 	strbuf_release(&ctx->data);
 }
 
+/* Buffers of each thread, for svndiff0_apply_serial(). */
+static _Thread_local struct strbuf magic_buf =
+	STRBUF_INIT_TAGGED(MEM_DELTA_WINDOW);
+static _Thread_local struct window serial_window = WINDOW_INIT(NULL, 0, 0);
+
+void svndiff0_release_thread(void)
+{
+	strbuf_release(&magic_buf);
+	window_release(&serial_window);
+}
+
 static int write_strbuf(struct strbuf *sb, FILE *out)
 {
 	if (fwrite(sb->buf, 1, sb->len, out) == sb->len)	/* Success. */
@@ -89,17 +141,11 @@ static int read_chunk(struct line_buffer *delta, off_t *delta_len,
 static int read_magic(struct line_buffer *in, off_t *len)
 {
 	static const char magic[] = {'S', 'V', 'N', '\0'};
-	struct strbuf sb = STRBUF_INIT;
 
-	if (read_chunk(in, len, &sb, sizeof(magic))) {
-		strbuf_release(&sb);
+	if (read_chunk(in, len, &magic_buf, sizeof(magic)))
 		return -1;
-	}
-	if (memcmp(sb.buf, magic, sizeof(magic))) {
-		strbuf_release(&sb);
+	if (memcmp(magic_buf.buf, magic, sizeof(magic)))
 		return error("invalid delta: unrecognized file type");
-	}
-	strbuf_release(&sb);
 	return 0;
 }
 
@@ -112,6 +158,8 @@ static int read_int(struct line_buffer *in, uintmax_t *result, off_t *len)
 		if (ch == EOF)
 			break;
 
+		if (rv > UINTMAX_MAX >> VLI_BITS_PER_DIGIT)
+			return error("invalid delta: integer too large");
 		rv <<= VLI_BITS_PER_DIGIT;
 		rv += (ch & VLI_DIGIT_MASK);
 		if (ch & VLI_CONTINUE)
@@ -124,23 +172,64 @@ static int read_int(struct line_buffer *in, uintmax_t *result, off_t *len)
 	return error_short_read(in);
 }
 
+/*
+ * Returns the last digit of the integer starting at pos, that is, the
+ * first byte without VLI_CONTINUE set, or NULL if there is none before
+ * end.  Looks at a block of bytes at a time since operands are usually
+ * packed back to back.
+ */
+static const char *find_last_digit(const char *pos, const char *end)
+{
+#if defined(__SSE2__) && defined(__GNUC__)
+	while (end - pos >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *) pos);
+		unsigned int last = ~_mm_movemask_epi8(block) & 0xffff;
+		if (last)
+			return pos + __builtin_ctz(last);
+		pos += 16;
+	}
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (end - pos >= 8) {
+		uint64_t block;
+		uint64_t last;
+		memcpy(&block, pos, sizeof(block));
+		last = ~block & UINT64_C(0x8080808080808080);
+		if (last)
+			return pos + (__builtin_ctzll(last) >> 3);
+		pos += 8;
+	}
+#endif
+	for (; pos != end; pos++)
+		if (!(*pos & VLI_CONTINUE))
+			return pos;
+	return NULL;
+}
+
 static int parse_int(const char **buf, size_t *result, const char *end)
 {
 	size_t rv = 0;
-	const char *pos;
-	for (pos = *buf; pos != end; pos++) {
-		unsigned char ch = *pos;
-
-		rv <<= VLI_BITS_PER_DIGIT;
-		rv += (ch & VLI_DIGIT_MASK);
-		if (ch & VLI_CONTINUE)
-			continue;
+	const char *pos = *buf;
+	const char *last;
 
-		*result = rv;
+	/* Most operands fit in a single digit. */
+	if (pos != end && !(*pos & VLI_CONTINUE)) {
+		*result = (unsigned char) *pos;
 		*buf = pos + 1;
 		return 0;
 	}
-	return error("invalid delta: unexpected end of instructions section");
+	last = find_last_digit(pos, end);
+	if (!last)
+		return error("invalid delta: unexpected end of instructions section");
+	for (; pos != last + 1; pos++) {
+		if (rv > SIZE_MAX >> VLI_BITS_PER_DIGIT)
+			return error("invalid delta: integer too large");
+		rv <<= VLI_BITS_PER_DIGIT;
+		rv += (*pos & VLI_DIGIT_MASK);
+	}
+	*result = rv;
+	*buf = pos;
+	return 0;
 }
 
 static int read_offset(struct line_buffer *in, off_t *result, off_t *len)
@@ -156,7 +245,7 @@ static int read_offset(struct line_buffer *in, off_t *result, off_t *len)
 
 static int read_length(struct line_buffer *in, size_t *result, off_t *len)
 {
-	uintmax_t val;
+	uintmax_t val = 0;
 	if (read_int(in, &val, len))
 		return -1;
 	if (val > SIZE_MAX)
@@ -172,9 +261,9 @@ static int copyfrom_source(struct window *ctx, const char **instructions,
 	if (parse_int(instructions, &offset, insns_end))
 		return -1;
 	if (unsigned_add_overflows(offset, nbytes) ||
-	    offset + nbytes > ctx->in->width)
+	    offset + nbytes > ctx->in_len)
 		return error("invalid delta: copies source data outside view");
-	strbuf_add(&ctx->out, ctx->in->buf.buf + offset, nbytes);
+	strbuf_add(&ctx->out, ctx->in + offset, nbytes);
 	return 0;
 }
 
@@ -246,9 +335,10 @@ static int apply_window_in_core(struct window *ctx)
 	 * Fill ctx->out.buf using data from the source, target,
 	 * and inline data views.
 	 */
+	ctx->nr_insns = 0;
 	for (instructions = ctx->instructions.buf;
 	     instructions != ctx->instructions.buf + ctx->instructions.len;
-	     )
+	     ctx->nr_insns++)
 		if (execute_one_instruction(ctx, &instructions, &data_pos))
 			return -1;
 	if (data_pos != ctx->data.len)
@@ -256,45 +346,286 @@ static int apply_window_in_core(struct window *ctx)
 	return 0;
 }
 
-static int apply_one_window(struct line_buffer *delta, off_t *delta_len,
-			    struct sliding_view *preimage, FILE *out)
+static int read_window(struct line_buffer *delta, off_t *delta_len,
+		       struct window *ctx)
 {
-	int rv = -1;
-	struct window ctx = WINDOW_INIT(preimage);
-	size_t out_len;
 	size_t instructions_len;
 	size_t data_len;
 	assert(delta_len);
 
 	/* "source view" offset and length already handled; */
-	if (read_length(delta, &out_len, delta_len) ||
+	if (read_length(delta, &ctx->out_len, delta_len) ||
 	    read_length(delta, &instructions_len, delta_len) ||
 	    read_length(delta, &data_len, delta_len) ||
-	    read_chunk(delta, delta_len, &ctx.instructions, instructions_len) ||
-	    read_chunk(delta, delta_len, &ctx.data, data_len))
-		goto error_out;
-	strbuf_grow(&ctx.out, out_len);
-	if (apply_window_in_core(&ctx))
-		goto error_out;
-	if (ctx.out.len != out_len) {
-		rv = error("invalid delta: incorrect postimage length");
-		goto error_out;
+	    read_chunk(delta, delta_len, &ctx->instructions, instructions_len) ||
+	    read_chunk(delta, delta_len, &ctx->data, data_len))
+		return -1;
+	return 0;
+}
+
+static int execute_window(struct window *ctx)
+{
+	strbuf_reset(&ctx->out);
+	strbuf_grow(&ctx->out, ctx->out_len);
+	if (apply_window_in_core(ctx))
+		return -1;
+	if (ctx->out.len != ctx->out_len)
+		return error("invalid delta: incorrect postimage length");
+	return 0;
+}
+
+/*
+ * Git delta encoding
+ *
+ * Source copies become git copy instructions against the whole
+ * preimage; everything else in a window becomes literal data, taken
+ * from the postimage.  See git's patch-delta.c.
+ */
+#define GIT_COPY_MAX	0xffffff
+#define GIT_INSERT_MAX	0x7f
+
+static void git_delta_insert(struct git_delta *git, const char *p, size_t n)
+{
+	while (n) {
+		size_t len = n < GIT_INSERT_MAX ? n : GIT_INSERT_MAX;
+		strbuf_addch(&git->ops, len);
+		strbuf_add(&git->ops, p, len);
+		p += len;
+		n -= len;
 	}
-	if (write_strbuf(&ctx.out, out))
+}
+
+static void git_delta_copy(struct git_delta *git, uintmax_t off, size_t n)
+{
+	if (off + n > 0xffffffff) {	/* offsets are 32 bits */
+		git->ok = 0;
+		return;
+	}
+	while (n) {
+		uint32_t len = n < GIT_COPY_MAX ? n : GIT_COPY_MAX;
+		unsigned char op[8];
+		int i, nr = 1;
+
+		op[0] = 0x80;
+		for (i = 0; i < 4; i++)
+			if ((off >> (8 * i)) & 0xff) {
+				op[0] |= 1 << i;
+				op[nr++] = off >> (8 * i);
+			}
+		for (i = 0; i < 3; i++)
+			if ((len >> (8 * i)) & 0xff) {
+				op[0] |= 0x10 << i;
+				op[nr++] = len >> (8 * i);
+			}
+		strbuf_add(&git->ops, op, nr);
+		off += len;
+		n -= len;
+	}
+}
+
+/* The window has been executed, so its instructions are known good. */
+static void git_delta_window(const struct window *ctx, struct git_delta *git)
+{
+	const char *insns = ctx->instructions.buf;
+	const char *insns_end = insns + ctx->instructions.len;
+	size_t out_pos = 0, literal = 0;
+
+	while (insns != insns_end && git->ok) {
+		unsigned int instruction = (unsigned char) *insns;
+		size_t nbytes, offset = 0;
+
+		parse_first_operand(&insns, &nbytes, insns_end);
+		if ((instruction & INSN_MASK) != INSN_COPYFROM_DATA)
+			parse_int(&insns, &offset, insns_end);
+		if ((instruction & INSN_MASK) == INSN_COPYFROM_SOURCE) {
+			git_delta_insert(git, ctx->out.buf + literal,
+					 out_pos - literal);
+			git_delta_copy(git, ctx->in_off + offset, nbytes);
+			literal = out_pos + nbytes;
+		}
+		out_pos += nbytes;
+	}
+	git_delta_insert(git, ctx->out.buf + literal, out_pos - literal);
+	if (git->ops.len > git->max_len)
+		git->ok = 0;
+}
+
+static int finish_window(struct window *ctx, FILE *out, struct git_delta *git)
+{
+	if (git && git->ok)
+		git_delta_window(ctx, git);
+	profile_add(PROFILE_DELTA_INSNS, ctx->nr_insns);
+	return write_strbuf(&ctx->out, out);
+}
+
+static int apply_one_window(struct line_buffer *delta, off_t *delta_len,
+			    struct sliding_view *preimage, FILE *out,
+			    struct git_delta *git)
+{
+	struct window *ctx = &serial_window;
+	int rv = -1;
+
+	ctx->in = sliding_view_data(preimage);
+	ctx->in_len = preimage->width;
+	ctx->in_off = preimage->off;
+	if (read_window(delta, delta_len, ctx) ||
+	    execute_window(ctx) ||
+	    finish_window(ctx, out, git))
 		goto error_out;
 	rv = 0;
 error_out:
-	window_release(&ctx);
+	window_recycle(ctx);
+	return rv;
+}
+
+static void execute_window_job(void *ctx)
+{
+	struct window *w = ctx;
+	uint64_t start = trace_begin();
+	w->rv = execute_window(w);
+	trace_end("window", NULL, start);
+}
+
+/*
+ * Same checks as move_window(), for a view that is already entirely
+ * in memory.
+ */
+static int check_source_view(const struct sliding_view *preimage,
+			     off_t off, size_t len, off_t *prev_off,
+			     size_t *prev_len)
+{
+	if (off > preimage->max_off ||
+	    len > (uintmax_t) (preimage->max_off - off))
+		return error("delta preimage ends early");
+	if (off < *prev_off || off + len < *prev_off + *prev_len)
+		return error("invalid delta: window slides left");
+	*prev_off = off;
+	*prev_len = len;
+	return 0;
+}
+
+/*
+ * Windows for the parallel path, kept from one delta to the next.
+ * One conversion at a time has them; the others apply their deltas
+ * window by window meanwhile.
+ */
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct window *batch;
+static size_t batch_alloc;
+
+static int alloc_batch(void)
+{
+	size_t i;
+
+	if (batch)
+		return 0;
+	batch_alloc = (size_t) nr_threads * WINDOWS_PER_THREAD;
+	batch = calloc(batch_alloc, sizeof(*batch));
+	if (!batch)
+		return error("cannot allocate delta windows: %s",
+			     strerror(errno));
+	for (i = 0; i < batch_alloc; i++) {
+		strbuf_init(&batch[i].out, 0);
+		strbuf_init(&batch[i].instructions, 0);
+		strbuf_init(&batch[i].data, 0);
+		strbuf_set_tag(&batch[i].out, MEM_POSTIMAGE);
+		strbuf_set_tag(&batch[i].instructions, MEM_DELTA_WINDOW);
+		strbuf_set_tag(&batch[i].data, MEM_DELTA_WINDOW);
+	}
+	return 0;
+}
+
+static void release_batch(void)
+{
+	size_t i;
+
+	for (i = 0; i < batch_alloc; i++)
+		window_release(&batch[i]);
+	free(batch);
+	batch = NULL;
+	batch_alloc = 0;
+}
+
+static int apply_windows_in_parallel(struct line_buffer *delta,
+			off_t delta_len, struct sliding_view *preimage,
+			FILE *postimage, struct git_delta *git)
+{
+	int rv = -1;
+	size_t i, nr = 0;
+	off_t prev_off = 0;
+	size_t prev_len = 0;
+
+	if (move_window(preimage, 0, preimage->max_off) || alloc_batch())
+		return -1;
+	while (delta_len) {
+		/* Read windows in order, then apply a batch of them at once. */
+		for (nr = 0; nr < batch_alloc && delta_len; nr++) {
+			struct window *w = &batch[nr];
+			off_t pre_off = -1;
+			size_t pre_len = 0;
+
+			if (read_offset(delta, &pre_off, &delta_len) ||
+			    read_length(delta, &pre_len, &delta_len) ||
+			    check_source_view(preimage, pre_off, pre_len,
+					      &prev_off, &prev_len) ||
+			    read_window(delta, &delta_len, w))
+				goto error_out;
+			w->in = sliding_view_data(preimage) + pre_off;
+			w->in_len = pre_len;
+			w->in_off = pre_off;
+		}
+		if (nr == 1) {
+			execute_window_job(&batch[0]);
+		} else {
+			for (i = 0; i < nr; i++)
+				thread_pool_submit(&window_pool,
+						   execute_window_job, &batch[i]);
+			thread_pool_wait(&window_pool);
+		}
+		for (i = 0; i < nr; i++)
+			if (batch[i].rv ||
+			    finish_window(&batch[i], postimage, git))
+				goto error_out;
+	}
+	rv = 0;
+error_out:
+	for (i = 0; i < batch_alloc; i++)
+		window_recycle(&batch[i]);
 	return rv;
 }
 
+void svndiff0_set_threads(int n)
+{
+	release_batch();
+	if (nr_threads > 1)
+		thread_pool_release(&window_pool);
+	nr_threads = 1;
+	if (n > 1 && !thread_pool_init(&window_pool, n)) {
+		thread_pool_on_exit(&window_pool, svndiff0_release_thread);
+		nr_threads = n;
+	}
+}
+
 int svndiff0_apply(struct line_buffer *delta, off_t delta_len,
 			struct sliding_view *preimage, FILE *postimage)
 {
-	assert(delta && preimage && postimage && delta_len >= 0);
+	return svndiff0_apply_git(delta, delta_len, preimage, postimage, NULL);
+}
 
+static int apply(struct line_buffer *delta, off_t delta_len,
+		 struct sliding_view *preimage, FILE *postimage,
+		 struct git_delta *git, int parallel)
+{
 	if (read_magic(delta, &delta_len))
 		return -1;
+	if (parallel && nr_threads > 1 && preimage->max_off >= 0 &&
+	    preimage->max_off <= PARALLEL_PREIMAGE_MAX &&
+	    !pthread_mutex_trylock(&batch_lock)) {
+		int rv = apply_windows_in_parallel(delta, delta_len,
+						   preimage, postimage, git);
+		pthread_mutex_unlock(&batch_lock);
+		return rv;
+	}
 	while (delta_len) {	/* For each window: */
 		off_t pre_off = -1;
 		size_t pre_len;
@@ -302,8 +633,36 @@ int svndiff0_apply(struct line_buffer *delta, off_t delta_len,
 		if (read_offset(delta, &pre_off, &delta_len) ||
 		    read_length(delta, &pre_len, &delta_len) ||
 		    move_window(preimage, pre_off, pre_len) ||
-		    apply_one_window(delta, &delta_len, preimage, postimage))
+		    apply_one_window(delta, &delta_len, preimage, postimage,
+				     git))
 			return -1;
 	}
 	return 0;
 }
+
+int svndiff0_apply_git(struct line_buffer *delta, off_t delta_len,
+			struct sliding_view *preimage, FILE *postimage,
+			struct git_delta *git)
+{
+	uint64_t start = metrics_start();
+	uint64_t trace_start = trace_begin();
+	int ret;
+
+	assert(delta && preimage && postimage && delta_len >= 0);
+	ret = apply(delta, delta_len, preimage, postimage, git, 1);
+	metrics_stop(METRIC_SVNDIFF_NS, start);
+	trace_end("delta", NULL, trace_start);
+	return ret;
+}
+
+int svndiff0_apply_serial(struct line_buffer *delta, off_t delta_len,
+			struct sliding_view *preimage, FILE *postimage)
+{
+	uint64_t trace_start = trace_begin();
+	int ret;
+
+	assert(delta && preimage && postimage && delta_len >= 0);
+	ret = apply(delta, delta_len, preimage, postimage, NULL, 0);
+	trace_end("delta", NULL, trace_start);
+	return ret;
+}
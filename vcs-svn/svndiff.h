@@ -1,10 +1,37 @@
 #ifndef SVNDIFF_H_
 #define SVNDIFF_H_
 
+#include "strbuf.h"
+
 struct line_buffer;
 struct sliding_view;
 
+/*
+ * The same delta as git delta instructions (without the size header)
+ * against the preimage, while they fit in max_len bytes; otherwise
+ * ok is cleared.
+ */
+struct git_delta {
+	struct strbuf ops;
+	size_t max_len;
+	int ok;
+};
+
+/* Apply windows on up to n threads when the preimage fits in memory. */
+extern void svndiff0_set_threads(int n);
+/* Free the buffers svndiff0_apply_serial() kept on this thread. */
+extern void svndiff0_release_thread(void);
 extern int svndiff0_apply(struct line_buffer *delta, off_t delta_len,
 		struct sliding_view *preimage, FILE *postimage);
+/*
+ * Like svndiff0_apply, but on the calling thread only and without
+ * updating metrics, so that several deltas can be applied at once
+ * from threads of their own.
+ */
+extern int svndiff0_apply_serial(struct line_buffer *delta, off_t delta_len,
+		struct sliding_view *preimage, FILE *postimage);
+extern int svndiff0_apply_git(struct line_buffer *delta, off_t delta_len,
+		struct sliding_view *preimage, FILE *postimage,
+		struct git_delta *git);
 
 #endif
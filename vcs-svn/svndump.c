@@ -8,14 +8,21 @@
  */
 
 #include <time.h>
-#include <ctype.h>
 
 #include "compat-util.h"
+#include <fcntl.h>
 #include "repo_tree.h"
 #include "fast_export.h"
 #include "line_buffer.h"
+#include "metrics.h"
+#include "trace.h"
+#include "profile.h"
+#include "memory.h"
 #include "strbuf.h"
 #include "mkgmtime.h"
+#include "dump_parser.h"
+#include "manifest.h"
+#include "sha1.h"
 #include "svndump.h"
 
 /*
@@ -24,81 +31,35 @@
  */
 #define constcmp(s, ref) memcmp(s, ref, sizeof(ref) - 1)
 
-#define REPORT_FILENO 3
-
-#define NODEACT_REPLACE 4
-#define NODEACT_DELETE 3
-#define NODEACT_ADD 2
-#define NODEACT_CHANGE 1
-#define NODEACT_UNKNOWN 0
-
-/* States: */
-#define DUMP_CTX 0	/* dump metadata */
-#define REV_CTX  1	/* revision metadata */
-#define NODE_CTX 2	/* node metadata */
-#define INTERNODE_CTX 3	/* between nodes */
-
 #define DATE_RFC2822_LEN 31
 
-static struct line_buffer input = LINE_BUFFER_INIT;
-
-static struct {
-	uint32_t action, srcRev, type;
-	off_t prop_length, text_length;
-	struct strbuf src, dst;
-	uint32_t text_delta, prop_delta;
-} node_ctx;
-
-static struct {
-	uint32_t revision;
-	unsigned long timestamp;
-	struct strbuf log, author;
-} rev_ctx;
-
-static struct {
-	uint32_t version;
-	struct strbuf uuid, url;
-} dump_ctx;
-
-static void reset_node_ctx(char *fname)
-{
-	node_ctx.type = 0;
-	node_ctx.action = NODEACT_UNKNOWN;
-	node_ctx.prop_length = -1;
-	node_ctx.text_length = -1;
-	strbuf_reset(&node_ctx.src);
-	node_ctx.srcRev = 0;
-	strbuf_reset(&node_ctx.dst);
-	if (fname)
-		strbuf_addstr(&node_ctx.dst, fname);
-	node_ctx.text_delta = 0;
-	node_ctx.prop_delta = 0;
-}
+/*
+ * Old text of a node with no text of its own yet, which is not
+ * looked up.  For the fast_export_* functions, NULL means empty.
+ */
+static const char *const empty_blob = "::empty::";
 
-static void reset_rev_ctx(uint32_t revision)
+static void reset_rev_ctx(struct svndump *d, uint32_t revision)
 {
-	rev_ctx.revision = revision;
-	rev_ctx.timestamp = 0;
-	strbuf_reset(&rev_ctx.log);
-	strbuf_reset(&rev_ctx.author);
+	d->rev_ctx.revision = revision;
+	d->rev_ctx.timestamp = 0;
+	d->rev_ctx.started = 0;
+	strbuf_reset(&d->rev_ctx.log);
+	strbuf_reset(&d->rev_ctx.author);
 }
 
-static void reset_dump_ctx(const char *url)
+static void reset_dump_ctx(struct svndump *d, const char *url)
 {
-	strbuf_reset(&dump_ctx.url);
+	strbuf_reset(&d->dump_ctx.url);
 	if (url)
-		strbuf_addstr(&dump_ctx.url, url);
-	dump_ctx.version = 1;
-	strbuf_reset(&dump_ctx.uuid);
+		strbuf_addstr(&d->dump_ctx.url, url);
+	strbuf_reset(&d->dump_ctx.uuid);
 }
 
-static void handle_property(const struct strbuf *key_buf,
-				struct strbuf *val,
-				uint32_t *type_set)
+static void handle_rev_property(struct svndump *d, const char *key,
+				size_t keylen, const char *val, size_t vallen)
 {
 	struct tm tm;
-	const char *key = key_buf->buf;
-	size_t keylen = key_buf->len;
 
 	switch (keylen + 1) {
 	case sizeof("svn:log"):
@@ -106,62 +67,32 @@ static void handle_property(const struct strbuf *key_buf,
 			break;
 		if (!val)
 			die("invalid dump: unsets svn:log");
-		strbuf_swap(&rev_ctx.log, val);
+		strbuf_reset(&d->rev_ctx.log);
+		strbuf_add(&d->rev_ctx.log, val, vallen);
 		break;
 	case sizeof("svn:author"):
 		if (constcmp(key, "svn:author"))
 			break;
-		if (!val)
-			strbuf_reset(&rev_ctx.author);
-		else
-			strbuf_swap(&rev_ctx.author, val);
+		strbuf_reset(&d->rev_ctx.author);
+		if (val)
+			strbuf_add(&d->rev_ctx.author, val, vallen);
 		break;
 	case sizeof("svn:date"):
 		if (constcmp(key, "svn:date"))
 			break;
 		if (!val)
 			die("invalid dump: unsets svn:date");
-		if (!strptime(val->buf, "%FT%T", &tm))
-			fprintf(stderr, "warning: " "invalid timestamp: %s", val->buf);
+		if (!strptime(val, "%FT%T", &tm))
+			fprintf(stderr, "warning: " "invalid timestamp: %s", val);
 		else
-			rev_ctx.timestamp = mkgmtime(&tm);
+			d->rev_ctx.timestamp = mkgmtime(&tm);
 		break;
-	case sizeof("svn:executable"):
-	case sizeof("svn:special"):
-		if (keylen == strlen("svn:executable") &&
-		    constcmp(key, "svn:executable"))
-			break;
-		if (keylen == strlen("svn:special") &&
-		    constcmp(key, "svn:special"))
-			break;
-		if (*type_set) {
-			if (!val)
-				return;
-			die("invalid dump: sets type twice");
-		}
-		if (!val) {
-			node_ctx.type = REPO_MODE_BLB;
-			return;
-		}
-		*type_set = 1;
-		node_ctx.type = keylen == strlen("svn:executable") ?
-				REPO_MODE_EXE :
-				REPO_MODE_LNK;
 	}
 }
 
-static void die_short_read(void)
-{
-	if (buffer_ferror(&input))
-		die_errno("error reading dump file");
-	die("invalid dump: unexpected end of file");
-}
-
-static void read_props(void)
+static void handle_node_property(struct svndump *d, const char *key,
+				 size_t keylen, const char *val)
 {
-	static struct strbuf key = STRBUF_INIT;
-	static struct strbuf val = STRBUF_INIT;
-	const char *t;
 	/*
 	 * NEEDSWORK: to support simple mode changes like
 	 *	K 11
@@ -174,343 +105,450 @@ static void read_props(void)
 	 * plain file only if not.  We should be keeping track of the
 	 * symlink and executable bits separately instead.
 	 */
-	uint32_t type_set = 0;
-	while ((t = buffer_read_line(&input)) && strcmp(t, "PROPS-END")) {
-		uint32_t len;
-		const char type = t[0];
-		int ch;
-
-		if (!type || t[1] != ' ')
-			die("invalid property line: %s\n", t);
-		len = atoi(&t[2]);
-		strbuf_reset(&val);
-		buffer_read_binary(&input, &val, len);
-		if (val.len < len)
-			die_short_read();
-
-		/* Discard trailing newline. */
-		ch = buffer_read_char(&input);
-		if (ch == EOF)
-			die_short_read();
-		if (ch != '\n')
-			die("invalid dump: expected newline after %s", val.buf);
-
-		switch (type) {
-		case 'K':
-			strbuf_swap(&key, &val);
-			continue;
-		case 'D':
-			handle_property(&val, NULL, &type_set);
-			continue;
-		case 'V':
-			handle_property(&key, &val, &type_set);
-			strbuf_reset(&key);
-			continue;
-		default:
-			die("invalid property line: %s\n", t);
-		}
+	if (keylen == strlen("svn:executable")) {
+		if (constcmp(key, "svn:executable"))
+			return;
+	} else if (keylen == strlen("svn:special")) {
+		if (constcmp(key, "svn:special"))
+			return;
+	} else {
+		return;
+	}
+	if (d->node_ctx.type_set) {
+		if (!val)
+			return;
+		die("invalid dump: sets type twice");
 	}
+	if (!val) {
+		d->node_ctx.type = REPO_MODE_BLB;
+		return;
+	}
+	d->node_ctx.type_set = 1;
+	d->node_ctx.type = keylen == strlen("svn:executable") ?
+			REPO_MODE_EXE :
+			REPO_MODE_LNK;
 }
 
-static void handle_node(void)
+static void visit_property(void *data, const char *key, size_t keylen,
+			   const char *val, size_t vallen)
 {
-	const uint32_t type = node_ctx.type;
-	const int have_props = node_ctx.prop_length != -1;
-	const int have_text = node_ctx.text_length != -1;
-	/*
-	 * Old text for this node:
-	 *  NULL	- directory or bug
-	 *  empty_blob	- empty
-	 *  "<dataref>"	- data retrievable from fast-import
-	 */
-	static const char *const empty_blob = "::empty::";
-	const char *old_data = NULL;
-	uint32_t old_mode = REPO_MODE_BLB;
+	struct svndump *d = data;
+
+	if (d->node_ctx.active) {
+		profile_add(PROFILE_PROP_BYTES, keylen + vallen);
+		handle_node_property(d, key, keylen, val);
+	}
+	else
+		handle_rev_property(d, key, keylen, val, vallen);
+}
+
+static void begin_commit(struct svndump *d)
+{
+	d->commit_start = trace_begin();
+	d->rev_ctx.started = 1;
+	if (!d->rev_ctx.revision)	/* revision 0 gets no git commit. */
+		return;
+	if (d->manifest)
+		manifest_revision(d->manifest, d->rev_ctx.revision);
+	fast_export_begin_commit(&d->fe, d->rev_ctx.revision,
+		d->rev_ctx.author.buf, &d->rev_ctx.log, d->dump_ctx.uuid.buf,
+		d->dump_ctx.url.buf, d->rev_ctx.timestamp);
+}
+
+static uint32_t kind_mode(uint32_t kind)
+{
+	switch (kind) {
+	case NODEKIND_DIR:
+		return REPO_MODE_DIR;
+	case NODEKIND_FILE:
+		return REPO_MODE_BLB;
+	default:
+		return 0;
+	}
+}
 
-	if (node_ctx.action == NODEACT_DELETE) {
-		if (have_text || have_props || node_ctx.srcRev)
+static int visit_node(void *data, const struct dump_node *node)
+{
+	struct svndump *d = data;
+	const uint32_t type = kind_mode(node->kind);
+	const int have_props = node->prop_length != -1;
+	const int have_text = node->text_length != -1;
+	uint32_t action = node->action;
+
+	if (!d->rev_ctx.started)
+		begin_commit(d);
+	d->node_ctx.start = trace_begin();
+	profile_begin_node(d->rev_ctx.revision);
+	d->node_ctx.active = 1;
+	d->node_ctx.done = 1;
+	d->node_ctx.type = type;
+	d->node_ctx.type_set = 0;
+	d->node_ctx.old_data = NULL;
+	d->node_ctx.old_mode = REPO_MODE_BLB;
+	d->fe.blob_named = 0;
+	d->fe.blob_queued = 0;
+
+	if (action != NODEACT_UNKNOWN)
+		metrics_add(METRIC_NODES_CHANGE + action - NODEACT_CHANGE, 1);
+	profile_add(PROFILE_BYTES_IN, (have_props ? node->prop_length : 0) +
+				      (have_text ? node->text_length : 0));
+	/* Nodes outside the --split prefixes are not even parsed. */
+	if (!fast_export_exports(node->path))
+		return DUMP_SKIP_BODY;
+	if (action == NODEACT_DELETE) {
+		if (have_text || have_props || node->copyfrom_rev)
 			die("invalid dump: deletion node has "
 				"copyfrom info, text, or properties");
-		repo_delete(node_ctx.dst.buf);
-		return;
+		if (d->manifest)
+			manifest_delete(d->manifest, node->path);
+		repo_delete(&d->fe, node->path);
+		return 0;
 	}
-	if (node_ctx.action == NODEACT_REPLACE) {
-		repo_delete(node_ctx.dst.buf);
-		node_ctx.action = NODEACT_ADD;
+	if (action == NODEACT_REPLACE) {
+		if (d->manifest)
+			manifest_delete(d->manifest, node->path);
+		repo_delete(&d->fe, node->path);
+		action = NODEACT_ADD;
 	}
-	if (node_ctx.srcRev) {
-		repo_copy(node_ctx.srcRev, node_ctx.src.buf, node_ctx.dst.buf);
-		if (node_ctx.action == NODEACT_ADD)
-			node_ctx.action = NODEACT_CHANGE;
+	if (node->copyfrom_rev) {
+		repo_copy(&d->fe, node->copyfrom_rev, node->copyfrom_path,
+			  node->path);
+		if (action == NODEACT_ADD)
+			action = NODEACT_CHANGE;
 	}
 	if (have_text && type == REPO_MODE_DIR)
 		die("invalid dump: directories cannot have text attached");
 
 	/*
 	 * Find old content (old_data) and decide on the new mode.
+	 *  NULL	- directory or bug
+	 *  empty_blob	- empty
+	 *  "<dataref>"	- data retrievable from fast-import
 	 */
-	if (node_ctx.action == NODEACT_CHANGE && !*node_ctx.dst.buf) {
+	if (action == NODEACT_CHANGE && !*node->path) {
 		if (type != REPO_MODE_DIR)
 			die("invalid dump: root of tree is not a regular file");
-		old_data = NULL;
-	} else if (node_ctx.action == NODEACT_CHANGE) {
+	} else if (action == NODEACT_CHANGE) {
 		uint32_t mode;
-		old_data = repo_read_path(node_ctx.dst.buf, &mode);
+		d->node_ctx.old_data = repo_read_path(&d->fe, node->path,
+						      &mode, &d->lookup);
 		if (mode == REPO_MODE_DIR && type != REPO_MODE_DIR)
 			die("invalid dump: cannot modify a directory into a file");
 		if (mode != REPO_MODE_DIR && type == REPO_MODE_DIR)
 			die("invalid dump: cannot modify a file into a directory");
-		node_ctx.type = mode;
-		old_mode = mode;
-	} else if (node_ctx.action == NODEACT_ADD) {
-		if (type == REPO_MODE_DIR)
-			old_data = NULL;
-		else if (have_text)
-			old_data = empty_blob;
-		else
+		d->node_ctx.type = mode;
+		d->node_ctx.old_mode = mode;
+	} else if (action == NODEACT_ADD) {
+		if (type != REPO_MODE_DIR && !have_text)
 			die("invalid dump: adds node without text");
+		if (type != REPO_MODE_DIR)
+			d->node_ctx.old_data = empty_blob;
 	} else {
 		die("invalid dump: Node-path block lacks Node-action");
 	}
 
 	/*
-	 * Adjust mode to reflect properties.
+	 * The properties that follow adjust the mode.
 	 */
-	if (have_props) {
-		if (!node_ctx.prop_delta)
-			node_ctx.type = type;
-		if (node_ctx.prop_length)
-			read_props();
-	}
+	if (have_props && !node->prop_delta)
+		d->node_ctx.type = type;
+	/* directories are not tracked. */
+	d->node_ctx.done = type == REPO_MODE_DIR;
+	return 0;
+}
 
-	/*
-	 * Save the result.
-	 */
-	if (type == REPO_MODE_DIR)	/* directories are not tracked. */
-		return;
-	assert(old_data);
-	if (old_data == empty_blob)
-		/* For the fast_export_* functions, NULL means empty. */
-		old_data = NULL;
-	if (!have_text) {
-		fast_export_modify(node_ctx.dst.buf, node_ctx.type, old_data);
+static const char *old_data(struct svndump *d)
+{
+	assert(d->node_ctx.old_data);
+	if (d->node_ctx.old_data == empty_blob)
+		return NULL;
+	return d->node_ctx.old_data;
+}
+
+static void visit_text(void *data, const struct dump_node *node,
+		       struct line_buffer *input)
+{
+	struct svndump *d = data;
+
+	d->node_ctx.done = 1;
+	if (!node->text_delta) {
+		metrics_add(METRIC_FULLTEXT_BYTES, node->text_length);
+		fast_export_blob(&d->fe, node->path, d->node_ctx.type,
+				 node->text_length, input);
 		return;
 	}
-	if (!node_ctx.text_delta) {
-		fast_export_modify(node_ctx.dst.buf, node_ctx.type, "inline");
-		fast_export_data(node_ctx.type, node_ctx.text_length, &input);
+	metrics_add(METRIC_DELTA_BYTES, node->text_length);
+	fast_export_blob_delta(&d->fe, node->path, d->node_ctx.type,
+			       d->node_ctx.old_mode, old_data(d),
+			       node->text_length, input);
+}
+
+static void name_queued_blob(void *data, const char *path, uint32_t mode,
+			     const unsigned char sha1[20])
+{
+	struct svndump *d = data;
+	char checksum[48];
+
+	snprintf(checksum, sizeof(checksum), "git:%s", sha1_to_hex(sha1));
+	manifest_modify(d->manifest, mode, checksum, path);
+}
+
+/*
+ * What the node leaves at its path: its text by the checksum the dump
+ * gives, or else by the name of the blob written, or the source of its
+ * copy.  A directory changed only in its properties leaves nothing.
+ */
+static void record_node(struct svndump *d, const struct dump_node *node)
+{
+	char checksum[48];
+
+	if (node->action == NODEACT_DELETE)
 		return;
+	if (node->text_length != -1) {
+		if (!*node->text_sha1 && !*node->text_md5 &&
+		    d->fe.blob_queued) {
+			/* name_queued_blob() records it once written */
+			fast_export_name_queued(&d->fe);
+			return;
+		}
+		if (*node->text_sha1)
+			snprintf(checksum, sizeof(checksum), "sha1:%s",
+				 node->text_sha1);
+		else if (*node->text_md5)
+			snprintf(checksum, sizeof(checksum), "md5:%s",
+				 node->text_md5);
+		else if (d->fe.blob_named)
+			snprintf(checksum, sizeof(checksum), "git:%s",
+				 sha1_to_hex(d->fe.blob_name));
+		else
+			strcpy(checksum, "-");
+		manifest_modify(d->manifest, d->node_ctx.type, checksum,
+				node->path);
+	} else if (node->copyfrom_rev) {
+		manifest_copy(d->manifest, d->node_ctx.type,
+			      node->copyfrom_rev, node->copyfrom_path,
+			      node->path);
+	} else if (d->node_ctx.type != REPO_MODE_DIR) {
+		manifest_modify(d->manifest, d->node_ctx.type, "-",
+				node->path);
 	}
-	fast_export_modify(node_ctx.dst.buf, node_ctx.type, "inline");
-	fast_export_blob_delta(node_ctx.type, old_mode, old_data,
-				node_ctx.text_length, &input);
 }
 
-static void begin_revision(void)
+static void end_node(void *data, const struct dump_node *node)
 {
-	if (!rev_ctx.revision)	/* revision 0 gets no git commit. */
-		return;
-	fast_export_begin_commit(rev_ctx.revision, rev_ctx.author.buf,
-		&rev_ctx.log, dump_ctx.uuid.buf, dump_ctx.url.buf,
-		rev_ctx.timestamp);
+	struct svndump *d = data;
+
+	if (!d->node_ctx.done)
+		fast_export_modify(&d->fe, node->path, d->node_ctx.type,
+				   old_data(d));
+	if (d->manifest)
+		record_node(d, node);
+	trace_end("node", node->path, d->node_ctx.start);
+	profile_end_node(node->path);
 }
 
-static void end_revision(void)
+static void check_continuity(struct svndump *d, uint32_t revision)
 {
-	if (rev_ctx.revision)
-		fast_export_end_commit(rev_ctx.revision);
+	if (d->expected_revision && revision > d->expected_revision)
+		die("invalid dump: revisions %"PRIu32" to %"PRIu32" are missing",
+		    d->expected_revision, revision - 1);
+	if (d->expected_revision && revision < d->expected_revision)
+		die("invalid dump: revision %"PRIu32" was already imported",
+		    revision);
+	d->expected_revision = 0;
+	d->last_revision = revision;
+	d->have_revision = 1;
 }
 
-void svndump_read(const char *url)
+static void visit_uuid(void *data, const char *uuid)
 {
-	char *val;
-	char *t;
-	uint32_t active_ctx = DUMP_CTX;
-	uint32_t len;
-
-	reset_dump_ctx(url);
-	while ((t = buffer_read_line(&input))) {
-		val = strchr(t, ':');
-		if (!val)
-			continue;
-		val++;
-		if (*val != ' ')
+	struct svndump *d = data;
+
+	strbuf_reset(&d->dump_ctx.uuid);
+	strbuf_addstr(&d->dump_ctx.uuid, uuid);
+}
+
+static void begin_revision(void *data, uint32_t revision)
+{
+	struct svndump *d = data;
+
+	d->node_ctx.active = 0;
+	reset_rev_ctx(d, revision);
+	check_continuity(d, revision);
+}
+
+static void end_revision(void *data, uint32_t revision)
+{
+	struct svndump *d = data;
+
+	if (!d->rev_ctx.started)
+		begin_commit(d);
+	if (revision)
+		fast_export_end_commit(&d->fe, revision);
+	if (trace_enabled) {
+		char rev[16];
+		snprintf(rev, sizeof(rev), "r%"PRIu32, revision);
+		trace_span("commit", rev, d->commit_start);
+	}
+	metrics_add(METRIC_REVISIONS, 1);
+	metrics_tick();
+}
+
+/* The conversion to a fast-import stream, as a visitor. */
+static const struct dump_visitor converter = {
+	visit_uuid,
+	begin_revision,
+	end_revision,
+	visit_node,
+	end_node,
+	visit_property,
+	NULL,
+	visit_text,
+	NULL,
+	NULL
+};
+
+void svndump_read(struct svndump *d, const char *url)
+{
+	reset_dump_ctx(d, url);
+	dump_parser_read(&d->parser, &d->input, &converter, d);
+}
+
+struct dump_file {
+	const char *path;
+	uint32_t first_revision;
+};
+
+/* Find the first revision from the headers at the top of a dump. */
+static int read_first_revision(struct dump_file *f)
+{
+	struct line_buffer buf = LINE_BUFFER_INIT;
+	const char *t;
+	int i, rv = -1;
+
+	if (buffer_init(&buf, f->path))
+		return error("cannot open %s: %s", f->path, strerror(errno));
+	for (i = 0; i < 16 && (t = buffer_read_line(&buf)); i++) {
+		if (constcmp(t, "Revision-number: "))
 			continue;
-		val++;
-
-		/* strlen(key) + 1 */
-		switch (val - t - 1) {
-		case sizeof("SVN-fs-dump-format-version"):
-			if (constcmp(t, "SVN-fs-dump-format-version"))
-				continue;
-			dump_ctx.version = atoi(val);
-			if (dump_ctx.version > 3)
-				die("expected svn dump format version <= 3, found %"PRIu32,
-				    dump_ctx.version);
-			break;
-		case sizeof("UUID"):
-			if (constcmp(t, "UUID"))
-				continue;
-			strbuf_reset(&dump_ctx.uuid);
-			strbuf_addstr(&dump_ctx.uuid, val);
-			break;
-		case sizeof("Revision-number"):
-			if (constcmp(t, "Revision-number"))
-				continue;
-			if (active_ctx == NODE_CTX)
-				handle_node();
-			if (active_ctx == REV_CTX)
-				begin_revision();
-			if (active_ctx != DUMP_CTX)
-				end_revision();
-			active_ctx = REV_CTX;
-			reset_rev_ctx(atoi(val));
-			break;
-		case sizeof("Node-path"):
-			if (constcmp(t, "Node-"))
-				continue;
-			if (!constcmp(t + strlen("Node-"), "path")) {
-				if (active_ctx == NODE_CTX)
-					handle_node();
-				if (active_ctx == REV_CTX)
-					begin_revision();
-				active_ctx = NODE_CTX;
-				reset_node_ctx(val);
-				break;
-			}
-			if (constcmp(t + strlen("Node-"), "kind"))
-				continue;
-			if (!strcmp(val, "dir"))
-				node_ctx.type = REPO_MODE_DIR;
-			else if (!strcmp(val, "file"))
-				node_ctx.type = REPO_MODE_BLB;
-			else
-				fprintf(stderr, "Unknown node-kind: %s\n", val);
-			break;
-		case sizeof("Node-action"):
-			if (constcmp(t, "Node-action"))
-				continue;
-			if (!strcmp(val, "delete")) {
-				node_ctx.action = NODEACT_DELETE;
-			} else if (!strcmp(val, "add")) {
-				node_ctx.action = NODEACT_ADD;
-			} else if (!strcmp(val, "change")) {
-				node_ctx.action = NODEACT_CHANGE;
-			} else if (!strcmp(val, "replace")) {
-				node_ctx.action = NODEACT_REPLACE;
-			} else {
-				fprintf(stderr, "Unknown node-action: %s\n", val);
-				node_ctx.action = NODEACT_UNKNOWN;
-			}
-			break;
-		case sizeof("Node-copyfrom-path"):
-			if (constcmp(t, "Node-copyfrom-path"))
-				continue;
-			strbuf_reset(&node_ctx.src);
-			strbuf_addstr(&node_ctx.src, val);
-			break;
-		case sizeof("Node-copyfrom-rev"):
-			if (constcmp(t, "Node-copyfrom-rev"))
-				continue;
-			node_ctx.srcRev = atoi(val);
-			break;
-		case sizeof("Text-content-length"):
-			if (constcmp(t, "Text") && constcmp(t, "Prop"))
-				continue;
-			if (constcmp(t + 4, "-content-length"))
-				continue;
-			{
-				char *end;
-				uintmax_t len;
-
-				len = strtoumax(val, &end, 10);
-				if (!isdigit(*val) || *end)
-					die("invalid dump: non-numeric length %s", val);
-				if (len > maximum_signed_value_of_type(off_t))
-					die("unrepresentable length in dump: %s", val);
-
-				if (*t == 'T')
-					node_ctx.text_length = (off_t) len;
-				else
-					node_ctx.prop_length = (off_t) len;
-				break;
-			}
-		case sizeof("Text-delta"):
-			if (!constcmp(t, "Text-delta")) {
-				node_ctx.text_delta = !strcmp(val, "true");
-				break;
-			}
-			if (constcmp(t, "Prop-delta"))
-				continue;
-			node_ctx.prop_delta = !strcmp(val, "true");
-			break;
-		case sizeof("Content-length"):
-			if (constcmp(t, "Content-length"))
-				continue;
-			len = atoi(val);
-			t = buffer_read_line(&input);
-			if (!t)
-				die_short_read();
-			if (*t)
-				die("invalid dump: expected blank line after content length header");
-			if (active_ctx == REV_CTX) {
-				read_props();
-			} else if (active_ctx == NODE_CTX) {
-				handle_node();
-				active_ctx = INTERNODE_CTX;
-			} else {
-				fprintf(stderr, "Unexpected content length header: %"PRIu32"\n", len);
-				if (buffer_skip_bytes(&input, len) != len)
-					die_short_read();
-			}
-		}
+		f->first_revision = strtoul(t + strlen("Revision-number: "),
+					    NULL, 10);
+		rv = 0;
+		break;
+	}
+	if (rv)
+		rv = error("%s does not start with a revision", f->path);
+	buffer_deinit(&buf);
+	return rv;
+}
+
+static int first_revision_order(const void *a, const void *b)
+{
+	const struct dump_file *x = a, *y = b;
+	return x->first_revision < y->first_revision ? -1 :
+		x->first_revision > y->first_revision;
+}
+
+/* Open a dump and ask the kernel to start reading it in. */
+static int open_and_prefetch(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die_errno("cannot open %s", path);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	return fd;
+}
+
+void svndump_read_files(struct svndump *d, const char *const *paths,
+			size_t nr, const char *url)
+{
+	struct dump_file *files = calloc(nr, sizeof(*files));
+	int next_fd;
+	size_t i;
+
+	if (!files)
+		die("out of memory");
+	for (i = 0; i < nr; i++) {
+		files[i].path = paths[i];
+		if (read_first_revision(&files[i]))
+			exit(128);
+	}
+	qsort(files, nr, sizeof(*files), first_revision_order);
+	for (i = 1; i < nr; i++)
+		if (files[i].first_revision == files[i - 1].first_revision)
+			die("%s and %s both start at revision %"PRIu32,
+			    files[i - 1].path, files[i].path,
+			    files[i].first_revision);
+
+	next_fd = open_and_prefetch(files[0].path);
+	for (i = 0; i < nr; i++) {
+		int fd = next_fd;
+		if (i + 1 < nr)
+			next_fd = open_and_prefetch(files[i + 1].path);
+		svndump_read_fd(d, fd, url);
 	}
-	if (buffer_ferror(&input))
-		die_short_read();
-	if (active_ctx == NODE_CTX)
-		handle_node();
-	if (active_ctx == REV_CTX)
-		begin_revision();
-	if (active_ctx != DUMP_CTX)
-		end_revision();
+	free(files);
+}
+
+void svndump_read_fd(struct svndump *d, int fd, const char *url)
+{
+	if (buffer_deinit(&d->input))
+		die("error reading dump file");
+	if (buffer_fdinit(&d->input, fd))
+		die_errno("cannot read dump from file descriptor %d", fd);
+	if (d->have_revision)
+		d->expected_revision = d->last_revision + 1;
+	svndump_read(d, url);
+}
+
+static void init_field(struct strbuf *sb, int tag)
+{
+	strbuf_init(sb, 0);
+	strbuf_set_tag(sb, tag);
+	strbuf_grow(sb, 4096);
 }
 
-int svndump_init(const char *filename)
+int svndump_init(struct svndump *d, const char *filename,
+		 FILE *out, int report_fd)
 {
-	if (buffer_init(&input, filename))
+	if (buffer_init(&d->input, filename))
 		return error("cannot open %s: %s", filename, strerror(errno));
-	fast_export_init(REPORT_FILENO);
-	strbuf_init(&dump_ctx.uuid, 4096);
-	strbuf_init(&dump_ctx.url, 4096);
-	strbuf_init(&rev_ctx.log, 4096);
-	strbuf_init(&rev_ctx.author, 4096);
-	strbuf_init(&node_ctx.src, 4096);
-	strbuf_init(&node_ctx.dst, 4096);
-	reset_dump_ctx(NULL);
-	reset_rev_ctx(0);
-	reset_node_ctx(NULL);
+	d->out = out;
+	if (d->manifest)
+		fast_export_set_name_blobs(&d->fe, name_queued_blob, d);
+	fast_export_init(&d->fe, out, report_fd);
+	init_field(&d->dump_ctx.uuid, MEM_PARSER);
+	init_field(&d->dump_ctx.url, MEM_PARSER);
+	init_field(&d->rev_ctx.log, MEM_PROPS);
+	init_field(&d->rev_ctx.author, MEM_PARSER);
+	init_field(&d->lookup, MEM_LOOKUP);
+	dump_parser_init(&d->parser);
+	d->expected_revision = d->last_revision = 0;
+	d->have_revision = 0;
+	d->node_ctx.active = 0;
+	reset_dump_ctx(d, NULL);
+	reset_rev_ctx(d, 0);
 	return 0;
 }
 
-void svndump_deinit(void)
+void svndump_deinit(struct svndump *d)
 {
-	fast_export_deinit();
-	reset_dump_ctx(NULL);
-	reset_rev_ctx(0);
-	reset_node_ctx(NULL);
-	strbuf_release(&rev_ctx.log);
-	strbuf_release(&node_ctx.src);
-	strbuf_release(&node_ctx.dst);
-	if (buffer_deinit(&input))
+	fast_export_deinit(&d->fe);
+	reset_dump_ctx(d, NULL);
+	reset_rev_ctx(d, 0);
+	strbuf_release(&d->rev_ctx.log);
+	strbuf_release(&d->lookup);
+	dump_parser_deinit(&d->parser);
+	if (buffer_deinit(&d->input))
 		fprintf(stderr, "Input error\n");
-	if (ferror(stdout))
+	if (ferror(d->out))
 		fprintf(stderr, "Output error\n");
 }
 
-void svndump_reset(void)
+void svndump_reset(struct svndump *d)
 {
-	strbuf_release(&dump_ctx.uuid);
-	strbuf_release(&dump_ctx.url);
-	strbuf_release(&rev_ctx.log);
-	strbuf_release(&rev_ctx.author);
+	strbuf_release(&d->dump_ctx.uuid);
+	strbuf_release(&d->dump_ctx.url);
+	strbuf_release(&d->rev_ctx.log);
+	strbuf_release(&d->rev_ctx.author);
 }
@@ -1,9 +1,78 @@
 #ifndef SVNDUMP_H_
 #define SVNDUMP_H_
 
-int svndump_init(const char *filename);
-void svndump_read(const char *url);
-void svndump_deinit(void);
-void svndump_reset(void);
+#include "strbuf.h"
+#include "line_buffer.h"
+#include "fast_export.h"
+#include "dump_parser.h"
+
+/* The backchannel from fast-import, as svn-fe is started. */
+#define REPORT_FILENO 3
+
+/*
+ * One conversion: the dump being read, where the parser is in it,
+ * and the fast-import stream written from it.  Each conversion keeps
+ * its state here, so several can run at once on threads of their
+ * own.  Start from a zeroed struct; calls to fast_export_set_*() on
+ * fe go before svndump_init().
+ */
+struct svndump {
+	struct line_buffer input;
+	struct dump_parser parser;
+	FILE *out;
+	struct fast_export fe;
+	/* If set before svndump_init(), what is imported is recorded here. */
+	FILE *manifest;
+
+	/*
+	 * When reading a series of dumps, the first revision of each
+	 * must follow the last of the one before.  0 means anything goes.
+	 */
+	uint32_t expected_revision;
+	uint32_t last_revision;
+	int have_revision;
+
+	/* What the converter made of the node being read. */
+	struct {
+		int active;	/* properties are the node's */
+		int done;	/* nothing more to write for it */
+		uint32_t type, type_set;
+		const char *old_data;
+		uint32_t old_mode;
+		uint64_t start;	/* for tracing */
+	} node_ctx;
+
+	struct {
+		uint32_t revision;
+		unsigned long timestamp;
+		struct strbuf log, author;
+		int started;	/* the commit has been begun */
+	} rev_ctx;
+
+	struct {
+		struct strbuf uuid, url;
+	} dump_ctx;
+
+	struct strbuf lookup;	/* the old dataref of the current node */
+	uint64_t commit_start;	/* for tracing */
+};
+
+/*
+ * Read the dump from filename (stdin if NULL), write the stream to
+ * out and read fast-import's answers from report_fd.
+ */
+int svndump_init(struct svndump *d, const char *filename,
+		 FILE *out, int report_fd);
+void svndump_read(struct svndump *d, const char *url);
+/*
+ * Read dumps of consecutive revision ranges (as from svnadmin dump
+ * --incremental) in order of their first revision, as one dump.
+ */
+void svndump_read_files(struct svndump *d, const char *const *paths,
+			size_t nr, const char *url);
+/* Read the next dump of a series from fd, which is closed afterwards. */
+void svndump_read_fd(struct svndump *d, int fd, const char *url);
+void svndump_deinit(struct svndump *d);
+void svndump_reset(struct svndump *d);
 
 #endif
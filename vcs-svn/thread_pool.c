@@ -0,0 +1,143 @@
+/*
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include "thread_pool.h"
+#include <limits.h>
+#include <unistd.h>
+
+int online_cpus(void)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		return 1;
+	return ncpus > INT_MAX ? INT_MAX : (int) ncpus;
+}
+
+static void *worker(void *data)
+{
+	struct thread_pool *pool = data;
+	void (*thread_exit)(void);
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		struct thread_pool_job job;
+
+		while (!pool->nr_queued && !pool->stopping)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (!pool->nr_queued)
+			break;
+		job = pool->queue[pool->first];
+		pool->first = (pool->first + 1) % pool->queue_alloc;
+		pool->nr_queued--;
+		pool->nr_running++;
+		pthread_mutex_unlock(&pool->lock);
+
+		job.fn(job.arg);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->nr_running--;
+		if (!pool->nr_queued && !pool->nr_running)
+			pthread_cond_broadcast(&pool->done);
+	}
+	thread_exit = pool->thread_exit;
+	pthread_mutex_unlock(&pool->lock);
+	if (thread_exit)
+		thread_exit();
+	return NULL;
+}
+
+int thread_pool_init(struct thread_pool *pool, int nr_threads)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->threads = calloc(nr_threads, sizeof(*pool->threads));
+	if (!pool->threads)
+		return error("cannot allocate thread pool: %s", strerror(errno));
+	for (i = 0; i < nr_threads; i++) {
+		int err = pthread_create(&pool->threads[i], NULL, worker, pool);
+		if (err) {
+			thread_pool_release(pool);
+			return error("cannot create thread: %s", strerror(err));
+		}
+		pool->nr_threads++;
+	}
+	return 0;
+}
+
+/* Make room for one more job, keeping the queue in FIFO order. */
+static void grow_queue(struct thread_pool *pool)
+{
+	size_t old_alloc = pool->queue_alloc;
+	size_t tail;
+
+	if (pool->nr_queued < pool->queue_alloc)
+		return;
+	ALLOC_GROW(pool->queue, pool->nr_queued + 1, pool->queue_alloc);
+	if (!pool->first)
+		return;
+	/*
+	 * The queue was full.  Slide the jobs from ->first to the old end
+	 * up against the new end, so the part that wrapped around to the
+	 * start of the array stays where it is; the growth need not be
+	 * large enough to hold a copy of that part after the old end.
+	 */
+	tail = old_alloc - pool->first;
+	memmove(pool->queue + pool->queue_alloc - tail,
+		pool->queue + pool->first, tail * sizeof(*pool->queue));
+	pool->first = pool->queue_alloc - tail;
+}
+
+void thread_pool_on_exit(struct thread_pool *pool, void (*fn)(void))
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->thread_exit = fn;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_submit(struct thread_pool *pool,
+			void (*fn)(void *), void *arg)
+{
+	size_t slot;
+
+	pthread_mutex_lock(&pool->lock);
+	grow_queue(pool);
+	slot = (pool->first + pool->nr_queued) % pool->queue_alloc;
+	pool->queue[slot].fn = fn;
+	pool->queue[slot].arg = arg;
+	pool->nr_queued++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->nr_queued || pool->nr_running)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_release(struct thread_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	free(pool->queue);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,35 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <pthread.h>
+
+struct thread_pool_job {
+	void (*fn)(void *);
+	void *arg;
+};
+
+struct thread_pool {
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* signalled when a job is queued */
+	pthread_cond_t done;	/* signalled when the queue drains */
+	struct thread_pool_job *queue;
+	size_t queue_alloc, first, nr_queued;
+	size_t nr_running;
+	int stopping;
+	void (*thread_exit)(void);
+};
+
+extern int online_cpus(void);
+
+extern int thread_pool_init(struct thread_pool *pool, int nr_threads);
+/* Have each thread call fn as it stops, to free what it keeps. */
+extern void thread_pool_on_exit(struct thread_pool *pool, void (*fn)(void));
+extern void thread_pool_submit(struct thread_pool *pool,
+			void (*fn)(void *), void *arg);
+/* Block until every job submitted so far has finished. */
+extern void thread_pool_wait(struct thread_pool *pool);
+extern void thread_pool_release(struct thread_pool *pool);
+
+#endif
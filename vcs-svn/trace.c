@@ -0,0 +1,222 @@
+/*
+ * Licensed under a two-clause BSD-style license.
+ * See LICENSE for details.
+ */
+
+#include "compat-util.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "trace.h"
+
+#define RING_SIZE 16384	/* events per thread; a power of two */
+#define DETAIL_MAX 64
+#define FLUSH_INTERVAL_NS 10000000
+
+struct trace_event {
+	const char *name;
+	uint64_t begin, end;
+	char detail[DETAIL_MAX];
+};
+
+/*
+ * Only the owning thread adds to a ring (at head) and only the
+ * writer thread takes from it (at tail), so no lock is needed.
+ * Events that find the ring full are dropped and counted.
+ */
+struct trace_ring {
+	struct trace_event events[RING_SIZE];
+	atomic_size_t head, tail;
+	atomic_uint_fast64_t dropped;
+	int tid;
+	struct trace_ring *next;
+};
+
+int trace_enabled;
+
+static _Thread_local struct trace_ring *ring;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings;
+static int nr_rings;
+
+static FILE *out;
+static int first_event;
+static uint64_t start_ns;
+static pthread_t writer;
+static atomic_int stopping;
+
+uint64_t trace_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_ring *new_ring(void)
+{
+	struct trace_ring *r = calloc(1, sizeof(*r));
+	if (!r)
+		die("out of memory");
+	pthread_mutex_lock(&rings_lock);
+	r->tid = ++nr_rings;
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+	return r;
+}
+
+void trace_span(const char *name, const char *detail, uint64_t begin_ns)
+{
+	uint64_t end_ns = trace_clock_ns();
+	struct trace_event *e;
+	size_t head;
+
+	if (!ring)
+		ring = new_ring();
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire)
+	    == RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1,
+					  memory_order_relaxed);
+		return;
+	}
+	e = &ring->events[head % RING_SIZE];
+	e->name = name;
+	e->begin = begin_ns;
+	e->end = end_ns;
+	e->detail[0] = '\0';
+	if (detail) {
+		strncpy(e->detail, detail, DETAIL_MAX - 1);
+		e->detail[DETAIL_MAX - 1] = '\0';
+	}
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void write_json_string(const char *s)
+{
+	putc('"', out);
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			putc(c, out);
+	}
+	putc('"', out);
+}
+
+static void begin_event(void)
+{
+	if (!first_event)
+		fputs(",\n", out);
+	first_event = 0;
+}
+
+static void write_event(int tid, const struct trace_event *e)
+{
+	begin_event();
+	fprintf(out, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		"\"ts\":%.3f,\"dur\":%.3f", e->name, tid,
+		(e->begin - start_ns) / 1e3, (e->end - e->begin) / 1e3);
+	if (*e->detail) {
+		fputs(",\"args\":{\"detail\":", out);
+		write_json_string(e->detail);
+		putc('}', out);
+	}
+	putc('}', out);
+}
+
+static void drain(struct trace_ring *r)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	for (; tail != head; tail++) {
+		write_event(r->tid, &r->events[tail % RING_SIZE]);
+		atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	}
+}
+
+static void drain_all(void)
+{
+	struct trace_ring *r;
+
+	pthread_mutex_lock(&rings_lock);
+	for (r = rings; r; r = r->next)
+		drain(r);
+	pthread_mutex_unlock(&rings_lock);
+}
+
+static void *write_events(void *data)
+{
+	const struct timespec interval = { 0, FLUSH_INTERVAL_NS };
+
+	(void) data;
+	while (!atomic_load(&stopping)) {
+		nanosleep(&interval, NULL);
+		drain_all();
+	}
+	return NULL;
+}
+
+int trace_init(const char *file)
+{
+	int err;
+
+	out = fopen(file, "w");
+	if (!out)
+		return error("cannot open %s: %s", file, strerror(errno));
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+	first_event = 1;
+	start_ns = trace_clock_ns();
+	/* The main thread is tid 1. */
+	ring = new_ring();
+	err = pthread_create(&writer, NULL, write_events, NULL);
+	if (err)
+		return error("cannot start trace writer: %s", strerror(err));
+	trace_enabled = 1;
+	return 0;
+}
+
+static void write_thread_name(int tid)
+{
+	char name[32];
+
+	if (tid == 1)
+		strcpy(name, "main");
+	else
+		snprintf(name, sizeof(name), "worker %d", tid - 1);
+	begin_event();
+	fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":%d,\"args\":{\"name\":\"%s\"}}", tid, name);
+}
+
+void trace_finish(void)
+{
+	struct trace_ring *r, *next;
+	uint64_t dropped = 0;
+
+	if (!trace_enabled)
+		return;
+	trace_enabled = 0;
+	atomic_store(&stopping, 1);
+	pthread_join(writer, NULL);
+	drain_all();
+
+	for (r = rings; r; r = next) {
+		next = r->next;
+		write_thread_name(r->tid);
+		dropped += atomic_load(&r->dropped);
+		free(r);
+	}
+	rings = NULL;
+	ring = NULL;
+	fprintf(out, "\n],\"otherData\":{\"dropped_events\":\"%"PRIu64"\"}}\n",
+		dropped);
+	if (fclose(out))
+		die_errno("cannot write trace");
+	if (dropped)
+		fprintf(stderr, "Trace: %"PRIu64" events dropped\n", dropped);
+}
@@ -0,0 +1,32 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/*
+ * Spans written as Chrome trace events, for chrome://tracing or
+ * Perfetto.  Each thread appends to a buffer of its own without
+ * locking, and a background thread writes the buffers out.
+ */
+
+extern int trace_enabled;
+
+uint64_t trace_clock_ns(void);
+void trace_span(const char *name, const char *detail, uint64_t begin_ns);
+
+/*
+ * uint64_t start = trace_begin(); ...; trace_end("ls", path, start);
+ * name must be a string constant; detail is copied and may be NULL.
+ */
+static inline uint64_t trace_begin(void)
+{
+	return trace_enabled ? trace_clock_ns() : 0;
+}
+#define trace_end(name, detail, begin) \
+	do { \
+		if (trace_enabled) \
+			trace_span(name, detail, begin); \
+	} while (0)
+
+int trace_init(const char *file);
+void trace_finish(void);
+
+#endif